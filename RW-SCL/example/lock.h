@@ -21,6 +21,16 @@ typedef rwlock_t lock_t;
 #define lock_reader_unlock(plock) rwlock_reader_unlock(plock)
 #define lock_destroy(plock) rwlock_destroy(plock)
 
+#elif RWLOCK_SCL_PERCPU
+#include "rwlock.h"
+typedef rwlock_t lock_t;
+#define lock_init(plock) (rwlock_init(plock) ? -1 : rwlock_set_indicator(plock, RWLOCK_INDICATOR_CPU))
+#define lock_writer_lock(plock) rwlock_writer_lock(plock)
+#define lock_reader_lock(plock) rwlock_reader_lock(plock)
+#define lock_writer_unlock(plock) rwlock_writer_unlock(plock)
+#define lock_reader_unlock(plock) rwlock_reader_unlock(plock)
+#define lock_destroy(plock) rwlock_destroy(plock)
+
 #elif RWLOCK_SCL_ORIG
 #include "orig_rwlock.h"
 typedef rwlock_t lock_t;
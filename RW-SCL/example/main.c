@@ -10,12 +10,13 @@
 #include <inttypes.h>
 #define gettid() syscall(SYS_gettid)
 #include "rdtsc.h"
+#include "../../common/clock.h"
 #include "lock.h"
 
 int duration;
 
 typedef unsigned long long ull;
-typedef struct {
+typedef struct __attribute__ ((aligned (64))) {
     volatile int *stop;
     pthread_t thread;
     int priority;
@@ -27,7 +28,7 @@ typedef struct {
     ull lock_acquires;
     ull lock_hold;
     ull wait_time;
-} task_t __attribute__ ((aligned (64)));
+} task_t;
 
 lock_t lock;
 
@@ -70,9 +71,9 @@ void *read_worker(void *arg) {
     const ull delta = CYCLE_PER_US * task->cs;
     while (!*task->stop) {
 
-	temp = rdtscp();
+	temp = scl_now();
 	lock_reader_lock(&lock);
-        now = rdtscp();
+        now = scl_now();
 
 	wait_time += now - temp;
 
@@ -82,7 +83,7 @@ void *read_worker(void *arg) {
 
         do {
             loop_in_cs++;
-        } while ((now = rdtscp()) < then);
+        } while ((now = scl_now()) < then);
 
         lock_hold += now - start;
 
@@ -163,9 +164,9 @@ void *write_worker(void *arg) {
     const ull delta = CYCLE_PER_US * task->cs;
     while (!*task->stop) {
 
-	temp = rdtscp();
+	temp = scl_now();
 	lock_writer_lock(&lock);
-        now = rdtscp();
+        now = scl_now();
 
 	wait_time += now - temp;
 
@@ -175,7 +176,7 @@ void *write_worker(void *arg) {
 
         do {
             loop_in_cs++;
-        } while ((now = rdtscp()) < then);
+        } while ((now = scl_now()) < then);
 
         lock_hold += now - start;
 
@@ -222,11 +223,12 @@ int main(int argc, char *argv[]) {
         printf("usage: %s <read-threads> <write-threads> <duration> <<cs prio> <..n>> [NCPU]\n", argv[0]);
         return 1;
     }
+    scl_clock_init();
     int nthreads = atoi(argv[1]) + atoi(argv[2]);
     int r_threads = atoi(argv[1]);
     //int w_threads = atoi(argv[2]);
     duration = atoi(argv[3]);
-    task_t *tasks = malloc(sizeof(task_t) * nthreads);
+    task_t *tasks = aligned_alloc(64, sizeof(task_t) * nthreads);
     if (argc < 4+nthreads*2) {
         printf("usage: %s <nthreads> <duration> <<cs prio> <..n>> [NCPU]\n", argv[0]);
         return 1;
@@ -242,7 +244,7 @@ int main(int argc, char *argv[]) {
 
 #ifdef PTHREAD_RW
     lock_init(&lock, &attr);
-#elif RWLOCK_SCL
+#elif RWLOCK_SCL || RWLOCK_SCL_PERCPU
     lock_init(&lock);
 #elif RWLOCK_SCL_ORIG
     lock_init(&lock);
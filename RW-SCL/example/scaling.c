@@ -0,0 +1,105 @@
+/*
+ * Read scaling: run 1, 2, 4, ... reader threads, each pinned to a CPU of its
+ * own, over one lock with a near-empty critical section, and report how
+ * many read acquisitions per second they make together at each count.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include "rdtsc.h"
+#include "../../common/clock.h"
+#include "lock.h"
+
+typedef unsigned long long ull;
+typedef struct __attribute__ ((aligned (64))) {
+    volatile int *stop;
+    pthread_t thread;
+    int cpu;
+    // outputs
+    ull lock_acquires;
+} task_t;
+
+lock_t lock;
+volatile long shared;
+
+void *read_worker(void *arg) {
+    task_t *task = (task_t *) arg;
+    cpu_set_t cpuset;
+    ull lock_acquires = 0;
+
+    CPU_ZERO(&cpuset);
+    CPU_SET(task->cpu, &cpuset);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) != 0) {
+        perror("pthread_set_affinity_np");
+        exit(-1);
+    }
+
+    while (!*task->stop) {
+        lock_reader_lock(&lock);
+        (void) shared;
+        lock_reader_unlock(&lock);
+        lock_acquires++;
+    }
+    task->lock_acquires = lock_acquires;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc < 2) {
+        printf("usage: %s <duration per step (ms)> [max-threads]\n", argv[0]);
+        return 1;
+    }
+    int duration = atoi(argv[1]);
+    int max = argc > 2 ? atoi(argv[2]) : ncpu;
+    if (duration <= 0 || max <= 0) {
+        printf("usage: %s <duration per step (ms)> [max-threads]\n", argv[0]);
+        return 1;
+    }
+    task_t *tasks = aligned_alloc(64, sizeof(task_t) * max);
+
+    scl_clock_init();
+#ifdef PTHREAD_RW
+    lock_init(&lock, NULL);
+#else
+    if (lock_init(&lock) != 0) {
+        perror("lock_init");
+        return 1;
+    }
+#endif
+
+    for (int nthreads = 1; ; nthreads = nthreads * 2 < max ? nthreads * 2 : max) {
+        int stop __attribute__((aligned (64))) = 0;
+        ull total = 0;
+
+        for (int i = 0; i < nthreads; i++) {
+            tasks[i].stop = &stop;
+            tasks[i].cpu = i % ncpu;
+            tasks[i].lock_acquires = 0;
+            pthread_create(&tasks[i].thread, NULL, read_worker, &tasks[i]);
+        }
+        usleep(duration * 1000);
+        stop = 1;
+        for (int i = 0; i < nthreads; i++) {
+            pthread_join(tasks[i].thread, NULL);
+            total += tasks[i].lock_acquires;
+        }
+        printf("threads %3d "
+                "lock_acquires %10llu "
+                "acquires/s %12.0f "
+                "per thread %12.0f\n",
+                nthreads,
+                total,
+                total * 1000.0 / duration,
+                total * 1000.0 / duration / nthreads);
+        if (nthreads == max)
+            break;
+    }
+
+    lock_destroy(&lock);
+
+    return 0;
+}
@@ -47,7 +47,13 @@ static __inline__ unsigned long long rdtscp_before_fence(void)
 	return ( (unsigned long long)lo)|( ((unsigned long long)hi)<<32 );
 }
 
-unsigned long rdtscp_(int *chip, int *core)
+#endif // __RDTSC_H__
+
+// Kept apart from the guard above, which u-scl/rdtsc.h shares.
+#ifndef __RDTSCP_H__
+#define __RDTSCP_H__
+
+static __inline__ unsigned long rdtscp_(int *chip, int *core)
 {
 	unsigned a, d, c;
 
@@ -59,5 +65,4 @@ unsigned long rdtscp_(int *chip, int *core)
 	return ((unsigned long)a) | (((unsigned long)d) << 32);;
 }
 
-
-#endif // __RDTSC_H__
+#endif // __RDTSCP_H__
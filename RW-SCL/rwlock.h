@@ -1,314 +1,786 @@
+#ifndef __RWLOCK_H__
+#define __RWLOCK_H__
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include "rdtsc.h"
 #include <time.h>
 #include <stdint.h>
-#include <common.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include "common.h"
+#include "../common/stats.h"
+#include "../common/waiter.h"
+#include "../common/group.h"
+#include "../common/weight.h"
+#include "../common/topology.h"
 
 #define WA_FLAG 1
 #define RC_INC 2
 
 #define TOTAL_SLICE (CYCLE_PER_MS * 20L)
-#define READ_SLICE_SIZE (TOTAL_SLICE * lock->reader_weight / lock->total_weight)
-#define WRITE_SLICE_SIZE (TOTAL_SLICE * lock->writer_weight / lock->total_weight)
 #define INIT_SLICE_SIZE CYCLE_PER_US * 100
+#define IDLE_GRACE (CYCLE_PER_US * 100)
+#define READER_SWEEP (CYCLE_PER_MS * 1L)
 
 typedef unsigned long long ull;
 
-/* Per-NUMA-node counter */
+/*
+ * Reader indicator, one per NUMA node or per CPU (see rwlock_set_indicator()).
+ * Readers add RC_INC to the counter of the node or CPU they run on, and
+ * writers set WA_FLAG in every counter.
+ */
 typedef struct numa_counter {
 	unsigned int count;
-	char padding[60];
+	ull last_release; // when a reader last left through this counter
+	char padding[48];
 } numa_counter_t;
 
-/* Lock structure */
+enum rwlock_indicator {
+	RWLOCK_INDICATOR_NODE = 0,
+	RWLOCK_INDICATOR_CPU,
+};
+
+enum rwlock_class_id {
+	RWLOCK_READERS = 0,
+	RWLOCK_WRITERS,
+};
+
+/*
+ * The threads of one class that are in the lock. Active ones found the
+ * slice their class's and hold the lock or are about to; waiting ones
+ * sleep on seq until their class gets the slice. A class with neither
+ * gives the slice up to the other class (see rwlock_slice_wait()). Only
+ * writers count themselves in active: readers are counted by the reader
+ * indicators alone, so that they write no cache line another CPU reads
+ * on every acquisition.
+ *
+ * Every thread of the class has a weight and a ban in threads, an
+ * accounting group of the class alone (see common/group.h): its critical
+ * sections are charged there, so that within the class threads share the
+ * lock by weight as on a u-SCL, and the class's slices are sized by the
+ * summed weights of its active threads. Those bans run on the class's own
+ * time, how long it has owned the slice (rwlock_class_time()), as the
+ * threads of a class can only use the lock while it does.
+ */
+typedef struct rwlock_class {
+	unsigned int active;
+	unsigned int waiting;
+	int seq; // bumped whenever the class gets the slice
+	int watcher; // a waiting thread polls for the other class going idle
+	ull idle_since; // when the last active thread left
+	ull sweep_next; // readers: when to count the readers in the lock again
+	ull owned; // how long the class owned the slices before the current one
+	unsigned int readers; // readers: how many the last count found
+	char padding[20];
+	scl_group_t threads;
+} rwlock_class_t;
+
+/*
+ * Lock structure. The first cache line holds what every acquisition reads
+ * and only the start of a slice writes, so that readers keep it shared.
+ */
 typedef struct rwlock {
 	ull slice;
 	ull read_slice;
 	ull write_slice;
-	uint32_t reader_weight;
-	uint32_t writer_weight;
-	uint32_t total_weight;
-	char padding1[28];
-	numa_counter_t counters[NUMA_NODES];
+	numa_counter_t *counters; // ncounters reader indicators
+	scl_group_t *group; // accounting group threads are banned in, if any
+	int ncounters;
+	int indicator; // enum rwlock_indicator
+	ull slice_begin; // when the current slice started
+	char padding1[8];
+	rwlock_class_t classes[2]; // indexed by enum rwlock_class_id
+	scl_wait_policy_t waiting;
+	scl_stats_t stats;
 } rwlock_t;
 
-void rwlock_init(rwlock_t *lock) {
-	lock->slice = rdtsc() + INIT_SLICE_SIZE;
+/*
+ * The counters the calling thread's read holds went to, so that a reader
+ * that migrates to another node or CPU before unlocking decrements the
+ * counter it incremented. Read holds are mostly
+ * released in reverse order, so the search starts from the newest.
+ */
+typedef struct rwlock_read_hold {
+	rwlock_t *lock;
+	numa_counter_t *counter;
+} rwlock_read_hold_t;
+
+SCL_SHARED_TLS rwlock_read_hold_t *rwlock_holds;
+SCL_SHARED_TLS int rwlock_nholds;
+SCL_SHARED_TLS int rwlock_holds_cap;
+SCL_SHARED pthread_key_t rwlock_holds_key;
+SCL_SHARED pthread_once_t rwlock_holds_once = PTHREAD_ONCE_INIT;
+
+static void rwlock_holds_free(void *arg) {
+	free(rwlock_holds);
+	rwlock_holds = NULL;
+	rwlock_nholds = rwlock_holds_cap = 0;
+}
+
+static void rwlock_holds_key_create(void) {
+	pthread_key_create(&rwlock_holds_key, rwlock_holds_free);
+}
+
+// Make room for one more read hold. Returns 0 or ENOMEM.
+static inline int rwlock_hold_reserve(void) {
+	rwlock_read_hold_t *holds;
+	int cap;
+
+	if (__builtin_expect(rwlock_nholds < rwlock_holds_cap, 1))
+		return 0;
+	cap = rwlock_holds_cap ? rwlock_holds_cap * 2 : 8;
+	if (NULL == (holds = (rwlock_read_hold_t *) realloc(rwlock_holds, cap * sizeof(*holds))))
+		return ENOMEM;
+	if (NULL == rwlock_holds) {
+		// the key only frees the array on thread exit
+		pthread_once(&rwlock_holds_once, rwlock_holds_key_create);
+		pthread_setspecific(rwlock_holds_key, holds);
+	}
+	rwlock_holds = holds;
+	rwlock_holds_cap = cap;
+	return 0;
+}
+
+// Record a read hold; rwlock_hold_reserve() must have made room for it.
+static inline void rwlock_hold_push(rwlock_t *lock, numa_counter_t *counter) {
+	rwlock_holds[rwlock_nholds].lock = lock;
+	rwlock_holds[rwlock_nholds].counter = counter;
+	rwlock_nholds++;
+}
+
+// Forget the newest read hold of lock, returning its counter, NULL if none.
+static inline numa_counter_t *rwlock_hold_pop(rwlock_t *lock) {
+	for (int i = rwlock_nholds - 1; i >= 0; i--) {
+		if (rwlock_holds[i].lock == lock) {
+			numa_counter_t *counter = rwlock_holds[i].counter;
+			rwlock_holds[i] = rwlock_holds[--rwlock_nholds];
+			return counter;
+		}
+	}
+	return NULL;
+}
+
+// The counter of the CPU or the node the calling reader runs on.
+static inline numa_counter_t *rwlock_reader_counter(rwlock_t *lock) {
+	int chip = 0, core = 0;
+
+	rdtscp_(&chip, &core);
+	if (RWLOCK_INDICATOR_CPU == lock->indicator)
+		return &lock->counters[core % lock->ncounters];
+	return &lock->counters[scl_cpu_node(core)];
+}
+
+// Replace the reader indicators with new ones of the given kind.
+static int rwlock_counters_alloc(rwlock_t *lock, int indicator) {
+	int n = RWLOCK_INDICATOR_CPU == indicator ? scl_topology.ncpus : scl_topology.nnodes;
+	numa_counter_t *counters;
+
+	if (n < 1)
+		n = 1;
+	if (0 != posix_memalign((void **) &counters, sizeof(numa_counter_t),
+							n * sizeof(numa_counter_t)))
+		return ENOMEM;
+	memset(counters, 0, n * sizeof(numa_counter_t));
+	free(lock->counters);
+	lock->counters = counters;
+	lock->ncounters = n;
+	lock->indicator = indicator;
+	return 0;
+}
+
+// Whether the class cls owns curr_slice.
+static inline int rwlock_owns(rwlock_t *lock, int cls, ull curr_slice) {
+	if (RWLOCK_READERS == cls)
+		return readvol(lock->read_slice) == curr_slice;
+	return readvol(lock->write_slice) == curr_slice;
+}
+
+/*
+ * The time of the class cls at the tick now: how long it has owned the
+ * slice, counted until the slice passes on, as its threads may hold the
+ * lock past the end of the slice.
+ */
+static inline ull rwlock_class_time(rwlock_t *lock, int cls, ull now) {
+	ull curr_slice = readvol(lock->slice), begin = readvol(lock->slice_begin);
+	ull owned = readvol(lock->classes[cls].owned);
+
+	if (rwlock_owns(lock, cls, curr_slice) && now > begin)
+		owned += now - begin;
+	return owned;
+}
+
+static ull rwlock_reader_time(void *lock, ull now) {
+	return rwlock_class_time((rwlock_t *) lock, RWLOCK_READERS, now);
+}
+
+static ull rwlock_writer_time(void *lock, ull now) {
+	return rwlock_class_time((rwlock_t *) lock, RWLOCK_WRITERS, now);
+}
+
+/*
+ * Initialise the lock with one reader counter per NUMA node of the machine,
+ * as discovered from sysfs. Returns 0 or ENOMEM.
+ */
+SCL_API int rwlock_init(rwlock_t *lock) {
+	scl_clock_init();
+	scl_wait_init();
+	scl_topology_init();
+	lock->counters = NULL;
+	if (0 != rwlock_counters_alloc(lock, RWLOCK_INDICATOR_NODE))
+		return ENOMEM;
+	for (int i = 0; i < 2; i++) {
+		rwlock_class_t *c = &lock->classes[i];
+		c->active = c->waiting = 0;
+		c->seq = c->watcher = 0;
+		c->idle_since = 0;
+		c->sweep_next = 0;
+		c->readers = 0;
+		c->owned = 0;
+		scl_group_init(&c->threads);
+	}
+	scl_group_set_clock(&lock->classes[RWLOCK_READERS].threads, rwlock_reader_time, lock);
+	scl_group_set_clock(&lock->classes[RWLOCK_WRITERS].threads, rwlock_writer_time, lock);
+	lock->slice_begin = scl_now();
+	lock->slice = lock->slice_begin + INIT_SLICE_SIZE;
 	lock->read_slice = lock->slice;
 	lock->write_slice = 0;
-	for (int i = 0; i < NUMA_NODES; i++) {
-		lock->counters[i].count = 0;
+	scl_wait_policy_init(&lock->waiting, SCL_WAIT_ADAPTIVE);
+	lock->group = NULL;
+	scl_stats_init(&lock->stats);
+	return 0;
+}
+
+/*
+ * Choose the reader indicators, one of enum rwlock_indicator. With
+ * RWLOCK_INDICATOR_NODE, the default, readers count themselves in one
+ * counter per NUMA node, which all the readers of a node write. With
+ * RWLOCK_INDICATOR_CPU they use one counter per CPU, so that readers on
+ * different CPUs write no common cache line and read throughput scales with
+ * the cores; in exchange writers set and clear their flag in every CPU's
+ * counter, and telling whether the readers are idle takes a sweep of them.
+ * Meant for read-mostly locks on large machines, at a cache line per CPU.
+ * Call before the lock is shared. Returns 0, EINVAL or ENOMEM.
+ */
+SCL_API int rwlock_set_indicator(rwlock_t *lock, int indicator) {
+	if (RWLOCK_INDICATOR_NODE != indicator && RWLOCK_INDICATOR_CPU != indicator)
+		return EINVAL;
+	return rwlock_counters_alloc(lock, indicator);
+}
+
+/*
+ * How threads wait for the lock within their class's slice, one of enum
+ * scl_wait_strategy. Readers and writers are not woken on unlock, so
+ * SCL_WAIT_PARK waits like SCL_WAIT_BACKOFF; threads waiting for their
+ * class's slice always sleep. Call before the lock is shared.
+ */
+SCL_API void rwlock_set_wait(rwlock_t *lock, int strategy) {
+	scl_wait_policy_init(&lock->waiting, strategy);
+}
+
+/*
+ * Charge every read and write critical section to group and have threads
+ * wait out their ban in it before taking the lock (see common/group.h),
+ * instead of their ban within their class. Slices between readers and
+ * writers stay as they are. Call before the lock is shared.
+ */
+SCL_API void rwlock_set_group(rwlock_t *lock, scl_group_t *group) {
+	lock->group = group;
+}
+
+/*
+ * Set the calling thread's weight as a reader or as a writer of the lock;
+ * 0 derives it from the thread's scheduling parameters (see
+ * common/weight.h) and keeps it up to date with them, which is also what
+ * threads that never set one get. Safe while the lock is in use.
+ */
+SCL_API void rwlock_reader_set_weight(rwlock_t *lock, int weight) {
+	scl_group_thread_init(&lock->classes[RWLOCK_READERS].threads, weight);
+}
+
+SCL_API void rwlock_writer_set_weight(rwlock_t *lock, int weight) {
+	scl_group_thread_init(&lock->classes[RWLOCK_WRITERS].threads, weight);
+}
+
+/*
+ * How much longer the calling thread, whose entry in its class cls is t,
+ * is banned at now, in the time of the group that bans it: the lock's
+ * group, or else its class.
+ */
+static inline ull rwlock_banned(rwlock_t *lock, int cls, scl_group_thread_t *t, ull now) {
+	scl_group_t *group = &lock->classes[cls].threads;
+	ull time;
+
+	if (NULL != lock->group) {
+		group = lock->group;
+		t = scl_group_self(group);
 	}
-	lock->reader_weight = 0;
-	lock->writer_weight = 0;
-	lock->total_weight = 0;
+	time = scl_group_time(group, now);
+	return time < t->banned_until ? t->banned_until - time : 0;
 }
 
-/* Writer lock code */
-void rwlock_writer_lock(rwlock_t *lock) {
-	ull now = 0;
-	ull time_diff = 0;
-	ull ns = 0;
-	struct timespec time_to_sleep;
-	int tot_weight = 0;
-
-	/* 
-	 * Identify the priority of the writer thread. We assume that all the
- 	 * writers will have the same priority. Only one thread needs to identify the
- 	 * priority and set the writer-weight.
-	 */
-	if(!lock->writer_weight) {
-		int prio = getpriority(PRIO_PROCESS, 0);
-		int weight = prio_to_weight[prio+20];
-		if (__sync_bool_compare_and_swap(&lock->writer_weight, 0, weight)) {
-retry:			tot_weight = __atomic_load_n(&lock->total_weight,
-											 __ATOMIC_RELAXED);
-			if (!__sync_bool_compare_and_swap(&lock->total_weight, tot_weight,
-											  weight + tot_weight)) {
-				goto retry;
-			}
+/*
+ * Whether the bans of the class cls run at now: those in the lock's group
+ * always do, and those in the class only while it owns the slice.
+ */
+static inline int rwlock_ban_runs(rwlock_t *lock, int cls, ull now) {
+	ull curr_slice = readvol(lock->slice);
+
+	return NULL != lock->group || (now < curr_slice && rwlock_owns(lock, cls, curr_slice));
+}
+
+/*
+ * Whether a trylock by the calling thread fails for its ban. A ban that
+ * does not run holds only once the class owns the slice again, or a thread
+ * that only tries the lock would never see it run out.
+ */
+static inline int rwlock_try_banned(rwlock_t *lock, int cls, scl_group_thread_t *t, ull now) {
+	return rwlock_ban_runs(lock, cls, now) && 0 != rwlock_banned(lock, cls, t, now);
+}
+
+static ull rwlock_slice_wait(rwlock_t *lock, int cls, scl_stats_slot_t *stats);
+
+/*
+ * Wait until the calling thread's ban is over. Returns how long that took.
+ * The time of a class stands still unless it owns the slice, so while it
+ * does not, the thread waits for the slice instead. While it does, the
+ * thread counts as waiting, or the other class would take over a slice
+ * whose threads are all banned and the class's time would stop for good.
+ * Bans in the lock's group run on ticks and are simply waited out.
+ */
+static inline ull rwlock_ban_wait(rwlock_t *lock, int cls, scl_group_thread_t *t,
+								  scl_stats_slot_t *stats) {
+	ull start = scl_now(), now = start, left;
+
+	while (0 != (left = rwlock_banned(lock, cls, t, now))) {
+		if (!rwlock_ban_runs(lock, cls, now)) {
+			// counts its wait as ban time itself
+			rwlock_slice_wait(lock, cls, stats);
+			now = scl_now();
+			continue;
 		}
+		if (NULL == lock->group)
+			(void)__sync_fetch_and_add(&lock->classes[cls].waiting, 1);
+		scl_wait_until(now + left, NULL);
+		if (NULL == lock->group)
+			(void)__sync_fetch_and_sub(&lock->classes[cls].waiting, 1);
+		stats->c.ban += scl_now() - now;
+		now = scl_now();
 	}
+	return now - start;
+}
 
-	while (1) {
-		if ((readvol(lock->write_slice) == readvol(lock->slice)) &&
-		    ((now = rdtsc()) < lock->slice)) {
-			/*
-			 * If the writer is unable to acquire the lock immediately, sleep
-			 * for a while and try again. The idea is to let the owner thread
-			 * run so that ir can quickly release the lock.
-			 * TODO: Add exponential backoff instead of a fixed SPIN_CUTOFF
-			 */
-
-			// All writers need to set the counters for all NUMA nodes. 
-
-			// TODO: Make the CAS generic by looping through all NUMA-nodes.
-			while (!__sync_bool_compare_and_swap(&lock->counters[0].count, 0,
-												 WA_FLAG)) {
-				time_diff = rdtsc() - now;
-				if (time_diff > SPIN_CUTOFF) {
-					ns = CYCLE_PER_US * 100;
-					time_to_sleep.tv_sec = ns / 1000000000;
-					time_to_sleep.tv_nsec = ns % 1000000000;
-
-					nanosleep(&time_to_sleep, NULL);
-					now = rdtsc();
-				}
-			}
+// Readers in the lock, waiting for a writer to leave included.
+static inline unsigned int rwlock_readers(rwlock_t *lock) {
+	unsigned int readers = 0;
 
-			while (!__sync_bool_compare_and_swap(&lock->counters[1].count, 0,
-												 WA_FLAG)) {
-				time_diff = rdtsc() - now;
-				if (time_diff > SPIN_CUTOFF) {
-					ns = CYCLE_PER_US * 100;
-					time_to_sleep.tv_sec = ns / 1000000000;
-					time_to_sleep.tv_nsec = ns % 1000000000;
-
-					nanosleep(&time_to_sleep, NULL);
-					now = rdtsc();
-				}
-			}
+	for (int i = 0; i < lock->ncounters; i++)
+		readers += readvol(lock->counters[i].count) / RC_INC;
+	return readers;
+}
 
-			return;
-		} else {
-			// Wait until the writers owns the slice.
-			ull curr_slice = readvol(lock->slice);
-
-			now = rdtscp();
-			/* 
-			 * We know the exact time when the slice will be owned by the
-			 * writers. So, sleep until that time if the time diff is more than
-			 * SPIN_CUTOFF. Otherwise, just spin.
-			 */
-			while (now < curr_slice) {
-				time_diff = curr_slice - now;
-				if (time_diff > SPIN_CUTOFF) {
-					ns = time_diff / CYCLE_PER_US / 1000;
-					time_to_sleep.tv_sec = ns / 1000000000;
-					time_to_sleep.tv_nsec = ns % 1000000000;
-
-					nanosleep(&time_to_sleep, NULL);
-				} else {
-					//sched_yield();
-				}
-				now = rdtscp();
-			}
-			// TODO: There is still a chance that total_weight is 0
-			// leading to divide-by-zero crash.
-
-			// Turn for the writers to own the slice. If the readers do not
-			// switch the slice ownership, better do it yourself.
-			if (__sync_bool_compare_and_swap(&lock->slice, curr_slice,
-											 rdtsc() + WRITE_SLICE_SIZE)) {
-				lock->write_slice = lock->slice;
+/*
+ * Charge the critical section that ends now to the calling thread in its
+ * class, and in the lock's group if any. Readers that held the lock
+ * together share the time they held it, so each is charged its hold time
+ * over the number of readers in the lock. That number takes a sweep of the
+ * indicators, so it is recounted every READER_SWEEP by whichever reader
+ * finds it due. Called once the thread has released the lock, so that the
+ * weight refresh a charge may trigger never holds up the next owner.
+ */
+static inline void rwlock_charge(rwlock_t *lock, int cls, scl_stats_slot_t *stats, ull now) {
+	rwlock_class_t *c = &lock->classes[cls];
+	scl_group_thread_t *t = scl_group_self(&c->threads);
+	ull cs = now - stats->start, next;
+	unsigned int readers;
+
+	if (RWLOCK_READERS == cls) {
+		next = readvol(c->sweep_next);
+		if (now >= next && __sync_bool_compare_and_swap(&c->sweep_next, next, now + READER_SWEEP))
+			c->readers = rwlock_readers(lock);
+		if ((readers = readvol(c->readers)) > 1)
+			cs /= readers;
+	}
+	scl_group_charge(&c->threads, t, cs, now);
+	stats->weight = t->weight;
+	if (NULL != lock->group)
+		scl_group_charge(lock->group, scl_group_self(lock->group), now - stats->start, now);
+}
+
+/*
+ * Length of a slice of the class cls: TOTAL_SLICE split between the
+ * classes by the summed weights of their active threads. A class without
+ * any gets INIT_SLICE_SIZE, which the other class takes over once it is
+ * idle, and so do both if neither has any.
+ */
+static inline ull rwlock_slice_size(rwlock_t *lock, int cls) {
+	ull mine = __atomic_load_n(&lock->classes[cls].threads.total_weight, __ATOMIC_RELAXED);
+	ull other = __atomic_load_n(&lock->classes[!cls].threads.total_weight, __ATOMIC_RELAXED);
+
+	if (0 == mine)
+		return INIT_SLICE_SIZE;
+	return TOTAL_SLICE * mine / (mine + other);
+}
+
+/*
+ * Whether the class has had no thread waiting for or holding the lock for
+ * at least IDLE_GRACE, so that a thread that loops over the lock does not
+ * lose its class's slice between two critical sections. For the readers
+ * this sweeps the indicators.
+ */
+static inline int rwlock_class_idle(rwlock_t *lock, int cls, ull now) {
+	rwlock_class_t *c = &lock->classes[cls];
+
+	if (0 != readvol(c->waiting))
+		return 0;
+	if (RWLOCK_WRITERS == cls)
+		return 0 == readvol(c->active) && now >= readvol(c->idle_since) + IDLE_GRACE;
+	for (int i = 0; i < lock->ncounters; i++) {
+		numa_counter_t *counter = &lock->counters[i];
+		if (readvol(counter->count) >= RC_INC ||
+		    now < readvol(counter->last_release) + IDLE_GRACE)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Give the class cls a new slice in place of curr_slice and wake its
+ * threads that sleep for it. Returns 1 if this thread did, and 0 if
+ * another thread changed the slice first.
+ */
+static int rwlock_slice_start(rwlock_t *lock, int cls, ull curr_slice, ull now,
+							  scl_stats_slot_t *stats) {
+	rwlock_class_t *c = &lock->classes[cls];
+	ull slice = now + rwlock_slice_size(lock, cls);
+	int prev;
+
+	if (!__sync_bool_compare_and_swap(&lock->slice, curr_slice, slice))
+		return 0;
+	// close the class time of the slice that ends here
+	for (prev = 0; prev < 2; prev++) {
+		if (rwlock_owns(lock, prev, curr_slice)) {
+			lock->classes[prev].owned += now - lock->slice_begin;
+			break;
+		}
+	}
+	lock->slice_begin = now;
+	if (RWLOCK_READERS == cls)
+		lock->read_slice = slice;
+	else
+		lock->write_slice = slice;
+	stats->c.handoffs++;
+	(void)__sync_fetch_and_add(&c->seq, 1);
+	if (readvol(c->waiting))
+		syscall(SYS_futex, &c->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+	return 1;
+}
+
+/*
+ * Wait until the class cls owns the slice. The class gets it when the
+ * other class's slice runs out, or once the other class is idle, so that a
+ * slice does not sit unused while the lock is wanted; what was left of a
+ * slice given up that way is counted as idle slice time. One waiting
+ * thread of the class, the watcher, looks for the other class going idle
+ * at intervals that double from IDLE_GRACE; the others sleep until the
+ * slice changes hands. Returns how long the wait took, which counts as ban
+ * time.
+ */
+static ull rwlock_slice_wait(rwlock_t *lock, int cls, scl_stats_slot_t *stats) {
+	rwlock_class_t *c = &lock->classes[cls];
+	ull start = scl_now(), curr_slice, deadline, now;
+	ull interval = IDLE_GRACE;
+	int seq, watcher = 0;
+
+	(void)__sync_fetch_and_add(&c->waiting, 1);
+	while (1) {
+		// read seq first, so that a slice started from now on wakes us
+		seq = readvol(c->seq);
+		curr_slice = readvol(lock->slice);
+		now = scl_now();
+		if (now < curr_slice && rwlock_owns(lock, cls, curr_slice))
+			break;
+		// Turn for the class to own the slice. If the other class does
+		// not switch the slice ownership, better do it yourself.
+		if (now >= curr_slice) {
+			if (rwlock_slice_start(lock, cls, curr_slice, now, stats))
+				break;
+			continue;
+		}
+		if (rwlock_class_idle(lock, !cls, now)) {
+			if (rwlock_slice_start(lock, cls, curr_slice, now, stats)) {
+				stats->c.idle_slice += curr_slice - now;
+				break;
 			}
+			continue;
 		}
+		/*
+		 * We know the exact time when the slice will be owned by the
+		 * class, so sleep until then unless it changes hands earlier.
+		 */
+		deadline = curr_slice;
+		if (watcher || (watcher = __sync_bool_compare_and_swap(&c->watcher, 0, 1))) {
+			if (now + interval < deadline)
+				deadline = now + interval;
+			interval <<= 1;
+		}
+		if (ETIMEDOUT == scl_futex_wait_until(&c->seq, seq, deadline, NULL, 0))
+			scl_wait_until(deadline, NULL);
 	}
+	if (watcher)
+		c->watcher = 0;
+	(void)__sync_fetch_and_sub(&c->waiting, 1);
+	now = scl_now();
+	stats->c.ban += now - start;
+	return now - start;
 }
 
-void rwlock_reader_lock(rwlock_t *lock) {
+/*
+ * Enter the lock as an active thread of the class cls if the class owns the
+ * current slice. If it does not but the class owning it is idle, or the
+ * slice has run out, take the slice over when take_idle is set: a thread
+ * that only ever tries the lock has no rwlock_slice_wait() to start the
+ * next slice for it. Returns 1 if the thread is active.
+ */
+static inline int rwlock_class_enter(rwlock_t *lock, int cls, int take_idle,
+									 scl_stats_slot_t *stats) {
+	rwlock_class_t *c = &lock->classes[cls];
+	ull curr_slice, now;
+
+	if (RWLOCK_WRITERS == cls)
+		(void)__sync_fetch_and_add(&c->active, 1);
+	curr_slice = readvol(lock->slice);
+	now = scl_now();
+	if (now < curr_slice && rwlock_owns(lock, cls, curr_slice))
+		return 1;
+	if (take_idle && now >= curr_slice && rwlock_slice_start(lock, cls, curr_slice, now, stats))
+		return 1;
+	if (take_idle && now < curr_slice && rwlock_class_idle(lock, !cls, now) &&
+	    rwlock_slice_start(lock, cls, curr_slice, now, stats)) {
+		stats->c.idle_slice += curr_slice - now;
+		return 1;
+	}
+	if (RWLOCK_WRITERS == cls)
+		(void)__sync_fetch_and_sub(&c->active, 1);
+	return 0;
+}
+
+/*
+ * Leave the lock as an active thread of the class cls, passing the slice
+ * to the other class if it has run out.
+ */
+static inline void rwlock_class_leave(rwlock_t *lock, int cls, ull now,
+									  scl_stats_slot_t *stats) {
+	rwlock_class_t *c = &lock->classes[cls];
+	ull curr_slice = readvol(lock->slice);
+
+	// Slice has expired. So be kind and do the needful.
+	if (now > curr_slice)
+		rwlock_slice_start(lock, !cls, curr_slice, now, stats);
+	if (RWLOCK_WRITERS == cls && 1 == __sync_fetch_and_sub(&c->active, 1))
+		c->idle_since = now;
+}
+
+/* Writer lock code */
+SCL_API void rwlock_writer_lock(rwlock_t *lock) {
+	ull start = scl_now(), banned = 0;
+	scl_group_thread_t *t;
+	scl_stats_slot_t *stats;
 	ull now = 0;
-	ull time_diff = 0;
-	ull ns = 0;
-	struct timespec time_to_sleep;
-	int tot_weight = 0;
-
-	/* 
-	 * Identify the priority of the reader thread. We assume that all the
- 	 * readers will have the same priority. Only one thread needs to identify the
- 	 * priority and set the writer-weight.
+
+	t = scl_group_self(&lock->classes[RWLOCK_WRITERS].threads);
+	stats = scl_stats_self(&lock->stats, SCL_STATS_WRITER, t->weight);
+	banned += rwlock_ban_wait(lock, RWLOCK_WRITERS, t, stats);
+
+	// Wait until the writers own the slice.
+	while (!rwlock_class_enter(lock, RWLOCK_WRITERS, 0, stats))
+		banned += rwlock_slice_wait(lock, RWLOCK_WRITERS, stats);
+
+	/*
+	 * If the writer is unable to acquire the lock immediately, wait as the
+	 * lock's policy says. The idea is to let the owner thread run so that
+	 * it can quickly release the lock.
 	 */
-	if(!lock->reader_weight) {
-		int prio = getpriority(PRIO_PROCESS, 0);
-		int weight = prio_to_weight[prio+20];
-		if (__sync_bool_compare_and_swap(&lock->reader_weight, 0, weight)) {
-retry:			tot_weight = __atomic_load_n(&lock->total_weight,
-											 __ATOMIC_RELAXED);
-			if (!__sync_bool_compare_and_swap(&lock->total_weight, tot_weight,
-											  weight + tot_weight)) {
-				goto retry;
-			}
-		}
+
+	// All writers need to set the counters for all NUMA nodes.
+	for (int i = 0; i < lock->ncounters; i++) {
+		scl_wait_while(&lock->waiting, stats,
+					   !__sync_bool_compare_and_swap(&lock->counters[i].count,
+													 0, WA_FLAG));
 	}
 
-	while (1) {
-		int chip = 0, core = 0;
-		// Identify the NUMA node where the reader is acquiring the lock and
-		// appropriately set that particular NUMA counter.
-		now = rdtscp_(&chip, &core);
-		if (( readvol(lock->read_slice) == readvol(lock->slice)) &&
-		    (now < lock->slice)) {
-			// TODO: Make the core check generic.
-			if (core < 8) {
-				(void)__sync_fetch_and_add(&lock->counters[0].count, RC_INC);
-
-				/*
-				 * If the reader is unable to acquire the lock immediately,
-				 * sleep for a while and try again. The idea is to let the
-				 * owner thread run so that it can quickly release the lock.
-				 * TODO: Add exponential backoff instead of a fixed
-				 * SPIN_CUTOFF.
-				 */
-				while((readvol(lock->counters[0].count) & WA_FLAG) == 1) {
-					time_diff = rdtsc() - now;
-					if (time_diff > SPIN_CUTOFF) {
-						ns = CYCLE_PER_US * 100;
-						time_to_sleep.tv_sec = ns / 1000000000;
-						time_to_sleep.tv_nsec = ns % 1000000000;
-
-						nanosleep(&time_to_sleep, NULL);
-						now = rdtsc();
-					}
-				}
-			} else if (core < 16) {
-				(void)__sync_fetch_and_add(&lock->counters[1].count, RC_INC);
-				while((readvol(lock->counters[1].count) & WA_FLAG) == 1) {
-					time_diff = rdtsc() - now;
-					if (time_diff > SPIN_CUTOFF) {
-						ns = CYCLE_PER_US * 100;
-						time_to_sleep.tv_sec = ns / 1000000000;
-						time_to_sleep.tv_nsec = ns % 1000000000;
-
-						nanosleep(&time_to_sleep, NULL);
-						now = rdtsc();
-					}
-				}
-			}
+	now = scl_now();
+	scl_stats_wait(stats, now - start - banned);
+	scl_stats_acquired(stats, now, 0);
+}
 
-			return;
-		} else {
-			// Wait until the readers owns the slice.
-			ull curr_slice = readvol(lock->slice);
-
-			now = rdtscp();
-			/* 
-			 * We know the exact time when the slice will be owned by the
-			 * writers. So, sleep until that time if the time diff is more than
-			 * SPIN_CUTOFF. Otherwise, just spin.
-			 */
-			while (now < curr_slice) {
-				time_diff = curr_slice - now;
-				if (time_diff > SPIN_CUTOFF) {
-					ns = time_diff / CYCLE_PER_US / 1000;
-					time_to_sleep.tv_sec = ns / 1000000000;
-					time_to_sleep.tv_nsec = ns % 1000000000;
-
-					nanosleep(&time_to_sleep, NULL);
-				} else {
-					//sched_yield();
-				}
-				now = rdtscp();
-			}
+SCL_API void rwlock_reader_lock(rwlock_t *lock) {
+	ull start = scl_now(), banned = 0;
+	scl_group_thread_t *t;
+	scl_stats_slot_t *stats;
+	numa_counter_t *counter;
+	ull now = 0;
 
-			// TODO: There is still a chance that total_weight is 0
-			// leading to divide-by-zero crash.
+	if (0 != rwlock_hold_reserve()) {
+		fprintf(stderr, "Unable to allocate a read hold record\n");
+		abort();
+	}
+	t = scl_group_self(&lock->classes[RWLOCK_READERS].threads);
+	stats = scl_stats_self(&lock->stats, SCL_STATS_READER, t->weight);
+	banned += rwlock_ban_wait(lock, RWLOCK_READERS, t, stats);
 
-			// Turn for the writers to own the slice. If the readers do not
-			// switch the slice ownership, better do it yourself.
-			if (__sync_bool_compare_and_swap(&lock->slice, curr_slice,
-											 rdtsc() + READ_SLICE_SIZE)) {
-				lock->read_slice = lock->slice;
-			}
+	// Wait until the readers own the slice.
+	while (!rwlock_class_enter(lock, RWLOCK_READERS, 0, stats))
+		banned += rwlock_slice_wait(lock, RWLOCK_READERS, stats);
+
+	// Identify the NUMA node where the reader is acquiring the lock and
+	// appropriately set that particular NUMA counter.
+	counter = rwlock_reader_counter(lock);
+	(void)__sync_fetch_and_add(&counter->count, RC_INC);
+	rwlock_hold_push(lock, counter);
+
+	/*
+	 * If the reader is unable to acquire the lock immediately, wait as the
+	 * lock's policy says. The idea is to let the owner thread run so that
+	 * it can quickly release the lock.
+	 */
+	scl_wait_while(&lock->waiting, stats, readvol(counter->count) & WA_FLAG);
+
+	now = scl_now();
+	scl_stats_wait(stats, now - start - banned);
+	scl_stats_acquired(stats, now, 0);
+}
+
+/*
+ * Take the lock for writing only if the thread is not banned, the writers
+ * own the current slice, or it has run out, or the readers are idle and
+ * give it up, and no reader or writer holds the lock. Returns 0 on success and EBUSY
+ * otherwise.
+ */
+SCL_API int rwlock_writer_trylock(rwlock_t *lock) {
+	scl_group_thread_t *t;
+	scl_stats_slot_t *stats;
+	ull now;
+
+	t = scl_group_self(&lock->classes[RWLOCK_WRITERS].threads);
+	stats = scl_stats_self(&lock->stats, SCL_STATS_WRITER, t->weight);
+	now = scl_now();
+	if (rwlock_try_banned(lock, RWLOCK_WRITERS, t, now))
+		return EBUSY;
+	if (!rwlock_class_enter(lock, RWLOCK_WRITERS, 1, stats))
+		return EBUSY;
+	for (int i = 0; i < lock->ncounters; i++) {
+		if (!__sync_bool_compare_and_swap(&lock->counters[i].count, 0, WA_FLAG)) {
+			while (i-- > 0)
+				(void)__sync_fetch_and_add(&lock->counters[i].count, -WA_FLAG);
+			(void)__sync_fetch_and_sub(&lock->classes[RWLOCK_WRITERS].active, 1);
+			return EBUSY;
 		}
 	}
+	scl_stats_acquired(stats, now, 0);
+	return 0;
 }
 
-void rwlock_writer_unlock(rwlock_t *lock) {
-	ull curr_slice = readvol(lock->slice);
-	ull now = rdtsc();
-
-	// Writer slice has expired. So be kind and do the needful.
-	if (now > curr_slice) {
-		// TODO: There is still a chance that total_weight is 0
-		// leading to divide-by-zero crash.
-		if (__sync_bool_compare_and_swap(&lock->slice, curr_slice,
-										 now + READ_SLICE_SIZE)) {
-			lock->read_slice = lock->slice;
-		}
+/*
+ * Take the lock for reading only if the thread is not banned, the readers
+ * own the current slice, or it has run out, or the writers are idle and
+ * give it up, and no writer holds the lock. Returns 0 on success, EBUSY otherwise, or ENOMEM.
+ */
+SCL_API int rwlock_reader_trylock(rwlock_t *lock) {
+	scl_group_thread_t *t;
+	scl_stats_slot_t *stats;
+	numa_counter_t *counter;
+	ull now;
+
+	if (0 != rwlock_hold_reserve())
+		return ENOMEM;
+	t = scl_group_self(&lock->classes[RWLOCK_READERS].threads);
+	stats = scl_stats_self(&lock->stats, SCL_STATS_READER, t->weight);
+	now = scl_now();
+	if (rwlock_try_banned(lock, RWLOCK_READERS, t, now))
+		return EBUSY;
+	if (!rwlock_class_enter(lock, RWLOCK_READERS, 1, stats))
+		return EBUSY;
+	counter = rwlock_reader_counter(lock);
+	(void)__sync_fetch_and_add(&counter->count, RC_INC);
+	if (readvol(counter->count) & WA_FLAG) {
+		(void)__sync_fetch_and_add(&counter->count, -RC_INC);
+		return EBUSY;
 	}
+	rwlock_hold_push(lock, counter);
+	scl_stats_acquired(stats, now, 0);
+	return 0;
+}
+
+SCL_API void rwlock_writer_unlock(rwlock_t *lock) {
+	ull now = scl_now();
+	scl_stats_slot_t *stats = scl_stats_self(&lock->stats, SCL_STATS_WRITER, 0);
+
+	// Only writers feed the adaptive spin budget: readers mostly wait for
+	// writers, and their unlocks should not all write the lock's cache line.
+	scl_wait_policy_hold(&lock->waiting, now - stats->start);
 
 	// Clean the writer flags for all NUMA counters.
-	(void)__sync_fetch_and_add(&lock->counters[0].count, -WA_FLAG);
-	(void)__sync_fetch_and_add(&lock->counters[1].count, -WA_FLAG);
+	for (int i = 0; i < lock->ncounters; i++)
+		(void)__sync_fetch_and_add(&lock->counters[i].count, -WA_FLAG);
 
-	return;
+	rwlock_class_leave(lock, RWLOCK_WRITERS, now, stats);
+	// charge once the lock is free, as refreshing a derived weight may read files
+	rwlock_charge(lock, RWLOCK_WRITERS, stats, now);
+	scl_stats_released(stats, now);
 }
 
-void rwlock_reader_unlock(rwlock_t *lock) {
-	int core = 0, chip = 0;
-	ull curr_slice = readvol(lock->slice);
-	ull now = rdtscp_(&chip, &core);
-
-	// Reader slice has expired. So be kind and do the needful.
-	if (now > curr_slice) {
-		// TODO: There is still a chance that total_weight is 0
-		// leading to divide-by-zero crash.
-		if (__sync_bool_compare_and_swap(&lock->slice, curr_slice,
-										 rdtsc() + WRITE_SLICE_SIZE)) {
-			lock->write_slice = lock->slice;
-		}
-	}
+SCL_API void rwlock_reader_unlock(rwlock_t *lock) {
+	numa_counter_t *counter;
+	ull now = scl_now();
+	scl_stats_slot_t *stats = scl_stats_self(&lock->stats, SCL_STATS_READER, 0);
 
 	/*
-	 * Reduce the counter from where the reader acquired the lock. We assume
-	 * that the threads are pinned so they wont change the CPU/NUMA node. If
-	 * the threads can change CPU/NUMA nodes, we need to remember the NUMA
-	 * counter locally and just decrement that counter.
+	 * Reduce the counter from where the reader acquired the lock, which
+	 * the thread remembers as it may have moved to another node since. A
+	 * thread with no hold recorded unlocks on behalf of another one, and
+	 * can only guess that the reader ran on its node.
 	 */
-	if (core < 8) {
-		(void) __sync_fetch_and_add(&lock->counters[0].count, -RC_INC);
-	} else if (core < 16) {
-		(void) __sync_fetch_and_add(&lock->counters[1].count, -RC_INC);
-	}
-
-	return;
+	if (NULL == (counter = rwlock_hold_pop(lock)))
+		counter = rwlock_reader_counter(lock);
+	counter->last_release = now;
+	(void) __sync_fetch_and_add(&counter->count, -RC_INC);
+
+	rwlock_class_leave(lock, RWLOCK_READERS, now, stats);
+	// charge once the lock is free, as with writers
+	rwlock_charge(lock, RWLOCK_READERS, stats, now);
+	scl_stats_released(stats, now);
 }
 
-void rwlock_destroy(rwlock_t *lock) {
+SCL_API void rwlock_destroy(rwlock_t *lock) {
 	/* Try to prevent the readers and writers from acquiring lock */
-	while (!__sync_bool_compare_and_swap(&lock->counters[0].count, 0,
-										 RC_INC + WA_FLAG));
-	while (!__sync_bool_compare_and_swap(&lock->counters[1].count, 0,
-										 RC_INC + WA_FLAG));
+	for (int i = 0; i < lock->ncounters; i++) {
+		while (!__sync_bool_compare_and_swap(&lock->counters[i].count, 0,
+											 RC_INC + WA_FLAG));
+	}
+	free(lock->counters);
+	lock->counters = NULL;
+	scl_group_destroy(&lock->classes[RWLOCK_READERS].threads);
+	scl_group_destroy(&lock->classes[RWLOCK_WRITERS].threads);
+	scl_stats_destroy(&lock->stats);
 	return;
 }
+
+/*
+ * Snapshot the lock's counters per reader and writer thread and in total:
+ * acquisitions, slices started, time spent waiting for the other side's
+ * slice (reported as ban time) and for the lock, the time left of the
+ * slices threads took over from an idle class (idle_slice_ns), hold times
+ * and their histograms, entitled versus received shares, and the time spent
+ * spinning and how often threads slept. Safe to call while the lock is in use; free
+ * the snapshot with scl_stats_snapshot_free(). Returns 0 or ENOMEM.
+ */
+SCL_API int rwlock_stats(rwlock_t *lock, scl_stats_snapshot_t *snap) {
+	return scl_stats_snapshot(&lock->stats, snap);
+}
+
+#endif // __RWLOCK_H__
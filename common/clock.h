@@ -0,0 +1,130 @@
+#ifndef __SCL_CLOCK_H__
+#define __SCL_CLOCK_H__
+
+/*
+ * Clock source shared by u-SCL and RW-SCL.
+ *
+ * Every slice, ban and sleep computation is expressed in ticks. If the CPU
+ * advertises an invariant TSC, a tick is one TSC cycle and the TSC frequency
+ * is calibrated against CLOCK_MONOTONIC the first time a lock is
+ * initialized. Otherwise a tick is one nanosecond of CLOCK_MONOTONIC, read
+ * through clock_gettime() which glibc serves from the vDSO.
+ *
+ * CYCLE_PER_US and friends are therefore runtime values, so one binary gets
+ * correct slice lengths on any host. Build with -DSCL_CLOCK_MONOTONIC to skip
+ * the TSC entirely.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <cpuid.h>
+#include <x86intrin.h>
+#include "linkage.h"
+
+#ifndef SCL_CLOCK_CALIBRATE_US
+#define SCL_CLOCK_CALIBRATE_US 2000
+#endif
+#define SCL_CLOCK_CALIBRATE_ROUNDS 5
+
+typedef struct scl_clock {
+    unsigned long long cycle_per_us;
+    int tsc;
+} scl_clock_t;
+
+// Until calibration finishes, ticks are CLOCK_MONOTONIC nanoseconds.
+SCL_SHARED scl_clock_t scl_clock = { 1000, 0 };
+SCL_SHARED pthread_once_t scl_clock_once = PTHREAD_ONCE_INIT;
+
+#define CYCLE_PER_US (scl_clock.cycle_per_us)
+#define CYCLE_PER_MS (CYCLE_PER_US * 1000L)
+#define CYCLE_PER_S (CYCLE_PER_MS * 1000L)
+
+static inline unsigned long long scl_monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline unsigned long long scl_now(void) {
+#ifndef SCL_CLOCK_MONOTONIC
+    if (__builtin_expect(scl_clock.tsc, 1))
+        return __rdtsc();
+#endif
+    return scl_monotonic_ns();
+}
+
+static inline unsigned long long scl_ticks_to_ns(unsigned long long ticks) {
+    return ticks / CYCLE_PER_US * 1000 + ticks % CYCLE_PER_US * 1000 / CYCLE_PER_US;
+}
+
+static inline unsigned long long scl_ns_to_ticks(unsigned long long ns) {
+    return ns / 1000 * CYCLE_PER_US + ns % 1000 * CYCLE_PER_US / 1000;
+}
+
+// Convert an absolute CLOCK_MONOTONIC time to the tick domain of scl_now().
+static inline unsigned long long scl_monotonic_to_ticks(const struct timespec *abstime) {
+    unsigned long long ns = abstime->tv_sec * 1000000000ULL + abstime->tv_nsec;
+    unsigned long long now_ns = scl_monotonic_ns(), now = scl_now();
+
+    if (ns <= now_ns)
+        return now;
+    return now + scl_ns_to_ticks(ns - now_ns);
+}
+
+static inline void scl_ticks_to_timespec(unsigned long long ticks, struct timespec *ts) {
+    unsigned long long ns = scl_ticks_to_ns(ticks);
+    ts->tv_sec = ns / 1000000000ULL;
+    ts->tv_nsec = ns % 1000000000ULL;
+}
+
+// CPUID.80000007H:EDX[8] - TSC runs at a constant rate in all ACPI P/C/T-states.
+static int scl_tsc_invariant(void) {
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007)
+        return 0;
+    __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    return (edx >> 8) & 1;
+}
+
+static int scl_cmp_ull(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *) a, y = *(const unsigned long long *) b;
+    return x < y ? -1 : x > y;
+}
+
+static void scl_clock_calibrate(void) {
+#ifndef SCL_CLOCK_MONOTONIC
+    unsigned long long rate[SCL_CLOCK_CALIBRATE_ROUNDS];
+
+    if (!scl_tsc_invariant())
+        return;
+    // Take the median of a few short windows so that a preemption during
+    // one window does not skew the result.
+    for (int i = 0; i < SCL_CLOCK_CALIBRATE_ROUNDS; i++) {
+        unsigned long long t0, t1, c0, c1;
+        t0 = scl_monotonic_ns();
+        c0 = __rdtsc();
+        do {
+            t1 = scl_monotonic_ns();
+        } while (t1 - t0 < SCL_CLOCK_CALIBRATE_US * 1000ULL);
+        c1 = __rdtsc();
+        rate[i] = (c1 - c0) * 1000 / (t1 - t0);
+    }
+    qsort(rate, SCL_CLOCK_CALIBRATE_ROUNDS, sizeof(rate[0]), scl_cmp_ull);
+    if (rate[SCL_CLOCK_CALIBRATE_ROUNDS / 2] == 0)
+        return;
+    scl_clock.cycle_per_us = rate[SCL_CLOCK_CALIBRATE_ROUNDS / 2];
+    scl_clock.tsc = 1;
+#endif
+}
+
+/*
+ * Select and calibrate the clock source. Safe to call from every lock
+ * initializer; only the first call does any work.
+ */
+static inline void scl_clock_init(void) {
+    pthread_once(&scl_clock_once, scl_clock_calibrate);
+}
+
+#endif // __SCL_CLOCK_H__
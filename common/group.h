@@ -0,0 +1,314 @@
+#ifndef __SCL_GROUP_H__
+#define __SCL_GROUP_H__
+
+/*
+ * Accounting groups: one usage budget shared by several locks.
+ *
+ * A lock that joins a group (fairlock_set_group(), rwlock_set_group())
+ * stops banning threads on its own. Every critical section on any member
+ * is charged to the thread's entry in the group instead, scaled by the
+ * group's total_weight over the thread's weight in the group, and a thread
+ * waits out that one ban before it takes any member. A thread that is
+ * under its share on every single lock can thus still be banned for the
+ * combined time it holds them.
+ *
+ * A thread's weight in the group is set with scl_group_thread_init() and
+ * otherwise derives from its scheduling parameters (common/weight.h). As
+ * with a single u-SCL, a thread that has not released a member for
+ * SCL_GROUP_INACTIVE_THRESHOLD stops counting towards total_weight until
+ * it comes back, and exiting threads leave the group. Per-thread entries
+ * are found through a small thread-local table, like the statistics slots
+ * of common/stats.h. Groups are process-local and cannot be used with
+ * fairlock_shm_t.
+ *
+ * Bans run on scl_now() ticks unless the group is given a clock of its own
+ * (scl_group_set_clock()).
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "clock.h"
+#include "stats.h"
+#include "weight.h"
+
+#define SCL_GROUP_INACTIVE_THRESHOLD (CYCLE_PER_S * 1L)
+
+typedef struct scl_group_thread {
+    unsigned long long banned_until;
+    unsigned long long weight;
+    unsigned long long last_release;
+    int active; // weight is counted in total_weight, guarded by members_mutex
+    int weight_auto; // weight is derived, see common/weight.h
+    struct scl_group_thread *next;
+    struct scl_group_thread **pprev;
+} scl_group_thread_t;
+
+typedef struct scl_group {
+    unsigned long long total_weight __attribute__ ((aligned (64)));
+    unsigned long long next_scan __attribute__ ((aligned (64)));
+    pthread_mutex_t members_mutex;
+    scl_group_thread_t *members;
+    unsigned long long gen;
+    struct scl_group *next_live;
+    // maps scl_now() ticks to the time bans are kept in, NULL for the ticks
+    unsigned long long (*clock)(void *arg, unsigned long long now);
+    void *clock_arg;
+} scl_group_t;
+
+typedef struct scl_group_entry {
+    scl_group_t *group;
+    unsigned long long gen;
+    scl_group_thread_t *thread;
+} scl_group_entry_t;
+
+// scl_group_mutex guards the list of live groups
+SCL_SHARED pthread_mutex_t scl_group_mutex = PTHREAD_MUTEX_INITIALIZER;
+SCL_SHARED scl_group_t *scl_group_live;
+SCL_SHARED unsigned long long scl_group_next_gen = 1;
+SCL_SHARED_TLS scl_group_entry_t *scl_group_map;
+SCL_SHARED_TLS int scl_group_map_len;
+SCL_SHARED_TLS int scl_group_map_cap;
+// stands in for the entry of a thread that could not allocate one
+SCL_SHARED_TLS scl_group_thread_t scl_group_lost;
+SCL_SHARED pthread_key_t scl_group_exit_key;
+SCL_SHARED pthread_once_t scl_group_exit_once = PTHREAD_ONCE_INIT;
+
+SCL_API void scl_group_init(scl_group_t *group) {
+    scl_clock_init();
+    group->total_weight = 0;
+    group->next_scan = 0;
+    pthread_mutex_init(&group->members_mutex, NULL);
+    group->members = NULL;
+    group->clock = NULL;
+    group->clock_arg = NULL;
+    pthread_mutex_lock(&scl_group_mutex);
+    group->gen = scl_group_next_gen++;
+    group->next_live = scl_group_live;
+    scl_group_live = group;
+    pthread_mutex_unlock(&scl_group_mutex);
+}
+
+/*
+ * Keep the group's bans in another time than scl_now() ticks: clock(arg,
+ * now) gives that time at the tick now, and must not run faster than the
+ * ticks. RW-SCL bans the threads of a class in the time the class has owned
+ * the lock. Call before the group is used.
+ */
+SCL_API void scl_group_set_clock(scl_group_t *group,
+                                 unsigned long long (*clock)(void *arg, unsigned long long now),
+                                 void *arg) {
+    group->clock = clock;
+    group->clock_arg = arg;
+}
+
+// The group's time at the tick now, which its bans are kept in.
+static inline unsigned long long scl_group_time(scl_group_t *group, unsigned long long now) {
+    return NULL == group->clock ? now : group->clock(group->clock_arg, now);
+}
+
+// The members must not be used any more.
+SCL_API void scl_group_destroy(scl_group_t *group) {
+    scl_group_thread_t *t;
+    scl_group_t **p;
+
+    pthread_mutex_lock(&scl_group_mutex);
+    for (p = &scl_group_live; NULL != *p; p = &(*p)->next_live) {
+        if (*p == group) {
+            *p = group->next_live;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&scl_group_mutex);
+    while (NULL != (t = group->members)) {
+        group->members = t->next;
+        free(t);
+    }
+    pthread_mutex_destroy(&group->members_mutex);
+}
+
+// Needs members_mutex.
+static inline void scl_group_deactivate(scl_group_t *group, scl_group_thread_t *t) {
+    if (t->active) {
+        t->active = 0;
+        __sync_sub_and_fetch(&group->total_weight, t->weight);
+    }
+}
+
+static void scl_group_thread_exit(void *arg) {
+    pthread_mutex_lock(&scl_group_mutex);
+    for (int i = 0; i < scl_group_map_len; i++) {
+        scl_group_entry_t *e = &scl_group_map[i];
+        scl_group_t *g;
+        // skip groups that have been destroyed since
+        for (g = scl_group_live; NULL != g && g != e->group; g = g->next_live);
+        if (NULL == g || g->gen != e->gen)
+            continue;
+        pthread_mutex_lock(&g->members_mutex);
+        scl_group_deactivate(g, e->thread);
+        if (NULL != e->thread->next)
+            e->thread->next->pprev = e->thread->pprev;
+        *e->thread->pprev = e->thread->next;
+        pthread_mutex_unlock(&g->members_mutex);
+        free(e->thread);
+    }
+    pthread_mutex_unlock(&scl_group_mutex);
+    free(scl_group_map);
+    scl_group_map = NULL;
+    scl_group_map_len = scl_group_map_cap = 0;
+}
+
+static void scl_group_exit_key_create(void) {
+    pthread_key_create(&scl_group_exit_key, scl_group_thread_exit);
+}
+
+static scl_group_thread_t *scl_group_join(scl_group_t *group, scl_group_entry_t *e, int weight) {
+    scl_group_thread_t *t;
+
+    if (NULL == (t = (scl_group_thread_t *) malloc(sizeof(scl_group_thread_t))))
+        return NULL;
+    t->weight_auto = 0 == weight;
+    t->weight = t->weight_auto ? scl_thread_weight() : (unsigned long long) weight;
+    t->last_release = scl_now();
+    t->banned_until = scl_group_time(group, t->last_release);
+    pthread_mutex_lock(&group->members_mutex);
+    t->active = 1;
+    __sync_add_and_fetch(&group->total_weight, t->weight);
+    t->next = group->members;
+    if (NULL != t->next)
+        t->next->pprev = &t->next;
+    t->pprev = &group->members;
+    group->members = t;
+    pthread_mutex_unlock(&group->members_mutex);
+    e->group = group;
+    e->gen = group->gen;
+    e->thread = t;
+    return t;
+}
+
+// Count a thread that went inactive towards total_weight again.
+static void scl_group_reactivate(scl_group_t *group, scl_group_thread_t *t) {
+    unsigned long long now = scl_group_time(group, scl_now());
+
+    pthread_mutex_lock(&group->members_mutex);
+    if (!t->active) {
+        t->active = 1;
+        __sync_add_and_fetch(&group->total_weight, t->weight);
+    }
+    pthread_mutex_unlock(&group->members_mutex);
+    // idle time does not turn into credit
+    if (t->banned_until < now)
+        t->banned_until = now;
+}
+
+// The calling thread's entry in group, created with weight if it has none.
+static scl_group_thread_t *scl_group_entry(scl_group_t *group, int weight) {
+    scl_group_entry_t *e = NULL;
+    scl_group_thread_t *t;
+    int i;
+
+    for (i = 0; i < scl_group_map_len; i++) {
+        if (scl_group_map[i].group == group) {
+            if (__builtin_expect(scl_group_map[i].gen == group->gen, 1))
+                return scl_group_map[i].thread;
+            // the group was destroyed and another one took its place
+            e = &scl_group_map[i];
+            break;
+        }
+    }
+    if (NULL == e) {
+        if (NULL == scl_group_map) {
+            pthread_once(&scl_group_exit_once, scl_group_exit_key_create);
+            pthread_setspecific(scl_group_exit_key, &scl_group_map);
+        }
+        if (scl_group_map_len == scl_group_map_cap) {
+            int cap = scl_group_map_cap ? scl_group_map_cap * 2 : 8;
+            scl_group_entry_t *map = (scl_group_entry_t *) realloc(scl_group_map, cap * sizeof(scl_group_entry_t));
+            if (NULL == map)
+                goto lost;
+            scl_group_map = map;
+            scl_group_map_cap = cap;
+        }
+        e = &scl_group_map[scl_group_map_len++];
+    }
+    if (NULL != (t = scl_group_join(group, e, weight)))
+        return t;
+    // leave a reused entry pointing at nothing that a later lookup could match
+    e->group = NULL;
+lost:
+    if (0 == scl_group_lost.weight)
+        scl_group_lost.weight = 0 != weight ? (unsigned long long) weight : scl_thread_weight();
+    return &scl_group_lost;
+}
+
+/*
+ * The calling thread's entry in group, to charge a member's critical
+ * section to and to wait out its ban. Called before taking a member.
+ */
+static inline scl_group_thread_t *scl_group_self(scl_group_t *group) {
+    scl_group_thread_t *t = scl_group_entry(group, 0);
+
+    if (__builtin_expect(!scl_readvol(t->active), 0) && &scl_group_lost != t)
+        scl_group_reactivate(group, t);
+    return t;
+}
+
+static void scl_group_update_weight(scl_group_t *group, scl_group_thread_t *t, unsigned long long weight) {
+    if (&scl_group_lost == t) {
+        t->weight = weight;
+        return;
+    }
+    pthread_mutex_lock(&group->members_mutex);
+    if (t->active)
+        __sync_add_and_fetch(&group->total_weight, weight - t->weight);
+    t->weight = weight;
+    pthread_mutex_unlock(&group->members_mutex);
+}
+
+/*
+ * Set the calling thread's weight in the group; 0 derives it from the
+ * thread's scheduling parameters (see common/weight.h) and keeps it up to
+ * date with them. Safe while other threads use the members.
+ */
+SCL_API void scl_group_thread_init(scl_group_t *group, int weight) {
+    scl_group_thread_t *t = scl_group_entry(group, weight);
+
+    t->weight_auto = 0 == weight;
+    scl_group_update_weight(group, t, t->weight_auto ? scl_thread_weight() : (unsigned long long) weight);
+}
+
+/*
+ * Drop threads that have not released a member within
+ * SCL_GROUP_INACTIVE_THRESHOLD out of total_weight. Skipped if another
+ * thread holds members_mutex.
+ */
+static void scl_group_scan(scl_group_t *group, unsigned long long now) {
+    scl_group_thread_t *t;
+
+    if (0 != pthread_mutex_trylock(&group->members_mutex))
+        return;
+    group->next_scan = now + SCL_GROUP_INACTIVE_THRESHOLD;
+    for (t = group->members; NULL != t; t = t->next) {
+        if (t->active && scl_readvol(t->last_release) + SCL_GROUP_INACTIVE_THRESHOLD < now)
+            scl_group_deactivate(group, t);
+    }
+    pthread_mutex_unlock(&group->members_mutex);
+}
+
+/*
+ * Charge a critical section of cs ticks on a member that ended at now to
+ * the calling thread's entry t. Returns the end of its ban, in the
+ * group's time.
+ */
+static inline unsigned long long scl_group_charge(scl_group_t *group, scl_group_thread_t *t,
+                                                  unsigned long long cs, unsigned long long now) {
+    // multiplied first: total_weight / weight truncates a 1024 among 1359 to 1
+    t->banned_until += cs * __atomic_load_n(&group->total_weight, __ATOMIC_RELAXED) / t->weight;
+    t->last_release = now;
+    if (now >= scl_readvol(group->next_scan))
+        scl_group_scan(group, now);
+    if (t->weight_auto && __builtin_expect(scl_thread_weight_at(now) != t->weight, 0))
+        scl_group_update_weight(group, t, scl_thread_weight_at(now));
+    return t->banned_until;
+}
+
+#endif // __SCL_GROUP_H__
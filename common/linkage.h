@@ -0,0 +1,25 @@
+#ifndef __SCL_LINKAGE_H__
+#define __SCL_LINKAGE_H__
+
+/*
+ * Linkage of the header-only SCLs.
+ *
+ * A C program includes a lock header in one translation unit: public
+ * functions get external linkage and the lock state shared by all locks
+ * (id registries, calibrated clock, per-thread caches) is static. Compiled
+ * as C++, public functions and shared state are inline instead, so that
+ * every translation unit including the headers links against a single
+ * copy of both.
+ */
+
+#ifdef __cplusplus
+#define SCL_API inline
+#define SCL_SHARED inline
+#define SCL_SHARED_TLS inline thread_local
+#else
+#define SCL_API
+#define SCL_SHARED static
+#define SCL_SHARED_TLS static __thread
+#endif
+
+#endif // __SCL_LINKAGE_H__
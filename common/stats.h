@@ -0,0 +1,359 @@
+#ifndef __SCL_STATS_H__
+#define __SCL_STATS_H__
+
+/*
+ * Always-on lock statistics shared by the user-space SCLs.
+ *
+ * Every thread that uses a lock gets its own cache-line-aligned slot, and
+ * only that thread writes to it, with plain stores. Slots hang off the
+ * lock's scl_stats_t in a list that only grows while the lock lives, so
+ * scl_stats_snapshot() can walk it at any time without stopping the lock;
+ * a snapshot taken while threads run is consistent per counter, not across
+ * counters. When a thread exits, its counters are folded into the lock's
+ * retired totals and its slot is reused by the next new thread.
+ *
+ * Times are kept in ticks and histograms have one bucket per power of two
+ * ticks; snapshots convert both to nanoseconds.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "clock.h"
+
+#define SCL_HIST_BUCKETS 40
+
+#define scl_readvol(lvalue) (*(volatile __typeof__(lvalue)*)(&lvalue))
+
+enum scl_stats_role {
+    SCL_STATS_THREAD = 0, // u-SCL: every thread has its own weight
+    SCL_STATS_READER,
+    SCL_STATS_WRITER,
+    SCL_STATS_TASK, // u-SCL accounting identity, tid holds its id
+};
+
+typedef struct scl_stats_counters {
+    unsigned long long acquisitions;
+    unsigned long long reentries; // acquisitions within the thread's own slice
+    unsigned long long handoffs; // slices the thread started
+    unsigned long long delegated; // acquisitions another thread ran on its behalf
+    unsigned long long ban; // time spent banned
+    unsigned long long idle_slice; // RW-SCL: time left of slices taken from an idle class
+    unsigned long long wait; // time spent waiting for the lock, bans excluded
+    unsigned long long hold;
+    unsigned long long spin; // time spent busy-waiting, see waiter.h
+    unsigned long long yields;
+    unsigned long long parks; // sleeps, on a futex or a timer
+    unsigned long long wait_hist[SCL_HIST_BUCKETS];
+    unsigned long long hold_hist[SCL_HIST_BUCKETS];
+} scl_stats_counters_t;
+
+typedef struct scl_stats_slot {
+    scl_stats_counters_t c;
+    unsigned long long weight;
+    unsigned long long start; // when the current hold started
+    pid_t tid; // 0 while the slot is free
+    int role;
+    int in_use;
+    struct scl_stats_slot *next;
+} scl_stats_slot_t __attribute__ ((aligned (64)));
+
+typedef struct scl_stats {
+    scl_stats_slot_t *slots;
+    scl_stats_slot_t retired; // counters of threads that have exited
+    unsigned long long gen;
+    struct scl_stats *next_live;
+} scl_stats_t;
+
+typedef struct scl_stats_thread {
+    pid_t tid;
+    int role;
+    unsigned long long weight;
+    unsigned long long acquisitions;
+    unsigned long long reentries;
+    unsigned long long handoffs;
+    unsigned long long delegated;
+    unsigned long long ban_ns;
+    unsigned long long idle_slice_ns;
+    unsigned long long wait_ns;
+    unsigned long long hold_ns;
+    unsigned long long spin_ns;
+    unsigned long long yields;
+    unsigned long long parks;
+    double entitled; // share of the lock the weight entitles the thread to
+    double received; // share of the lock's hold time it got
+} scl_stats_thread_t;
+
+typedef struct scl_stats_snapshot {
+    scl_stats_thread_t total; // including threads that have exited
+    unsigned long long bucket_ns[SCL_HIST_BUCKETS]; // upper bound of each bucket
+    unsigned long long wait_hist[SCL_HIST_BUCKETS];
+    unsigned long long hold_hist[SCL_HIST_BUCKETS];
+    int nthreads;
+    scl_stats_thread_t *threads; // live threads, free with scl_stats_snapshot_free()
+} scl_stats_snapshot_t;
+
+/*
+ * Locks with statistics, so that a thread exit can tell whether a lock it
+ * used still exists. Guarded by scl_stats_mutex.
+ */
+SCL_SHARED pthread_mutex_t scl_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+SCL_SHARED scl_stats_t *scl_stats_live;
+SCL_SHARED unsigned long long scl_stats_next_gen = 1;
+
+static inline int scl_hist_bucket(unsigned long long ticks) {
+    int b = 63 - __builtin_clzll(ticks | 1);
+    return b < SCL_HIST_BUCKETS ? b : SCL_HIST_BUCKETS - 1;
+}
+
+static inline void scl_stats_wait(scl_stats_slot_t *slot, unsigned long long ticks) {
+    slot->c.wait += ticks;
+    slot->c.wait_hist[scl_hist_bucket(ticks)]++;
+}
+
+// Called by the new holder.
+static inline void scl_stats_acquired(scl_stats_slot_t *slot, unsigned long long now, int reentry) {
+    slot->c.acquisitions++;
+    slot->c.reentries += reentry;
+    slot->start = now;
+}
+
+static inline void scl_stats_released(scl_stats_slot_t *slot, unsigned long long now) {
+    unsigned long long hold = now - slot->start;
+    slot->c.hold += hold;
+    slot->c.hold_hist[scl_hist_bucket(hold)]++;
+}
+
+SCL_API void scl_stats_init(scl_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&scl_stats_mutex);
+    stats->gen = scl_stats_next_gen++;
+    stats->next_live = scl_stats_live;
+    scl_stats_live = stats;
+    pthread_mutex_unlock(&scl_stats_mutex);
+}
+
+SCL_API void scl_stats_destroy(scl_stats_t *stats) {
+    scl_stats_slot_t *slot;
+    scl_stats_t **p;
+
+    pthread_mutex_lock(&scl_stats_mutex);
+    for (p = &scl_stats_live; NULL != *p; p = &(*p)->next_live) {
+        if (*p == stats) {
+            *p = stats->next_live;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&scl_stats_mutex);
+    while (NULL != (slot = stats->slots)) {
+        stats->slots = slot->next;
+        free(slot);
+    }
+}
+
+// Whether stats, last seen with generation gen, still exists. Needs scl_stats_mutex.
+static int scl_stats_alive(scl_stats_t *stats, unsigned long long gen) {
+    for (scl_stats_t *s = scl_stats_live; NULL != s; s = s->next_live) {
+        if (s == stats)
+            return s->gen == gen;
+    }
+    return 0;
+}
+
+// Give the calling thread a slot, reusing one left by an exited thread.
+static scl_stats_slot_t *scl_stats_claim(scl_stats_t *stats, int role, unsigned long long weight) {
+    scl_stats_slot_t *slot;
+
+    for (slot = scl_readvol(stats->slots); NULL != slot; slot = slot->next) {
+        if (0 == slot->in_use && __sync_bool_compare_and_swap(&slot->in_use, 0, 1))
+            goto claimed;
+    }
+    if (0 != posix_memalign((void **) &slot, 64, sizeof(scl_stats_slot_t)))
+        return NULL;
+    memset(slot, 0, sizeof(*slot));
+    slot->in_use = 1;
+    do {
+        slot->next = stats->slots;
+    } while (!__sync_bool_compare_and_swap(&stats->slots, slot->next, slot));
+claimed:
+    slot->role = role;
+    slot->weight = weight;
+    slot->tid = syscall(SYS_gettid);
+    return slot;
+}
+
+// Fold an exiting thread's counters into the retired totals and free its slot.
+static void scl_stats_retire(scl_stats_t *stats, scl_stats_slot_t *slot) {
+    unsigned long long *from = (unsigned long long *) &slot->c;
+    unsigned long long *to = (unsigned long long *) &stats->retired.c;
+
+    for (size_t i = 0; i < sizeof(scl_stats_counters_t) / sizeof(unsigned long long); i++)
+        __sync_fetch_and_add(&to[i], from[i]);
+    memset(&slot->c, 0, sizeof(slot->c));
+    slot->tid = 0;
+    __sync_lock_release(&slot->in_use);
+}
+
+/*
+ * Slots of locks that keep no per-thread state of their own, looked up by
+ * (lock, role) in a small thread-local table. On thread exit the slots of
+ * locks that still exist are retired.
+ */
+typedef struct scl_stats_entry {
+    scl_stats_t *stats;
+    unsigned long long gen;
+    scl_stats_slot_t *slot;
+    int role;
+} scl_stats_entry_t;
+
+SCL_SHARED_TLS scl_stats_entry_t *scl_stats_map;
+SCL_SHARED_TLS int scl_stats_map_len;
+SCL_SHARED_TLS int scl_stats_map_cap;
+// counts of a thread that could not get a slot go nowhere
+SCL_SHARED_TLS scl_stats_slot_t scl_stats_lost;
+SCL_SHARED pthread_key_t scl_stats_exit_key;
+SCL_SHARED pthread_once_t scl_stats_exit_once = PTHREAD_ONCE_INIT;
+
+static void scl_stats_thread_exit(void *arg) {
+    pthread_mutex_lock(&scl_stats_mutex);
+    for (int i = 0; i < scl_stats_map_len; i++) {
+        scl_stats_entry_t *e = &scl_stats_map[i];
+        if (scl_stats_alive(e->stats, e->gen))
+            scl_stats_retire(e->stats, e->slot);
+    }
+    pthread_mutex_unlock(&scl_stats_mutex);
+    free(scl_stats_map);
+    scl_stats_map = NULL;
+    scl_stats_map_len = scl_stats_map_cap = 0;
+}
+
+static void scl_stats_exit_key_create(void) {
+    pthread_key_create(&scl_stats_exit_key, scl_stats_thread_exit);
+}
+
+// The calling thread's slot for stats in the given role.
+static inline scl_stats_slot_t *scl_stats_self(scl_stats_t *stats, int role, unsigned long long weight) {
+    scl_stats_entry_t *e = NULL;
+    int i;
+
+    for (i = 0; i < scl_stats_map_len; i++) {
+        if (scl_stats_map[i].stats == stats && scl_stats_map[i].role == role) {
+            if (__builtin_expect(scl_stats_map[i].gen == stats->gen, 1))
+                return scl_stats_map[i].slot;
+            // the lock was destroyed and another one took its place
+            e = &scl_stats_map[i];
+            break;
+        }
+    }
+    if (NULL == e) {
+        if (NULL == scl_stats_map) {
+            pthread_once(&scl_stats_exit_once, scl_stats_exit_key_create);
+            pthread_setspecific(scl_stats_exit_key, &scl_stats_map);
+        }
+        if (scl_stats_map_len == scl_stats_map_cap) {
+            int cap = scl_stats_map_cap ? scl_stats_map_cap * 2 : 8;
+            scl_stats_entry_t *map = (scl_stats_entry_t *) realloc(scl_stats_map, cap * sizeof(scl_stats_entry_t));
+            if (NULL == map)
+                return &scl_stats_lost;
+            scl_stats_map = map;
+            scl_stats_map_cap = cap;
+        }
+        e = &scl_stats_map[scl_stats_map_len++];
+    }
+    e->stats = stats;
+    e->gen = stats->gen;
+    e->role = role;
+    if (NULL == (e->slot = scl_stats_claim(stats, role, weight))) {
+        *e = scl_stats_map[--scl_stats_map_len];
+        return &scl_stats_lost;
+    }
+    return e->slot;
+}
+
+static void scl_stats_add(scl_stats_counters_t *to, const scl_stats_counters_t *from) {
+    const unsigned long long *f = (const unsigned long long *) from;
+    unsigned long long *t = (unsigned long long *) to;
+
+    for (size_t i = 0; i < sizeof(scl_stats_counters_t) / sizeof(unsigned long long); i++)
+        t[i] += scl_readvol(f[i]);
+}
+
+static void scl_stats_convert(scl_stats_thread_t *t, const scl_stats_counters_t *c) {
+    t->acquisitions = c->acquisitions;
+    t->reentries = c->reentries;
+    t->handoffs = c->handoffs;
+    t->delegated = c->delegated;
+    t->ban_ns = scl_ticks_to_ns(c->ban);
+    t->idle_slice_ns = scl_ticks_to_ns(c->idle_slice);
+    t->wait_ns = scl_ticks_to_ns(c->wait);
+    t->hold_ns = scl_ticks_to_ns(c->hold);
+    t->spin_ns = scl_ticks_to_ns(c->spin);
+    t->yields = c->yields;
+    t->parks = c->parks;
+}
+
+/*
+ * Copy the statistics out. Entitled shares are computed over the live
+ * threads that have used the lock: a thread's weight over the sum of
+ * weights, readers and writers included, as RW-SCL sizes its classes'
+ * slices by their threads' summed weights. Received shares are shares of
+ * the summed hold time, in which concurrent reader holds all count.
+ * Returns 0 or ENOMEM.
+ */
+SCL_API int scl_stats_snapshot(scl_stats_t *stats, scl_stats_snapshot_t *snap) {
+    scl_stats_counters_t total, c;
+    unsigned long long weights = 0, hold = 0;
+    scl_stats_slot_t *slot;
+    int n = 0, i = 0;
+
+    memset(snap, 0, sizeof(*snap));
+    for (slot = scl_readvol(stats->slots); NULL != slot; slot = slot->next)
+        n++;
+    if (n > 0 && NULL == (snap->threads = (scl_stats_thread_t *) calloc(n, sizeof(scl_stats_thread_t))))
+        return ENOMEM;
+
+    memset(&total, 0, sizeof(total));
+    scl_stats_add(&total, &stats->retired.c);
+    for (slot = scl_readvol(stats->slots); NULL != slot && i < n; slot = slot->next) {
+        scl_stats_thread_t *t = &snap->threads[i];
+        if (!scl_readvol(slot->in_use))
+            continue;
+        memset(&c, 0, sizeof(c));
+        scl_stats_add(&c, &slot->c);
+        scl_stats_add(&total, &c);
+        if (0 == c.acquisitions)
+            continue;
+        t->tid = slot->tid;
+        t->role = slot->role;
+        t->weight = slot->weight;
+        scl_stats_convert(t, &c);
+        weights += t->weight;
+        hold += c.hold;
+        i++;
+    }
+    snap->nthreads = i;
+    for (i = 0; i < snap->nthreads; i++) {
+        scl_stats_thread_t *t = &snap->threads[i];
+        t->entitled = weights ? (double) t->weight / weights : 0;
+        t->received = hold ? (double) scl_ns_to_ticks(t->hold_ns) / hold : 0;
+    }
+
+    scl_stats_convert(&snap->total, &total);
+    snap->total.entitled = snap->total.received = 1;
+    for (i = 0; i < SCL_HIST_BUCKETS; i++) {
+        snap->bucket_ns[i] = scl_ticks_to_ns(2ULL << i);
+        snap->wait_hist[i] = total.wait_hist[i];
+        snap->hold_hist[i] = total.hold_hist[i];
+    }
+    return 0;
+}
+
+SCL_API void scl_stats_snapshot_free(scl_stats_snapshot_t *snap) {
+    free(snap->threads);
+    snap->threads = NULL;
+}
+
+#endif // __SCL_STATS_H__
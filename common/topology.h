@@ -0,0 +1,115 @@
+#ifndef __SCL_TOPOLOGY_H__
+#define __SCL_TOPOLOGY_H__
+
+/*
+ * NUMA topology discovered at run time from /sys/devices/system/node.
+ *
+ * Nodes are numbered densely from 0 in the order of their kernel ids, so
+ * per-node arrays can be indexed directly even if the kernel's ids have
+ * holes. Without sysfs, or on a machine without NUMA, every CPU is on
+ * node 0.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "linkage.h"
+
+#define SCL_NODE_PATH "/sys/devices/system/node"
+
+typedef struct scl_topology {
+    int nnodes;
+    int ncpus;
+    int *cpu_node; // ncpus entries, dense node index of every CPU
+} scl_topology_t;
+
+SCL_SHARED scl_topology_t scl_topology = { 1, 0, NULL };
+SCL_SHARED pthread_once_t scl_topology_once = PTHREAD_ONCE_INIT;
+
+static int scl_cmp_int(const void *a, const void *b) {
+    return *(const int *) a - *(const int *) b;
+}
+
+// Mark the CPUs of a cpulist such as "0-3,8-11" as being on node.
+static void scl_topology_parse_cpulist(const char *list, int node) {
+    const char *p = list;
+
+    while (*p && '\n' != *p) {
+        char *end;
+        long lo = strtol(p, &end, 10), hi = lo;
+        if (end == p)
+            break;
+        if ('-' == *end)
+            hi = strtol(end + 1, &end, 10);
+        for (long cpu = lo; cpu <= hi && cpu < scl_topology.ncpus; cpu++)
+            scl_topology.cpu_node[cpu] = node;
+        p = ',' == *end ? end + 1 : end;
+    }
+}
+
+static void scl_topology_discover(void) {
+    int ncpus = sysconf(_SC_NPROCESSORS_CONF), nids = 0, cap = 0, *ids = NULL;
+    struct dirent *d;
+    DIR *dir;
+
+    if (ncpus <= 0)
+        ncpus = 1;
+    if (NULL == (scl_topology.cpu_node = (int *) calloc(ncpus, sizeof(int))))
+        return;
+    scl_topology.ncpus = ncpus;
+    if (NULL == (dir = opendir(SCL_NODE_PATH)))
+        return;
+    while (NULL != (d = readdir(dir))) {
+        int id;
+        char c;
+        if (1 != sscanf(d->d_name, "node%d%c", &id, &c))
+            continue;
+        if (nids == cap) {
+            int *tmp = (int *) realloc(ids, (cap = cap ? cap * 2 : 8) * sizeof(int));
+            if (NULL == tmp)
+                break;
+            ids = tmp;
+        }
+        ids[nids++] = id;
+    }
+    closedir(dir);
+    qsort(ids, nids, sizeof(int), scl_cmp_int);
+
+    for (int i = 0; i < nids; i++) {
+        char path[128], buf[4096];
+        FILE *f;
+        snprintf(path, sizeof(path), SCL_NODE_PATH "/node%d/cpulist", ids[i]);
+        if (NULL == (f = fopen(path, "r")))
+            continue;
+        if (NULL != fgets(buf, sizeof(buf), f))
+            scl_topology_parse_cpulist(buf, i);
+        fclose(f);
+    }
+    if (nids > 0)
+        scl_topology.nnodes = nids;
+    free(ids);
+}
+
+static inline void scl_topology_init(void) {
+    pthread_once(&scl_topology_once, scl_topology_discover);
+}
+
+static inline int scl_cpu_node(int cpu) {
+    if (cpu < 0 || cpu >= scl_topology.ncpus)
+        return 0;
+    return scl_topology.cpu_node[cpu];
+}
+
+// The node of the CPU the caller is running on; it may move at any time.
+static inline int scl_current_node(void) {
+    return scl_cpu_node(sched_getcpu());
+}
+
+#endif // __SCL_TOPOLOGY_H__
@@ -0,0 +1,133 @@
+#ifndef __SCL_WAIT_H__
+#define __SCL_WAIT_H__
+
+/*
+ * Deadline waits shared by the user-space SCLs.
+ *
+ * Deadlines are absolute times in ticks of scl_now(). A wait sleeps on an
+ * absolute CLOCK_MONOTONIC deadline, with clock_nanosleep(TIMER_ABSTIME) or
+ * FUTEX_WAIT_BITSET, so a sleep that is interrupted or rounded does not
+ * drift. It aims a little before the deadline and the last stretch is
+ * spun. That stretch, the slack, is the median wake-up latency of an
+ * absolute sleep measured on this host at start-up; build with
+ * -DSCL_WAIT_SLACK_NS=<ns> to fix it instead.
+ *
+ * Every wait that reaches its deadline records by how much it overshot it
+ * in the caller's scl_wait_stats_t.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "clock.h"
+
+#define SCL_WAIT_CALIBRATE_ROUNDS 9
+#define SCL_WAIT_CALIBRATE_NS 50000
+#define SCL_WAIT_SLACK_MAX_NS 100000
+#define SCL_NO_DEADLINE (~0ULL)
+
+typedef struct scl_wait_stats {
+    unsigned long long waits; // waits that reached their deadline
+    unsigned long long overshoot; // total ticks woken after the deadline
+    unsigned long long overshoot_max;
+} scl_wait_stats_t;
+
+SCL_SHARED unsigned long long scl_wait_slack;
+SCL_SHARED pthread_once_t scl_wait_once = PTHREAD_ONCE_INIT;
+
+static inline void scl_ticks_to_monotonic(unsigned long long deadline, struct timespec *ts) {
+    unsigned long long now = scl_now(), ns = scl_monotonic_ns();
+
+    if (deadline > now)
+        ns += scl_ticks_to_ns(deadline - now);
+    ts->tv_sec = ns / 1000000000ULL;
+    ts->tv_nsec = ns % 1000000000ULL;
+}
+
+static inline void scl_wait_record(scl_wait_stats_t *stats, unsigned long long deadline) {
+    unsigned long long now = scl_now(), over = now > deadline ? now - deadline : 0;
+
+    if (NULL == stats)
+        return;
+    stats->waits++;
+    stats->overshoot += over;
+    if (over > stats->overshoot_max)
+        stats->overshoot_max = over;
+}
+
+static void scl_wait_calibrate(void) {
+#ifdef SCL_WAIT_SLACK_NS
+    scl_wait_slack = scl_ns_to_ticks(SCL_WAIT_SLACK_NS);
+#else
+    unsigned long long late[SCL_WAIT_CALIBRATE_ROUNDS];
+
+    for (int i = 0; i < SCL_WAIT_CALIBRATE_ROUNDS; i++) {
+        unsigned long long ns = scl_monotonic_ns() + SCL_WAIT_CALIBRATE_NS, now;
+        struct timespec ts;
+        ts.tv_sec = ns / 1000000000ULL;
+        ts.tv_nsec = ns % 1000000000ULL;
+        while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL));
+        now = scl_monotonic_ns();
+        late[i] = now > ns ? now - ns : 0;
+    }
+    qsort(late, SCL_WAIT_CALIBRATE_ROUNDS, sizeof(late[0]), scl_cmp_ull);
+    if (late[SCL_WAIT_CALIBRATE_ROUNDS / 2] > SCL_WAIT_SLACK_MAX_NS)
+        late[SCL_WAIT_CALIBRATE_ROUNDS / 2] = SCL_WAIT_SLACK_MAX_NS;
+    scl_wait_slack = scl_ns_to_ticks(late[SCL_WAIT_CALIBRATE_ROUNDS / 2]);
+#endif
+}
+
+// Measure the slack. Call after scl_clock_init(); only the first call works.
+static inline void scl_wait_init(void) {
+    pthread_once(&scl_wait_once, scl_wait_calibrate);
+}
+
+// Wait until the deadline.
+static void scl_wait_until(unsigned long long deadline, scl_wait_stats_t *stats) {
+    unsigned long long now = scl_now();
+
+    if (now >= deadline)
+        return;
+    if (deadline - now > scl_wait_slack) {
+        struct timespec ts;
+        scl_ticks_to_monotonic(deadline - scl_wait_slack, &ts);
+        while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL));
+    }
+    while (scl_now() < deadline)
+        __builtin_ia32_pause();
+    scl_wait_record(stats, deadline);
+}
+
+/*
+ * Sleep while *uaddr == val, at most until the slack before the deadline
+ * (SCL_NO_DEADLINE waits forever). Returns ETIMEDOUT if the wait reached
+ * that point, leaving the rest of the wait to the caller, and 0 if it
+ * returned early, in which case the caller rechecks its condition. pshared
+ * selects a futex that works across processes.
+ */
+static int scl_futex_wait_until(int *uaddr, int val, unsigned long long deadline,
+        scl_wait_stats_t *stats, int pshared) {
+    int op = FUTEX_WAIT_BITSET | (pshared ? 0 : FUTEX_PRIVATE_FLAG);
+    struct timespec ts, *timeout = NULL;
+
+    if (SCL_NO_DEADLINE != deadline) {
+        unsigned long long now = scl_now();
+        if (now + scl_wait_slack >= deadline) {
+            scl_wait_record(stats, deadline);
+            return ETIMEDOUT;
+        }
+        scl_ticks_to_monotonic(deadline - scl_wait_slack, &ts);
+        timeout = &ts;
+    }
+    // FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC timeout
+    if (0 != syscall(SYS_futex, uaddr, op, val, timeout, NULL, FUTEX_BITSET_MATCH_ANY) &&
+            ETIMEDOUT == errno) {
+        scl_wait_record(stats, deadline);
+        return ETIMEDOUT;
+    }
+    return 0;
+}
+
+#endif // __SCL_WAIT_H__
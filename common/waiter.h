@@ -0,0 +1,190 @@
+#ifndef __SCL_WAITER_H__
+#define __SCL_WAITER_H__
+
+/*
+ * Waiting strategies shared by the user-space SCLs.
+ *
+ * A lock keeps one scl_wait_policy_t and every busy wait in it goes
+ * through scl_wait_while(), which spins with the pause instruction so that
+ * a hyperthread sibling keeps its share of the core, and falls back to
+ * giving up the CPU once the strategy's spin budget is spent:
+ *
+ *   SCL_WAIT_YIELD     SCL_WAIT_YIELD_SPINS pauses, then sched_yield(), the
+ *                      old spin_then_yield behaviour
+ *   SCL_WAIT_BACKOFF   pauses doubling up to SCL_BACKOFF_MAX between polls
+ *                      for SCL_SPIN_BUDGET, then sleeps doubling from
+ *                      SCL_SLEEP_MIN_NS up to SCL_SLEEP_MAX_NS
+ *   SCL_WAIT_PARK      like SCL_WAIT_BACKOFF, but where the wait is on a
+ *                      futex word (scl_waiter_park()) it sleeps on the futex
+ *                      until woken instead
+ *   SCL_WAIT_ADAPTIVE  like SCL_WAIT_PARK, with the spin budget set from the
+ *                      lock's recent hold times: twice the average hold
+ *                      when that is below SCL_SPIN_BUDGET_MAX, since the
+ *                      holder is then likely to release before a sleep
+ *                      would pay off, and SCL_SPIN_BUDGET_MIN otherwise
+ *
+ * With a single CPU online only SCL_WAIT_YIELD spins at all, as the thread
+ * waited for cannot run meanwhile.
+ *
+ * Waits charge the time they spent spinning, and the number of yields and
+ * sleeps, to the caller's scl_stats_slot_t, so scl_stats_snapshot() shows
+ * what a strategy costs.
+ */
+
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "clock.h"
+#include "stats.h"
+#include "wait.h"
+
+#define SCL_WAIT_YIELD_SPINS 20
+#define SCL_BACKOFF_MAX 64 // pauses between polls
+#define SCL_SPIN_BUDGET (CYCLE_PER_US * 50)
+#define SCL_SPIN_BUDGET_MIN (CYCLE_PER_US * 2)
+#define SCL_SPIN_BUDGET_MAX (CYCLE_PER_US * 100)
+#define SCL_SLEEP_MIN_NS 10000
+#define SCL_SLEEP_MAX_NS 1000000
+#define SCL_HOLD_EWMA_SHIFT 3
+
+enum scl_wait_strategy {
+    SCL_WAIT_YIELD = 0,
+    SCL_WAIT_BACKOFF,
+    SCL_WAIT_PARK,
+    SCL_WAIT_ADAPTIVE,
+};
+
+typedef struct scl_wait_policy {
+    int strategy;
+    unsigned long long avg_hold; // ticks, updated by lock holders for SCL_WAIT_ADAPTIVE
+} scl_wait_policy_t;
+
+typedef struct scl_waiter {
+    const scl_wait_policy_t *policy;
+    scl_stats_slot_t *stats;
+    unsigned long long start;
+    unsigned long long budget;
+    unsigned long long idle; // ticks yielded or asleep
+    unsigned long long sleep_ns;
+    unsigned int spins;
+    unsigned int delay;
+} scl_waiter_t;
+
+SCL_SHARED int scl_waiter_ncpus;
+
+static inline void scl_wait_policy_init(scl_wait_policy_t *policy, int strategy) {
+    policy->strategy = strategy;
+    policy->avg_hold = 0;
+    if (0 == scl_waiter_ncpus)
+        scl_waiter_ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+// Called by the lock holder on release.
+static inline void scl_wait_policy_hold(scl_wait_policy_t *policy, unsigned long long hold) {
+    unsigned long long avg = policy->avg_hold;
+
+    if (SCL_WAIT_ADAPTIVE != policy->strategy)
+        return;
+    policy->avg_hold = 0 == avg ? hold :
+        (unsigned long long) ((long long) avg + (((long long) hold - (long long) avg) >> SCL_HOLD_EWMA_SHIFT));
+}
+
+static inline void scl_waiter_init(scl_waiter_t *w, const scl_wait_policy_t *policy, scl_stats_slot_t *stats) {
+    unsigned long long budget = SCL_SPIN_BUDGET;
+
+    w->policy = policy;
+    w->stats = stats;
+    w->start = scl_now();
+    w->idle = 0;
+    w->sleep_ns = SCL_SLEEP_MIN_NS;
+    w->spins = 0;
+    w->delay = 1;
+    if (SCL_WAIT_ADAPTIVE == policy->strategy) {
+        budget = 2 * scl_readvol(policy->avg_hold);
+        if (budget > SCL_SPIN_BUDGET_MAX || budget < SCL_SPIN_BUDGET_MIN)
+            budget = SCL_SPIN_BUDGET_MIN;
+    }
+    w->budget = scl_waiter_ncpus > 1 ? budget : 0;
+}
+
+static inline int scl_waiter_spinning(scl_waiter_t *w) {
+    if (SCL_WAIT_YIELD == w->policy->strategy)
+        return w->spins < SCL_WAIT_YIELD_SPINS;
+    return scl_now() - w->start - w->idle < w->budget;
+}
+
+static inline void scl_waiter_idle(scl_waiter_t *w, unsigned long long from) {
+    w->idle += scl_now() - from;
+}
+
+// Wait a little before the caller polls again.
+static void scl_waiter_pause(scl_waiter_t *w) {
+    unsigned long long from;
+
+    if (scl_waiter_spinning(w)) {
+        for (unsigned int i = 0; i < w->delay; i++)
+            __builtin_ia32_pause();
+        w->spins++;
+        if (SCL_WAIT_YIELD != w->policy->strategy && w->delay < SCL_BACKOFF_MAX)
+            w->delay <<= 1;
+        return;
+    }
+    from = scl_now();
+    if (SCL_WAIT_YIELD == w->policy->strategy) {
+        sched_yield();
+        w->spins = 0;
+        if (NULL != w->stats)
+            w->stats->c.yields++;
+    } else {
+        struct timespec ts = { 0, (long) w->sleep_ns };
+        nanosleep(&ts, NULL);
+        if (w->sleep_ns < SCL_SLEEP_MAX_NS)
+            w->sleep_ns <<= 1;
+        if (NULL != w->stats)
+            w->stats->c.parks++;
+    }
+    scl_waiter_idle(w, from);
+}
+
+/*
+ * Wait a little before polling *uaddr again. Past the spin budget,
+ * SCL_WAIT_PARK and SCL_WAIT_ADAPTIVE sleep on the futex while it holds val,
+ * at most until deadline (SCL_NO_DEADLINE waits until woken); whoever
+ * changes the word must wake it. Other strategies pause as usual.
+ */
+static inline void scl_waiter_park(scl_waiter_t *w, int *uaddr, int val, unsigned long long deadline) {
+    unsigned long long from;
+
+    if (w->policy->strategy < SCL_WAIT_PARK || scl_waiter_spinning(w)) {
+        scl_waiter_pause(w);
+        return;
+    }
+    from = scl_now();
+    scl_futex_wait_until(uaddr, val, deadline, NULL, 0);
+    if (NULL != w->stats)
+        w->stats->c.parks++;
+    scl_waiter_idle(w, from);
+}
+
+static inline void scl_waiter_done(scl_waiter_t *w) {
+    if (NULL != w->stats)
+        w->stats->c.spin += scl_now() - w->start - w->idle;
+}
+
+// Poll expr until it is false, waiting between polls as the policy says.
+#define scl_wait_while(policy, stats, expr) do {                  \
+    if (expr) {                                                   \
+        scl_waiter_t scl_waiter_;                                 \
+        scl_waiter_init(&scl_waiter_, (policy), (stats));         \
+        do scl_waiter_pause(&scl_waiter_); while (expr);          \
+        scl_waiter_done(&scl_waiter_);                            \
+    } } while (0)
+
+// Spin with pauses until expr is false, for waits bounded by a near deadline.
+#define scl_spin_while(expr) do {                                 \
+    while (expr)                                                  \
+        __builtin_ia32_pause(); } while (0)
+
+#endif // __SCL_WAITER_H__
@@ -0,0 +1,196 @@
+#ifndef __SCL_WEIGHT_H__
+#define __SCL_WEIGHT_H__
+
+/*
+ * Weights of threads that do not set one explicitly.
+ *
+ * With SCL_WEIGHT_NICE, the default, a thread's nice value maps through
+ * prio_to_weight as in CFS. SCL_WEIGHT_CGROUP also folds in the cgroup v2
+ * cpu.weight of every group from the thread's own up to the root: at each
+ * level the weight is scaled by the group's cpu.weight over the average of
+ * its populated siblings, so sibling groups share a lock in the proportion
+ * they share the CPU in, assuming each has as many threads contending.
+ * Threads of the root group, or without the cpu controller, keep their nice
+ * weight.
+ *
+ * Under either source SCHED_IDLE threads get the kernel's idle weight and
+ * real-time threads the weight of nice -20; SCHED_BATCH threads are
+ * weighted by nice value like SCHED_OTHER ones, as CFS does.
+ *
+ * The weight is cached per thread and recomputed at most every
+ * SCL_WEIGHT_REFRESH, so reading it costs a clock read. Locks look at it
+ * on release, keeping the system calls of a refresh off the acquire path.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include "clock.h"
+#include "prio.h"
+
+#ifndef SCHED_IDLE
+#define SCHED_IDLE 5
+#endif
+
+#define SCL_WEIGHT_REFRESH (CYCLE_PER_S * 1L)
+#define SCL_WEIGHT_IDLE 3 // WEIGHT_IDLEPRIO in the kernel
+
+enum scl_weight_source {
+    SCL_WEIGHT_NICE = 0,
+    SCL_WEIGHT_CGROUP,
+};
+
+SCL_SHARED int scl_weight_source;
+SCL_SHARED char scl_cgroup_root[PATH_MAX]; // cgroup2 mount point, empty if none
+SCL_SHARED pthread_once_t scl_cgroup_once = PTHREAD_ONCE_INIT;
+SCL_SHARED_TLS unsigned long long scl_weight_cached;
+SCL_SHARED_TLS unsigned long long scl_weight_expires;
+
+// Select where derived weights come from. Call before the locks are used.
+SCL_API void scl_weight_set_source(int source) {
+    scl_weight_source = source;
+}
+
+static void scl_cgroup_find_root(void) {
+    char line[1024], fstype[64];
+    FILE *f = fopen("/proc/self/mountinfo", "r");
+
+    if (NULL == f)
+        return;
+    while (NULL != fgets(line, sizeof(line), f)) {
+        // optional fields end with " - ", followed by the filesystem type
+        char *sep = strstr(line, " - ");
+        if (NULL == sep || 1 != sscanf(sep + 3, "%63s", fstype) || 0 != strcmp(fstype, "cgroup2"))
+            continue;
+        if (1 == sscanf(line, "%*s %*s %*s %*s %4095s", scl_cgroup_root))
+            break;
+    }
+    fclose(f);
+}
+
+// The calling thread's cgroup v2 path below the mount point.
+static int scl_cgroup_path(char *buf, size_t len) {
+    char line[PATH_MAX + 8];
+    FILE *f = fopen("/proc/thread-self/cgroup", "r");
+    int rc = ENOENT;
+
+    if (NULL == f)
+        return rc;
+    while (NULL != fgets(line, sizeof(line), f)) {
+        if (0 == strncmp(line, "0::", 3)) {
+            line[strcspn(line, "\n")] = '\0';
+            rc = snprintf(buf, len, "%s", line + 3) < (int) len ? 0 : ENAMETOOLONG;
+            break;
+        }
+    }
+    fclose(f);
+    return rc;
+}
+
+// cpu.weight of the group at path, 0 for the root group or without the cpu controller.
+static unsigned long long scl_cgroup_weight(const char *path) {
+    char file[PATH_MAX + 16];
+    unsigned long long weight = 0;
+    FILE *f;
+
+    if (snprintf(file, sizeof(file), "%s/cpu.weight", path) >= (int) sizeof(file) ||
+            NULL == (f = fopen(file, "r")))
+        return 0;
+    if (1 != fscanf(f, "%llu", &weight))
+        weight = 0;
+    fclose(f);
+    return weight;
+}
+
+static int scl_cgroup_populated(const char *path) {
+    char file[PATH_MAX + 16];
+    int populated = 0;
+    FILE *f;
+
+    if (snprintf(file, sizeof(file), "%s/cgroup.events", path) >= (int) sizeof(file) ||
+            NULL == (f = fopen(file, "r")))
+        return 0;
+    if (1 != fscanf(f, "populated %d", &populated))
+        populated = 0;
+    fclose(f);
+    return populated;
+}
+
+/*
+ * Product over the calling thread's cgroup and its ancestors of each
+ * group's cpu.weight over the average cpu.weight of its populated siblings.
+ */
+static double scl_cgroup_factor(void) {
+    char rel[PATH_MAX], path[PATH_MAX], sibling[PATH_MAX + 256], *slash;
+    double factor = 1;
+
+    pthread_once(&scl_cgroup_once, scl_cgroup_find_root);
+    if ('\0' == scl_cgroup_root[0] || 0 != scl_cgroup_path(rel, sizeof(rel)))
+        return 1;
+    while (NULL != (slash = strrchr(rel, '/')) && '\0' != slash[1]) {
+        unsigned long long weight, sum = 0, n = 0;
+        struct dirent *de;
+        DIR *d;
+
+        if (snprintf(path, sizeof(path), "%s%s", scl_cgroup_root, rel) >= (int) sizeof(path))
+            break;
+        weight = scl_cgroup_weight(path);
+        // go up to the parent
+        *slash = '\0';
+        if (0 == weight)
+            continue;
+        if (snprintf(path, sizeof(path), "%s%s", scl_cgroup_root, rel) >= (int) sizeof(path) ||
+                NULL == (d = opendir(path)))
+            continue;
+        while (NULL != (de = readdir(d))) {
+            unsigned long long w;
+            if ('.' == de->d_name[0] || DT_DIR != de->d_type)
+                continue;
+            if (snprintf(sibling, sizeof(sibling), "%s/%s", path, de->d_name) >= (int) sizeof(sibling))
+                continue;
+            if (0 != (w = scl_cgroup_weight(sibling)) && scl_cgroup_populated(sibling)) {
+                sum += w;
+                n++;
+            }
+        }
+        closedir(d);
+        if (0 != sum)
+            factor *= (double) weight * n / sum;
+    }
+    return factor;
+}
+
+static unsigned long long scl_weight_compute(void) {
+    int policy = sched_getscheduler(0);
+    unsigned long long weight;
+
+    if (SCHED_IDLE == policy)
+        weight = SCL_WEIGHT_IDLE;
+    else if (SCHED_FIFO == policy || SCHED_RR == policy)
+        weight = prio_to_weight[0];
+    else
+        weight = prio_to_weight[getpriority(PRIO_PROCESS, 0) + 20];
+    if (SCL_WEIGHT_CGROUP == scl_weight_source)
+        weight = (unsigned long long) (weight * scl_cgroup_factor() + 0.5);
+    return weight ? weight : 1;
+}
+
+// The calling thread's weight as of now, recomputed if the cache has expired.
+static inline unsigned long long scl_thread_weight_at(unsigned long long now) {
+    if (__builtin_expect(now < scl_weight_expires, 1))
+        return scl_weight_cached;
+    scl_weight_cached = scl_weight_compute();
+    scl_weight_expires = now + SCL_WEIGHT_REFRESH;
+    return scl_weight_cached;
+}
+
+static inline unsigned long long scl_thread_weight(void) {
+    return scl_thread_weight_at(scl_now());
+}
+
+#endif // __SCL_WEIGHT_H__
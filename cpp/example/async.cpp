@@ -0,0 +1,126 @@
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include "../scl_async.hpp"
+
+/*
+ * Usage: ./async <ntenants> <duration (s)>
+ *
+ * One event-loop thread runs tenants with weights 1024, 2048, ... as
+ * coroutines that take a scl::fair_mutex with scl::async_lock(), while a
+ * plain thread takes the same lock with std::lock_guard. The loop sleeps in
+ * ppoll() on the waiter's eventfd and timeout. Each tenant's share of the
+ * lock is printed at the end.
+ */
+
+using mutex_type = scl::fair_mutex<scl::fixed_slice<1000>, scl::no_spin, scl::wall_clock,
+                                   scl::with_stats>;
+
+// A coroutine nobody waits for; it frees itself when it returns.
+struct detached {
+    struct promise_type {
+        detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// Coroutines the loop resumes on its next turn.
+struct run_queue {
+    std::deque<std::coroutine_handle<>> ready;
+
+    auto yield() {
+        struct awaiter {
+            run_queue &q;
+            bool await_ready() { return false; }
+            void await_suspend(std::coroutine_handle<> h) { q.ready.push_back(h); }
+            void await_resume() {}
+        };
+        return awaiter{*this};
+    }
+};
+
+static void busy(std::chrono::microseconds d) {
+    auto end = std::chrono::steady_clock::now() + d;
+    while (std::chrono::steady_clock::now() < end)
+        ;
+}
+
+static detached tenant(mutex_type &m, scl::lock_waiter &waiter, scl::task &t, run_queue &q,
+                       const bool &stop, unsigned long long &count, int &live) {
+    while (!stop) {
+        {
+            auto guard = co_await scl::async_lock(m, waiter, t);
+            busy(std::chrono::microseconds(10));
+            count++;
+        }
+        // let the other tenants and the loop run between critical sections
+        co_await q.yield();
+    }
+    live--;
+}
+
+int main(int argc, char **argv) {
+    int ntenants = argc > 1 ? atoi(argv[1]) : 2;
+    int duration = argc > 2 ? atoi(argv[2]) : 1;
+    mutex_type m;
+    scl::lock_waiter waiter;
+    run_queue q;
+    std::vector<scl::task> tasks(ntenants);
+    std::vector<unsigned long long> counts(ntenants);
+    volatile bool thread_stop = false;
+    bool stop = false;
+    int live = ntenants;
+
+    std::thread other([&m, &thread_stop] {
+        while (!thread_stop) {
+            std::lock_guard<mutex_type> guard(m);
+            busy(std::chrono::microseconds(10));
+        }
+    });
+
+    for (int i = 0; i < ntenants; i++) {
+        tasks[i].set_weight(1024 * (i + 1));
+        tenant(m, waiter, tasks[i], q, stop, counts[i], live);
+    }
+    auto end = std::chrono::steady_clock::now() + std::chrono::seconds(duration);
+    while (live > 0) {
+        while (!q.ready.empty()) {
+            auto h = q.ready.front();
+            q.ready.pop_front();
+            h.resume();
+        }
+        stop = std::chrono::steady_clock::now() >= end;
+        if (waiter.empty())
+            continue;
+        struct pollfd pfd = { waiter.fd(), POLLIN, 0 };
+        struct timespec ts, *tsp = nullptr;
+        if (auto timeout = waiter.timeout()) {
+            ts.tv_sec = timeout->count() / 1000000000LL;
+            ts.tv_nsec = timeout->count() % 1000000000LL;
+            tsp = &ts;
+        }
+        ppoll(&pfd, 1, tsp, nullptr);
+        waiter.poll();
+    }
+    // while the thread runs, so that it shows up too
+    auto stats = m.stats();
+    thread_stop = true;
+    other.join();
+
+    for (int i = 0; i < ntenants; i++)
+        printf("tenant %d weight %d acquisitions %llu\n", i, 1024 * (i + 1), counts[i]);
+    for (const auto &t : stats)
+        printf("tid %d weight %llu acquisitions %llu entitled %.3f received %.3f\n", t.tid,
+               t.weight, t.acquisitions, t.entitled, t.received);
+    return 0;
+}
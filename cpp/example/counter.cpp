@@ -0,0 +1,20 @@
+#include <mutex>
+#include <shared_mutex>
+#include "counter.hpp"
+
+void bump(counter &c, int n) {
+    for (int i = 0; i < n; i++) {
+        std::lock_guard<counter_mutex> guard(c.mutex);
+        c.value++;
+    }
+}
+
+void record(counter &c, int slot) {
+    std::unique_lock<scl::fair_shared_mutex<scl::no_spin, scl::with_stats>> writer(c.table_mutex);
+    c.table[slot % 64]++;
+}
+
+unsigned long long lookup(counter &c, int slot) {
+    std::shared_lock<scl::fair_shared_mutex<scl::no_spin, scl::with_stats>> reader(c.table_mutex);
+    return c.table[slot % 64];
+}
@@ -0,0 +1,21 @@
+#ifndef __COUNTER_HPP__
+#define __COUNTER_HPP__
+
+#include "../scl.hpp"
+
+using counter_mutex = scl::fair_mutex<scl::fixed_slice<1000>, scl::spin<4>, scl::wall_clock,
+                                      scl::with_stats>;
+
+struct counter {
+    counter_mutex mutex;
+    scl::fair_shared_mutex<scl::no_spin, scl::with_stats> table_mutex;
+    unsigned long long value = 0;
+    unsigned long long table[64] = { 0 };
+};
+
+// Defined in counter.cpp, a second translation unit using the same locks.
+void bump(counter &c, int n);
+void record(counter &c, int slot);
+unsigned long long lookup(counter &c, int slot);
+
+#endif // __COUNTER_HPP__
@@ -0,0 +1,54 @@
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "counter.hpp"
+
+/*
+ * Usage: ./main <nthreads> <duration (s)>
+ *
+ * Threads with weights 1024, 2048, ... take turns on a scl::fair_mutex
+ * from two translation units; every so often the first one updates a
+ * table under a scl::fair_shared_mutex that the others read. The lock's
+ * statistics are printed at the end.
+ */
+int main(int argc, char **argv) {
+    int nthreads = argc > 1 ? atoi(argv[1]) : 2;
+    int duration = argc > 2 ? atoi(argv[2]) : 1;
+    std::vector<std::thread> threads;
+    volatile bool stop = false;
+    counter c;
+
+    for (int i = 0; i < nthreads; i++) {
+        threads.emplace_back([&c, &stop, i] {
+            c.mutex.set_weight(1024 * (i + 1));
+            for (unsigned long long n = 0; !stop; n++) {
+                bump(c, 16);
+                if (0 == n % 1024) {
+                    if (0 == i)
+                        record(c, n);
+                    else
+                        lookup(c, i);
+                }
+                std::unique_lock<counter_mutex> guard(c.mutex, std::chrono::milliseconds(1));
+                if (guard.owns_lock())
+                    c.value++;
+            }
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(duration));
+    // while the threads run, so that they show up individually
+    auto stats = c.mutex.stats();
+    stop = true;
+    for (auto &t : threads)
+        t.join();
+
+    printf("acquisitions %llu hold(ms) %.3f\n", stats.total().acquisitions,
+           stats.total().hold_ns / 1e6);
+    for (const auto &t : stats)
+        printf("tid %d weight %llu acquisitions %llu entitled %.3f received %.3f\n", t.tid,
+               t.weight, t.acquisitions, t.entitled, t.received);
+    return 0;
+}
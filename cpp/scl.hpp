@@ -0,0 +1,286 @@
+#ifndef __SCL_HPP__
+#define __SCL_HPP__
+
+/*
+ * Header-only C++17 interface to u-SCL and RW-SCL.
+ *
+ * scl::fair_mutex wraps a fairlock_t and meets the Lockable and
+ * TimedLockable requirements, so it works with std::lock_guard,
+ * std::unique_lock and std::scoped_lock. scl::fair_shared_mutex wraps an
+ * rwlock_t and meets SharedLockable, so it also works with
+ * std::shared_lock. scl::task is an accounting identity that u-SCL usage
+ * can be charged to instead of the calling thread, within an
+ * scl::task_scope; scl_async.hpp takes a fair_mutex from a C++20 coroutine
+ * on its behalf.
+ *
+ * Behaviour is chosen with policy types given as template arguments. A
+ * policy that is not selected leaves no code behind:
+ *
+ *   Slice  scl::default_slice, scl::fixed_slice<us> or
+ *          scl::adaptive_slice<min_us, max_us> (0 picks the defaults)
+ *   Spin   scl::no_spin, or scl::spin<n> to try the lock n times before
+ *          queueing
+ *   Clock  what critical sections are charged for: scl::wall_clock,
+ *          scl::cpu_clock or scl::hybrid_clock (see enum fairlock_charge)
+ *   Stats  scl::no_stats, or scl::with_stats for a stats() member that
+ *          snapshots the lock's counters
+ *
+ * The C headers give their functions and shared state inline linkage when
+ * compiled as C++, so this header can be included from any number of
+ * translation units. Errors from initialization are thrown as
+ * std::system_error, allocation failures as std::bad_alloc.
+ */
+
+#include <cerrno>
+#include <chrono>
+#include <ctime>
+#include <memory>
+#include <new>
+#include <system_error>
+#include <type_traits>
+#include "../u-scl/fairlock.h"
+#include "../RW-SCL/rwlock.h"
+
+namespace scl {
+
+struct default_slice {
+    static void apply(fairlock_t *) {}
+};
+
+template <unsigned long long SliceUs>
+struct fixed_slice {
+    static_assert(SliceUs > 0, "use default_slice for the default slice length");
+    static void apply(fairlock_t *lock) { fairlock_set_slice(lock, SliceUs); }
+};
+
+template <unsigned long long MinUs = 0, unsigned long long MaxUs = 0>
+struct adaptive_slice {
+    static_assert(MaxUs == 0 || MinUs <= MaxUs, "MinUs must not exceed MaxUs");
+    static void apply(fairlock_t *lock) { fairlock_set_adaptive(lock, MinUs, MaxUs); }
+};
+
+template <unsigned int Tries>
+struct spin {
+    static constexpr unsigned int tries = Tries;
+};
+
+using no_spin = spin<0>;
+
+template <enum fairlock_charge Charge>
+struct charge_clock {
+    static constexpr enum fairlock_charge charge = Charge;
+};
+
+using wall_clock = charge_clock<FAIRLOCK_CHARGE_WALL>;
+using cpu_clock = charge_clock<FAIRLOCK_CHARGE_CPU>;
+using hybrid_clock = charge_clock<FAIRLOCK_CHARGE_HYBRID>;
+
+struct no_stats {
+    static constexpr bool enabled = false;
+};
+
+struct with_stats {
+    static constexpr bool enabled = true;
+};
+
+// A snapshot of a lock's counters, see common/stats.h.
+class stats_snapshot {
+public:
+    explicit stats_snapshot(int (*take)(void *, scl_stats_snapshot_t *), void *lock) {
+        int rc = take(lock, &snap_);
+        if (ENOMEM == rc)
+            throw std::bad_alloc();
+    }
+    ~stats_snapshot() { scl_stats_snapshot_free(&snap_); }
+    stats_snapshot(const stats_snapshot &) = delete;
+    stats_snapshot &operator=(const stats_snapshot &) = delete;
+
+    const scl_stats_thread_t &total() const { return snap_.total; }
+    const scl_stats_thread_t *begin() const { return snap_.threads; }
+    const scl_stats_thread_t *end() const { return snap_.threads + snap_.nthreads; }
+    const scl_stats_snapshot_t &raw() const { return snap_; }
+
+private:
+    scl_stats_snapshot_t snap_;
+};
+
+namespace detail {
+
+template <class Spin, class TryLock>
+inline bool spin_try(TryLock try_lock) {
+    if constexpr (Spin::tries > 0) {
+        for (unsigned int i = 0; i < Spin::tries; i++) {
+            if (try_lock())
+                return true;
+            __builtin_ia32_pause();
+        }
+    }
+    return false;
+}
+
+// Convert a time point of any clock to an absolute CLOCK_MONOTONIC time.
+template <class Clock, class Duration>
+inline struct timespec to_monotonic(const std::chrono::time_point<Clock, Duration> &abs_time) {
+    using namespace std::chrono;
+    struct timespec now, ts;
+    nanoseconds rel = duration_cast<nanoseconds>(abs_time - Clock::now());
+    long long ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = now.tv_sec * 1000000000LL + now.tv_nsec + (rel.count() > 0 ? rel.count() : 0);
+    ts.tv_sec = ns / 1000000000LL;
+    ts.tv_nsec = ns % 1000000000LL;
+    return ts;
+}
+
+} // namespace detail
+
+// An accounting identity, see fairlock_task_t. Weight 0 is that of a nice 0 thread.
+class task {
+public:
+    explicit task(int weight = 0) { fairlock_task_init(&task_, weight); }
+    ~task() { fairlock_task_destroy(&task_); }
+    task(const task &) = delete;
+    task &operator=(const task &) = delete;
+
+    void set_weight(int weight) { fairlock_task_set_weight(&task_, weight); }
+
+    fairlock_task_t *native_handle() { return &task_; }
+
+private:
+    fairlock_task_t task_;
+};
+
+// Charges the calling thread's u-SCL acquisitions to a task while in scope,
+// see fairlock_task_switch().
+class task_scope {
+public:
+    explicit task_scope(task &t) : prev_(fairlock_task_switch(t.native_handle())) {}
+    ~task_scope() { fairlock_task_switch(prev_); }
+    task_scope(const task_scope &) = delete;
+    task_scope &operator=(const task_scope &) = delete;
+
+private:
+    fairlock_task_t *prev_;
+};
+
+template <class Slice = default_slice, class Spin = no_spin, class Clock = wall_clock,
+          class Stats = no_stats>
+class fair_mutex {
+public:
+    using native_handle_type = fairlock_t *;
+
+    fair_mutex() {
+        int rc = fairlock_init(&lock_);
+        if (0 != rc)
+            throw std::system_error(rc, std::generic_category(), "fairlock_init");
+        Slice::apply(&lock_);
+        if constexpr (Clock::charge != FAIRLOCK_CHARGE_WALL)
+            fairlock_set_charge(&lock_, Clock::charge);
+    }
+    ~fair_mutex() { fairlock_destroy(&lock_); }
+    fair_mutex(const fair_mutex &) = delete;
+    fair_mutex &operator=(const fair_mutex &) = delete;
+
+    void lock() {
+        if (detail::spin_try<Spin>([this] { return try_lock(); }))
+            return;
+        fairlock_acquire(&lock_);
+    }
+
+    bool try_lock() { return 0 == fairlock_trylock(&lock_); }
+
+    void unlock() { fairlock_release(&lock_); }
+
+    template <class Rep, class Period>
+    bool try_lock_for(const std::chrono::duration<Rep, Period> &rel_time) {
+        return try_lock_until(std::chrono::steady_clock::now() + rel_time);
+    }
+
+    template <class C, class Duration>
+    bool try_lock_until(const std::chrono::time_point<C, Duration> &abs_time) {
+        struct timespec ts = detail::to_monotonic(abs_time);
+        int rc = fairlock_timedlock(&lock_, &ts);
+        if (ENOMEM == rc)
+            throw std::bad_alloc();
+        return 0 == rc;
+    }
+
+    // Run f() under the lock, possibly on the thread that holds it (see
+    // fairlock_execute()). f must not throw, block or take the lock.
+    template <class F>
+    void execute(F &&f) {
+        fairlock_execute(&lock_, [](void *p) { (*static_cast<std::remove_reference_t<F> *>(p))(); },
+                         const_cast<void *>(static_cast<const void *>(std::addressof(f))));
+    }
+
+    // The calling thread's weight; 0 derives it from its scheduling parameters.
+    void set_weight(int weight) { fairlock_set_weight(&lock_, weight); }
+
+    template <class S = Stats, std::enable_if_t<S::enabled, int> = 0>
+    stats_snapshot stats() {
+        return stats_snapshot([](void *l, scl_stats_snapshot_t *s) {
+            return fairlock_stats(static_cast<fairlock_t *>(l), s);
+        }, &lock_);
+    }
+
+    native_handle_type native_handle() { return &lock_; }
+
+private:
+    fairlock_t lock_;
+};
+
+template <class Spin = no_spin, class Stats = no_stats>
+class fair_shared_mutex {
+public:
+    using native_handle_type = rwlock_t *;
+
+    fair_shared_mutex() {
+        int rc = rwlock_init(&lock_);
+        if (0 != rc)
+            throw std::system_error(rc, std::generic_category(), "rwlock_init");
+    }
+    ~fair_shared_mutex() { rwlock_destroy(&lock_); }
+    fair_shared_mutex(const fair_shared_mutex &) = delete;
+    fair_shared_mutex &operator=(const fair_shared_mutex &) = delete;
+
+    void lock() {
+        if (detail::spin_try<Spin>([this] { return try_lock(); }))
+            return;
+        rwlock_writer_lock(&lock_);
+    }
+
+    bool try_lock() { return 0 == rwlock_writer_trylock(&lock_); }
+
+    void unlock() { rwlock_writer_unlock(&lock_); }
+
+    void lock_shared() {
+        if (detail::spin_try<Spin>([this] { return try_lock_shared(); }))
+            return;
+        rwlock_reader_lock(&lock_);
+    }
+
+    bool try_lock_shared() { return 0 == rwlock_reader_trylock(&lock_); }
+
+    void unlock_shared() { rwlock_reader_unlock(&lock_); }
+
+    // The calling thread's weight as a writer and as a reader; 0 derives it from its scheduling parameters.
+    void set_weight(int weight) { rwlock_writer_set_weight(&lock_, weight); }
+    void set_shared_weight(int weight) { rwlock_reader_set_weight(&lock_, weight); }
+
+    template <class S = Stats, std::enable_if_t<S::enabled, int> = 0>
+    stats_snapshot stats() {
+        return stats_snapshot([](void *l, scl_stats_snapshot_t *s) {
+            return rwlock_stats(static_cast<rwlock_t *>(l), s);
+        }, &lock_);
+    }
+
+    native_handle_type native_handle() { return &lock_; }
+
+private:
+    rwlock_t lock_;
+};
+
+} // namespace scl
+
+#endif // __SCL_HPP__
@@ -0,0 +1,203 @@
+#ifndef __SCL_ASYNC_HPP__
+#define __SCL_ASYNC_HPP__
+
+/*
+ * C++20 coroutine acquisition of scl::fair_mutex, built on
+ * u-scl/fairlock_async.h, for event loops that must not block.
+ *
+ *     scl::lock_waiter waiter;             // one per event-loop thread
+ *     scl::task tenant(weight);            // who the usage is charged to
+ *     ...
+ *     auto guard = co_await scl::async_lock(mutex, waiter, tenant);
+ *
+ * A coroutine that cannot have the lock at once is suspended on the
+ * waiter. The loop watches waiter.fd() for readability, waits at most
+ * waiter.timeout(), and calls waiter.poll() after either; poll() resumes,
+ * on the loop thread, the coroutines that got their lock. With an
+ * io_uring, submit a poll or a read of fd() and a timeout, or wait with
+ * io_uring_wait_cqe_timeout(). The guard releases the lock when it goes
+ * out of scope, charging the task.
+ *
+ * A coroutine destroyed while it waits gives up its acquisition.
+ */
+
+#include <chrono>
+#include <coroutine>
+#include <optional>
+#include <new>
+#include <system_error>
+#include <utility>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "scl.hpp"
+#include "../u-scl/fairlock_async.h"
+
+namespace scl {
+
+// Ownership of a lock taken with async_lock(); movable like std::unique_lock.
+class async_guard {
+public:
+    async_guard() = default;
+    explicit async_guard(const fairlock_async_t &req) : req_(req), owns_(true) {}
+    async_guard(async_guard &&other) noexcept : req_(other.req_), owns_(std::exchange(other.owns_, false)) {}
+    async_guard &operator=(async_guard &&other) noexcept {
+        if (this != &other) {
+            unlock();
+            req_ = other.req_;
+            owns_ = std::exchange(other.owns_, false);
+        }
+        return *this;
+    }
+    ~async_guard() { unlock(); }
+
+    bool owns_lock() const { return owns_; }
+    explicit operator bool() const { return owns_; }
+
+    void unlock() {
+        if (owns_) {
+            fairlock_async_release(&req_);
+            owns_ = false;
+        }
+    }
+
+private:
+    fairlock_async_t req_;
+    bool owns_ = false;
+};
+
+class lock_waiter;
+
+class lock_awaiter {
+public:
+    lock_awaiter(fairlock_t *lock, lock_waiter &waiter, fairlock_task_t *task) : waiter_(waiter) {
+        if (0 != (rc_ = fairlock_async_start(&req_, lock, task, fd_of(waiter))))
+            throw std::bad_alloc();
+    }
+    lock_awaiter(const lock_awaiter &) = delete;
+    lock_awaiter &operator=(const lock_awaiter &) = delete;
+    inline ~lock_awaiter();
+
+    bool await_ready() { return EAGAIN != (rc_ = fairlock_async_poll(&req_)); }
+    inline void await_suspend(std::coroutine_handle<> h);
+
+    async_guard await_resume() {
+        if (ENOMEM == rc_)
+            throw std::bad_alloc();
+        return async_guard(req_);
+    }
+
+private:
+    friend class lock_waiter;
+    static inline int fd_of(lock_waiter &waiter);
+
+    fairlock_async_t req_;
+    lock_waiter &waiter_;
+    std::coroutine_handle<> handle_;
+    lock_awaiter *next_ = nullptr;
+    lock_awaiter **pprev_ = nullptr; // non-null while suspended on the waiter
+    int rc_;
+};
+
+/*
+ * The coroutines of one event-loop thread that wait for a lock, and the
+ * eventfd that tells the loop to look at them again. Used from that thread
+ * only. poll() polls every waiting acquisition, so it costs time linear in
+ * their number.
+ */
+class lock_waiter {
+public:
+    lock_waiter() : fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+        if (fd_ < 0)
+            throw std::system_error(errno, std::generic_category(), "eventfd");
+    }
+    // Closes the eventfd, which releases of the locks by other threads may
+    // still signal; see fairlock_async.h for when that is safe.
+    ~lock_waiter() { close(fd_); }
+    lock_waiter(const lock_waiter &) = delete;
+    lock_waiter &operator=(const lock_waiter &) = delete;
+
+    int fd() const { return fd_; }
+
+    bool empty() const { return nullptr == waiting_; }
+
+    // How long the loop may wait for fd() before it has to poll(), none if indefinitely.
+    std::optional<std::chrono::nanoseconds> timeout() const {
+        std::optional<std::chrono::nanoseconds> t;
+        for (lock_awaiter *a = waiting_; nullptr != a; a = a->next_) {
+            long long ns = fairlock_async_timeout_ns(&a->req_);
+            if (ns >= 0 && (!t || std::chrono::nanoseconds(ns) < *t))
+                t = std::chrono::nanoseconds(ns);
+        }
+        return t;
+    }
+
+    // Resume the coroutines whose acquisition has completed.
+    void poll() {
+        lock_awaiter *ready = nullptr, **tail = &ready, *a;
+        eventfd_t count;
+
+        eventfd_read(fd_, &count);
+        for (lock_awaiter **p = &waiting_; nullptr != (a = *p);) {
+            if (EAGAIN == (a->rc_ = fairlock_async_poll(&a->req_))) {
+                p = &a->next_;
+                continue;
+            }
+            unlink(a);
+            *tail = a;
+            tail = &a->next_;
+        }
+        // resuming may suspend the coroutines on this waiter again
+        while (nullptr != (a = ready)) {
+            ready = a->next_;
+            a->handle_.resume();
+        }
+    }
+
+private:
+    friend class lock_awaiter;
+
+    void link(lock_awaiter *a) {
+        a->next_ = waiting_;
+        if (nullptr != waiting_)
+            waiting_->pprev_ = &a->next_;
+        a->pprev_ = &waiting_;
+        waiting_ = a;
+    }
+
+    void unlink(lock_awaiter *a) {
+        if (nullptr != a->next_)
+            a->next_->pprev_ = a->pprev_;
+        *a->pprev_ = a->next_;
+        a->next_ = nullptr;
+        a->pprev_ = nullptr;
+    }
+
+    int fd_;
+    lock_awaiter *waiting_ = nullptr;
+};
+
+inline int lock_awaiter::fd_of(lock_waiter &waiter) {
+    return waiter.fd_;
+}
+
+inline lock_awaiter::~lock_awaiter() {
+    if (nullptr != pprev_) {
+        waiter_.unlink(this);
+        fairlock_async_cancel(&req_);
+    }
+}
+
+inline void lock_awaiter::await_suspend(std::coroutine_handle<> h) {
+    handle_ = h;
+    waiter_.link(this);
+}
+
+// Acquire m on behalf of t without blocking the thread; co_await the result.
+template <class... Policies>
+lock_awaiter async_lock(fair_mutex<Policies...> &m, lock_waiter &waiter, task &t) {
+    return lock_awaiter(m.native_handle(), waiter, t.native_handle());
+}
+
+} // namespace scl
+
+#endif // __SCL_ASYNC_HPP__
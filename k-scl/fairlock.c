@@ -2,30 +2,101 @@
 #include <linux/slab.h>
 #include <linux/export.h>
 #include <linux/fairlock.h>
+#include <linux/sched/clock.h>
+#include <linux/sched/cputime.h>
+#include <linux/math64.h>
 #include <asm/current.h>
+#include <asm/tsc.h>
 
 /*
- * This value will change depending on the CPU-SPEED.
- * Please set the value accordingly.
+ * Lock usage is measured in TSC cycles when the TSC is invariant, and in
+ * local_clock() nanoseconds otherwise. The TSC rate is the one the kernel
+ * calibrated at boot, so no per-machine constant is needed.
  */
-#define INACTIVE_THRESHOLD 2400000000 /* about 1 sec */
+static inline bool fairlock_tsc_usable(void)
+{
+	return boot_cpu_has(X86_FEATURE_CONSTANT_TSC) &&
+	       boot_cpu_has(X86_FEATURE_NONSTOP_TSC) && tsc_khz;
+}
+
+static inline unsigned long long fairlock_now(void)
+{
+	if (likely(fairlock_tsc_usable()))
+		return rdtsc();
+	return local_clock();
+}
+
+static inline unsigned long long fairlock_ticks_per_sec(void)
+{
+	if (likely(fairlock_tsc_usable()))
+		return tsc_khz * 1000ULL;
+	return NSEC_PER_SEC;
+}
+
+#define INACTIVE_THRESHOLD fairlock_ticks_per_sec() /* 1 sec */
+
+static inline unsigned long long fairlock_ns_to_ticks(u64 ns)
+{
+	if (likely(fairlock_tsc_usable()))
+		return mul_u64_u32_div(ns, tsc_khz, USEC_PER_SEC);
+	return ns;
+}
 
 struct fairlock_waiter {
 	unsigned long long banned_until;
 	unsigned long long start_ticks;
 	unsigned long long end_ticks;
+#ifdef CONFIG_FAIRLOCK_CHARGE_CPU
+	unsigned long nr_switches;
+	u64 start_runtime;
+#endif
 	struct hlist_node hash;
 	struct list_head list;
 	pid_t pid;
 };
 
+/*
+ * With CONFIG_FAIRLOCK_CHARGE_CPU the holder is charged for the time it
+ * actually ran inside the critical section. If it was not switched out, a
+ * check of two counters, the wall time is exact. Otherwise the charge is
+ * the growth of its runtime, which costs a runqueue lock to read. The
+ * runtime at the start is read without the runqueue lock and may miss up to
+ * a tick, so the charge can be too high by that much but never too low.
+ */
+static inline void fairlock_start_cs(struct fairlock_waiter *waiter,
+				     unsigned long long now)
+{
+	waiter->start_ticks = now;
+#ifdef CONFIG_FAIRLOCK_CHARGE_CPU
+	waiter->nr_switches = current->nvcsw + current->nivcsw;
+	waiter->start_runtime = current->se.sum_exec_runtime;
+#endif
+}
+
+static inline unsigned long long
+fairlock_cs_length(struct fairlock_waiter *waiter, unsigned long long now)
+{
+	unsigned long long cs_length = now - waiter->start_ticks;
+#ifdef CONFIG_FAIRLOCK_CHARGE_CPU
+	unsigned long long ran;
+
+	if (waiter->nr_switches == current->nvcsw + current->nivcsw)
+		return cs_length;
+	ran = fairlock_ns_to_ticks(task_sched_runtime(current) -
+				   waiter->start_runtime);
+	if (ran < cs_length)
+		cs_length = ran;
+#endif
+	return cs_length;
+}
+
 inline struct fairlock_waiter *create_waiter(struct fairlock *lock)
 {
 	unsigned long long now;
 	struct fairlock_waiter *waiter;
 	pid_t pid;
 
-	now = rdtsc();
+	now = fairlock_now();
 	waiter = kmalloc(sizeof(struct fairlock_waiter), GFP_KERNEL);
 	if (!waiter) {
 		return waiter;
@@ -33,7 +104,7 @@ inline struct fairlock_waiter *create_waiter(struct fairlock *lock)
 	pid = get_current()->pid;
 	waiter->pid = pid;
 	waiter->banned_until = now;
-	waiter->start_ticks = now;
+	fairlock_start_cs(waiter, now);
 	waiter->end_ticks = now;
 	INIT_LIST_HEAD(&waiter->list);
 	list_add_tail(&waiter->list, &lock->waiters);
@@ -93,11 +164,11 @@ int fair_trylock(struct fairlock *lock)
 			return 0;
 		}
 	} else {
-		if (waiter->end_ticks < waiter->banned_until && rdtsc() < waiter->banned_until) {
+		if (waiter->end_ticks < waiter->banned_until && fairlock_now() < waiter->banned_until) {
 			atomic_inc(&lock->now_serving);
 			return 0;
 		}
-		waiter->start_ticks = rdtsc();
+		fairlock_start_cs(waiter, fairlock_now());
 	}
 	lock->holder = waiter;
 	return 1;
@@ -123,15 +194,15 @@ void fair_lock(struct fairlock *lock)
 		}
 		lock->holder = waiter;
 	} else {
-		if (waiter->end_ticks < waiter->banned_until && rdtsc() < waiter->banned_until) {
+		if (waiter->end_ticks < waiter->banned_until && fairlock_now() < waiter->banned_until) {
 			atomic_inc(&lock->now_serving);
 			do {
 				cond_resched();
-			} while (rdtsc() < waiter->banned_until);
+			} while (fairlock_now() < waiter->banned_until);
 			my_ticket = atomic_fetch_inc(&lock->next_ticket);
 			while (atomic_read(&lock->now_serving) != my_ticket);
 		}
-		waiter->start_ticks = rdtsc();
+		fairlock_start_cs(waiter, fairlock_now());
 		lock->holder = waiter;
 	}
 }
@@ -145,11 +216,11 @@ void fair_unlock(struct fairlock *lock)
 	unsigned long long now;
 
 	waiter = lock->holder;
-	now = rdtsc();
+	now = fairlock_now();
 	waiter->end_ticks = now;
 	num_threads = atomic_read(&lock->num_threads);
 	if (num_threads > 1) {
-		cs_length = now - waiter->start_ticks;
+		cs_length = fairlock_cs_length(waiter, now);
 		waiter->banned_until += cs_length * num_threads;
 
 		list_for_each_entry_safe_reverse(prev_waiter, tmp, &waiter->list, list) {
@@ -0,0 +1,129 @@
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Usage: LD_PRELOAD=../libsclpreload.so ./timed [nthreads] [iterations]
+ *
+ * Exercises the C++ timed waits, which libstdc++ builds on the
+ * pthread_*_clock* functions of glibc 2.30 rather than the older timed
+ * ones, so that they run on the SCLs too:
+ *
+ *   - a condition_variable::wait_for(3s) notified after 100 ms must return
+ *     after about 100 ms;
+ *   - timed_mutex::try_lock_for must keep the mutex exclusive, and time out
+ *     when the mutex stays held;
+ *   - shared_timed_mutex::try_lock_for and try_lock_shared_for must keep
+ *     writers exclusive of each other and of readers.
+ *
+ * Exits with 1 on the first check that fails.
+ */
+
+using namespace std::chrono;
+
+static int failed;
+
+static void check(bool ok, const char *what) {
+    printf("%s: %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+        failed = 1;
+}
+
+static void condvar_wait_for() {
+    std::mutex m;
+    std::condition_variable cv;
+    bool ready = false;
+    auto start = steady_clock::now();
+
+    std::unique_lock<std::mutex> lock(m);
+    std::thread notifier([&] {
+        std::this_thread::sleep_for(milliseconds(100));
+        std::lock_guard<std::mutex> guard(m);
+        ready = true;
+        cv.notify_one();
+    });
+    bool woken = cv.wait_for(lock, seconds(3), [&] { return ready; });
+    auto waited = duration_cast<milliseconds>(steady_clock::now() - start).count();
+    lock.unlock();
+    notifier.join();
+    printf("wait_for returned after %lld ms\n", (long long) waited);
+    check(woken && waited < 1000, "condition_variable::wait_for");
+}
+
+static void timed_mutex_exclusion(int nthreads, int iterations) {
+    std::timed_mutex m;
+    long counter = 0;
+    std::vector<std::thread> threads;
+
+    for (int i = 0; i < nthreads; i++)
+        threads.emplace_back([&] {
+            for (int j = 0; j < iterations; j++) {
+                while (!m.try_lock_for(milliseconds(10)))
+                    ;
+                // not atomic: a second owner would lose increments
+                long v = counter;
+                std::this_thread::yield();
+                counter = v + 1;
+                m.unlock();
+            }
+        });
+    for (auto &t : threads)
+        t.join();
+    check(counter == (long) nthreads * iterations, "timed_mutex::try_lock_for exclusion");
+
+    m.lock();
+    auto start = steady_clock::now();
+    bool got = false;
+    std::thread waiter([&] { got = m.try_lock_for(milliseconds(50)); });
+    waiter.join();
+    auto waited = duration_cast<milliseconds>(steady_clock::now() - start).count();
+    m.unlock();
+    check(!got && waited >= 50 && waited < 1000, "timed_mutex::try_lock_for timeout");
+}
+
+static void shared_timed_mutex_exclusion(int nthreads, int iterations) {
+    std::shared_timed_mutex rw;
+    long a = 0, b = 0;
+    bool torn = false;
+    std::vector<std::thread> threads;
+
+    for (int i = 0; i < nthreads; i++)
+        threads.emplace_back([&, i] {
+            for (int j = 0; j < iterations; j++) {
+                if (i % 2) {
+                    while (!rw.try_lock_shared_for(milliseconds(10)))
+                        ;
+                    // writers keep a and b equal while they hold the lock
+                    if (a != b)
+                        torn = true;
+                    rw.unlock_shared();
+                } else {
+                    while (!rw.try_lock_for(milliseconds(10)))
+                        ;
+                    a++;
+                    std::this_thread::yield();
+                    b++;
+                    rw.unlock();
+                }
+            }
+        });
+    for (auto &t : threads)
+        t.join();
+    check(!torn && a == b && a == (long) (nthreads + 1) / 2 * iterations,
+          "shared_timed_mutex::try_lock_for exclusion");
+}
+
+int main(int argc, char **argv) {
+    int nthreads = argc > 1 ? atoi(argv[1]) : 4;
+    int iterations = argc > 2 ? atoi(argv[2]) : 10000;
+
+    condvar_wait_for();
+    timed_mutex_exclusion(nthreads, iterations);
+    shared_timed_mutex_exclusion(nthreads, iterations);
+    return failed;
+}
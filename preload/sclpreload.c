@@ -0,0 +1,1033 @@
+/*
+ * LD_PRELOAD interposer that turns an unmodified program's pthread mutexes
+ * into u-SCLs and its pthread rwlocks into RW-SCLs.
+ *
+ *     LD_PRELOAD=./libsclpreload.so SCL_PRELOAD_REPORT=stderr ./app
+ *
+ * The SCL state lives in a side table keyed by the address of the pthread
+ * object, created the first time the object is locked; the pthread object
+ * itself stays untouched. Only plain mutexes (PTHREAD_MUTEX_NORMAL, the
+ * default, and PTHREAD_MUTEX_ADAPTIVE_NP) and process-private rwlocks are
+ * routed. Recursive, error-checking, robust, priority-inheritance and
+ * process-shared ones keep their native implementation, as u-SCL has none
+ * of those semantics. The type is read from the object on every call, so
+ * statically initialized locks are covered without interposing the init
+ * functions.
+ *
+ * Condition variables keep their native implementation. A thread waiting
+ * on a routed mutex takes the mutex's untouched native storage before it
+ * releases the u-SCL and hands that to pthread_cond_wait(), and signals and
+ * broadcasts on a condition variable last waited on with a routed mutex
+ * are sent under the same native mutex, so no wakeup falls between the
+ * release and the wait.
+ *
+ * The timed functions are interposed along with their clockid_t variants
+ * (pthread_mutex_clocklock() and the like, glibc 2.30), which C++ timed
+ * waits such as condition_variable::wait_for() call. Deadlines on either
+ * clock are converted to CLOCK_MONOTONIC, which the SCLs time out on.
+ *
+ * Environment:
+ *
+ *   SCL_PRELOAD_MODE    scl (default) routes locks to the SCLs; report
+ *                       keeps every lock native and only counts
+ *                       acquisitions, contended acquisitions, wait and hold
+ *                       times per lock, to see which locks matter before
+ *                       switching them
+ *   SCL_PRELOAD_ALLOW   comma-separated allow-list; when set, only these
+ *                       locks are routed or counted. An entry is a lock
+ *                       address (0x601040), the function a lock is first
+ *                       taken from (worker), or that call site as
+ *                       module+offset (app+0x1a2b), as printed in the report
+ *   SCL_PRELOAD_REPORT  where to write the per-lock report at exit: a file
+ *                       name, or stderr; report mode defaults to stderr
+ *   SCL_PRELOAD_LOCKS   side table size, rounded up to a power of two
+ *                       (at least 2, default 65536); locks that find no
+ *                       room in it stay native
+ *   SCL_PRELOAD_SLICE_US  u-SCL slice length, see fairlock_set_slice()
+ *   SCL_PRELOAD_WEIGHTS   cgroup to weight threads by cgroup v2 cpu.weight
+ *                       as well as by nice value (common/weight.h)
+ *
+ * Which locks are routed is decided when an address is first locked, so a
+ * call-site entry matches the site of that first acquisition. Destroying a
+ * mutex, rwlock or condition variable drops its entry and frees its SCL, so
+ * a lock created later at the same address is decided afresh, and the
+ * destroyed lock no longer appears in the report. A lock reinitialized
+ * without being destroyed inherits the decision and the SCL state.
+ *
+ * A lock's entry lies within PL_MAX_PROBE slots of where its address
+ * hashes, so a full table costs a bounded probe per call, and a lock that
+ * finds no free slot there stays native.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <dlfcn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+/*
+ * The SCLs take pthread mutexes of their own; send those straight to the
+ * native functions rather than back into the interposer.
+ */
+static int pl_native_mutex_lock(pthread_mutex_t *m);
+static int pl_native_mutex_trylock(pthread_mutex_t *m);
+static int pl_native_mutex_unlock(pthread_mutex_t *m);
+#define pthread_mutex_lock pl_native_mutex_lock
+#define pthread_mutex_trylock pl_native_mutex_trylock
+#define pthread_mutex_unlock pl_native_mutex_unlock
+#include "../u-scl/fairlock.h"
+#include "../RW-SCL/rwlock.h"
+#undef pthread_mutex_lock
+#undef pthread_mutex_trylock
+#undef pthread_mutex_unlock
+
+#define PL_DEFAULT_LOCKS 65536
+#define PL_HASH_MUL 0x9E3779B97F4A7C15ULL
+#define PL_MAX_PROBE 64
+#define PL_TOMBSTONE ((void *) 1) // key of a slot whose lock was destroyed
+// timed waits on the condition variable's own clock, not a given one
+#define PL_COND_CLOCK ((clockid_t) -1)
+
+// the functions taking a clockid_t, which C++ timed waits use (glibc 2.30)
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 30)
+#define PL_CLOCK_VARIANTS 1
+#else
+#define PL_CLOCK_VARIANTS 0
+#endif
+
+enum pl_mode {
+    PL_MODE_SCL = 0,
+    PL_MODE_REPORT,
+};
+
+enum pl_kind {
+    PL_NATIVE = 0,
+    PL_MUTEX,
+    PL_RWLOCK,
+    PL_COND,
+};
+
+typedef struct pl_lock {
+    int kind; // enum pl_kind
+    pid_t writer; // thread holding an rwlock for writing, 0 if none
+    void *addr;
+    void *site; // return address of the call that first took the lock
+    pthread_mutex_t *mutex; // condition variables: mutex of the last wait
+    // report mode, native locks
+    ull acquisitions;
+    ull contended;
+    ull wait;
+    ull wait_max;
+    ull hold;
+    ull hold_start;
+    union {
+        fairlock_t mutex;
+        rwlock_t rw;
+    } scl;
+} pl_lock_t;
+
+typedef struct pl_slot {
+    void *key; // lock address, NULL if never used, or PL_TOMBSTONE
+    pl_lock_t *lock; // NULL while the lock is being created
+} pl_slot_t;
+
+enum pl_allow_kind {
+    PL_ALLOW_ADDR = 0,
+    PL_ALLOW_FUNCTION,
+    PL_ALLOW_SITE,
+};
+
+typedef struct pl_allow {
+    int kind;
+    uintptr_t addr; // lock address, or site offset in the module
+    char *name; // function, or module basename
+} pl_allow_t;
+
+static struct {
+    int (*mutex_lock)(pthread_mutex_t *);
+    int (*mutex_trylock)(pthread_mutex_t *);
+    int (*mutex_timedlock)(pthread_mutex_t *, const struct timespec *);
+    int (*mutex_unlock)(pthread_mutex_t *);
+    int (*mutex_destroy)(pthread_mutex_t *);
+    int (*rwlock_rdlock)(pthread_rwlock_t *);
+    int (*rwlock_wrlock)(pthread_rwlock_t *);
+    int (*rwlock_tryrdlock)(pthread_rwlock_t *);
+    int (*rwlock_trywrlock)(pthread_rwlock_t *);
+    int (*rwlock_timedrdlock)(pthread_rwlock_t *, const struct timespec *);
+    int (*rwlock_timedwrlock)(pthread_rwlock_t *, const struct timespec *);
+    int (*rwlock_unlock)(pthread_rwlock_t *);
+    int (*rwlock_destroy)(pthread_rwlock_t *);
+    int (*cond_wait)(pthread_cond_t *, pthread_mutex_t *);
+    int (*cond_timedwait)(pthread_cond_t *, pthread_mutex_t *, const struct timespec *);
+    int (*cond_signal)(pthread_cond_t *);
+    int (*cond_broadcast)(pthread_cond_t *);
+    int (*cond_destroy)(pthread_cond_t *);
+#if PL_CLOCK_VARIANTS
+    int (*mutex_clocklock)(pthread_mutex_t *, clockid_t, const struct timespec *);
+    int (*rwlock_clockrdlock)(pthread_rwlock_t *, clockid_t, const struct timespec *);
+    int (*rwlock_clockwrlock)(pthread_rwlock_t *, clockid_t, const struct timespec *);
+    int (*cond_clockwait)(pthread_cond_t *, pthread_mutex_t *, clockid_t, const struct timespec *);
+#endif
+} pl_real;
+
+static volatile int pl_ready;
+static int pl_mode;
+static pl_slot_t *pl_table;
+static pthread_mutex_t pl_table_lock = PTHREAD_MUTEX_INITIALIZER; // claims and frees slots
+static ull pl_mask;
+static int pl_hash_shift;
+static pl_allow_t *pl_allow;
+static int pl_nallow;
+static ull pl_slice_us;
+static const char *pl_report;
+static scl_wait_policy_t pl_waiting;
+// locks that stayed native: not allowed, no memory, or no room in the table
+static ull pl_skipped;
+static ull pl_failed;
+static ull pl_full;
+static pl_lock_t pl_native_lock = { .kind = PL_NATIVE };
+static __thread pid_t pl_tid;
+
+static int pl_native_mutex_lock(pthread_mutex_t *m) {
+    return pl_real.mutex_lock(m);
+}
+
+static int pl_native_mutex_trylock(pthread_mutex_t *m) {
+    return pl_real.mutex_trylock(m);
+}
+
+static int pl_native_mutex_unlock(pthread_mutex_t *m) {
+    return pl_real.mutex_unlock(m);
+}
+
+static void *pl_sym(const char *name, const char *version) {
+    void *f = NULL;
+
+    // an unversioned lookup may find the compatibility version of a symbol
+    if (NULL != version)
+        f = dlvsym(RTLD_NEXT, name, version);
+    if (NULL == f)
+        f = dlsym(RTLD_NEXT, name);
+    if (NULL == f) {
+        fprintf(stderr, "scl-preload: cannot find %s\n", name);
+        abort();
+    }
+    return f;
+}
+
+static void pl_resolve(void) {
+    pl_real.mutex_lock = pl_sym("pthread_mutex_lock", NULL);
+    pl_real.mutex_trylock = pl_sym("pthread_mutex_trylock", NULL);
+    pl_real.mutex_timedlock = pl_sym("pthread_mutex_timedlock", NULL);
+    pl_real.mutex_unlock = pl_sym("pthread_mutex_unlock", NULL);
+    pl_real.mutex_destroy = pl_sym("pthread_mutex_destroy", NULL);
+    pl_real.rwlock_rdlock = pl_sym("pthread_rwlock_rdlock", NULL);
+    pl_real.rwlock_wrlock = pl_sym("pthread_rwlock_wrlock", NULL);
+    pl_real.rwlock_tryrdlock = pl_sym("pthread_rwlock_tryrdlock", NULL);
+    pl_real.rwlock_trywrlock = pl_sym("pthread_rwlock_trywrlock", NULL);
+    pl_real.rwlock_timedrdlock = pl_sym("pthread_rwlock_timedrdlock", NULL);
+    pl_real.rwlock_timedwrlock = pl_sym("pthread_rwlock_timedwrlock", NULL);
+    pl_real.rwlock_unlock = pl_sym("pthread_rwlock_unlock", NULL);
+    pl_real.rwlock_destroy = pl_sym("pthread_rwlock_destroy", NULL);
+#if defined(__x86_64__)
+#define PL_COND_VERSION "GLIBC_2.3.2"
+#else
+#define PL_COND_VERSION NULL
+#endif
+    pl_real.cond_wait = pl_sym("pthread_cond_wait", PL_COND_VERSION);
+    pl_real.cond_timedwait = pl_sym("pthread_cond_timedwait", PL_COND_VERSION);
+    pl_real.cond_signal = pl_sym("pthread_cond_signal", PL_COND_VERSION);
+    pl_real.cond_broadcast = pl_sym("pthread_cond_broadcast", PL_COND_VERSION);
+    pl_real.cond_destroy = pl_sym("pthread_cond_destroy", PL_COND_VERSION);
+#if PL_CLOCK_VARIANTS
+    pl_real.mutex_clocklock = pl_sym("pthread_mutex_clocklock", NULL);
+    pl_real.rwlock_clockrdlock = pl_sym("pthread_rwlock_clockrdlock", NULL);
+    pl_real.rwlock_clockwrlock = pl_sym("pthread_rwlock_clockwrlock", NULL);
+    pl_real.cond_clockwait = pl_sym("pthread_cond_clockwait", NULL);
+#endif
+}
+
+static void pl_parse_allow(const char *list) {
+    char *copy = strdup(list), *save = NULL, *tok, *plus;
+    int cap = 1;
+
+    if (NULL == copy)
+        return;
+    for (const char *p = list; *p; p++)
+        cap += ',' == *p;
+    if (NULL == (pl_allow = (pl_allow_t *) calloc(cap, sizeof(pl_allow_t))))
+        return;
+    for (tok = strtok_r(copy, ",", &save); NULL != tok; tok = strtok_r(NULL, ",", &save)) {
+        pl_allow_t *a = &pl_allow[pl_nallow];
+        if (0 == strncmp(tok, "0x", 2)) {
+            a->kind = PL_ALLOW_ADDR;
+            a->addr = strtoull(tok, NULL, 16);
+        } else if (NULL != (plus = strrchr(tok, '+'))) {
+            *plus = '\0';
+            a->kind = PL_ALLOW_SITE;
+            a->name = tok;
+            a->addr = strtoull(plus + 1, NULL, 16);
+        } else {
+            a->kind = PL_ALLOW_FUNCTION;
+            a->name = tok;
+        }
+        pl_nallow++;
+    }
+    // the names point into copy, which lives as long as the process
+}
+
+static void pl_report_write(void);
+
+static void pl_configure(void) {
+    const char *s;
+    // at least two slots, as a shift by 64 in pl_home() is undefined
+    ull n = 2, locks = PL_DEFAULT_LOCKS;
+
+    if (NULL != (s = getenv("SCL_PRELOAD_MODE")) && 0 == strcmp(s, "report"))
+        pl_mode = PL_MODE_REPORT;
+    if (NULL != (s = getenv("SCL_PRELOAD_LOCKS")) && 0 != strtoull(s, NULL, 0))
+        locks = strtoull(s, NULL, 0);
+    while (n < locks && n < (1ULL << 40))
+        n <<= 1;
+    pl_hash_shift = 64 - __builtin_ctzll(n);
+    if (NULL == (pl_table = (pl_slot_t *) calloc(n, sizeof(pl_slot_t))))
+        n = 0;
+    pl_mask = n - 1;
+    if (NULL != (s = getenv("SCL_PRELOAD_ALLOW")) && '\0' != *s)
+        pl_parse_allow(s);
+    if (NULL != (s = getenv("SCL_PRELOAD_SLICE_US")))
+        pl_slice_us = strtoull(s, NULL, 0);
+    if (NULL != (s = getenv("SCL_PRELOAD_WEIGHTS")) && 0 == strcmp(s, "cgroup"))
+        scl_weight_set_source(SCL_WEIGHT_CGROUP);
+    pl_report = getenv("SCL_PRELOAD_REPORT");
+    if (NULL == pl_report && PL_MODE_REPORT == pl_mode)
+        pl_report = "stderr";
+    scl_clock_init();
+    scl_wait_init();
+    scl_wait_policy_init(&pl_waiting, SCL_WAIT_YIELD);
+    if (NULL != pl_report)
+        atexit(pl_report_write);
+}
+
+/*
+ * Set up on the first interposed call, which may come from another
+ * library's constructor before ours has run.
+ */
+__attribute__ ((constructor)) static void pl_init(void) {
+    static int started;
+
+    if (pl_ready)
+        return;
+    if (!__sync_bool_compare_and_swap(&started, 0, 1)) {
+        scl_spin_while(!pl_ready);
+        return;
+    }
+    pl_resolve();
+    pl_configure();
+    pl_ready = 1;
+}
+
+static inline void pl_check_init(void) {
+    if (__builtin_expect(!pl_ready, 0))
+        pl_init();
+}
+
+static inline pid_t pl_self(void) {
+    if (__builtin_expect(0 == pl_tid, 0))
+        pl_tid = syscall(SYS_gettid);
+    return pl_tid;
+}
+
+// Plain mutexes only: no recursion, error checking, robustness, priority
+// protocol or process sharing. Elision flags do not matter.
+static inline int pl_mutex_routable(pthread_mutex_t *m) {
+    int kind = m->__data.__kind & 0xff;
+    return PTHREAD_MUTEX_NORMAL == kind || PTHREAD_MUTEX_ADAPTIVE_NP == kind;
+}
+
+static inline int pl_rwlock_routable(pthread_rwlock_t *rw) {
+    return 0 == rw->__data.__shared;
+}
+
+static int pl_allowed(void *addr, void *site) {
+    Dl_info dl;
+    int resolved = -1;
+
+    if (NULL == pl_allow)
+        return 1;
+    for (int i = 0; i < pl_nallow; i++) {
+        pl_allow_t *a = &pl_allow[i];
+        const char *module;
+
+        if (PL_ALLOW_ADDR == a->kind) {
+            if ((uintptr_t) addr == a->addr)
+                return 1;
+            continue;
+        }
+        if (-1 == resolved)
+            resolved = 0 != dladdr(site, &dl);
+        if (!resolved)
+            continue;
+        if (PL_ALLOW_FUNCTION == a->kind) {
+            if (NULL != dl.dli_sname && 0 == strcmp(dl.dli_sname, a->name))
+                return 1;
+            continue;
+        }
+        module = NULL != dl.dli_fname ? strrchr(dl.dli_fname, '/') : NULL;
+        module = NULL != module ? module + 1 : dl.dli_fname;
+        if (NULL != module && 0 == strcmp(module, a->name) &&
+                (uintptr_t) site - (uintptr_t) dl.dli_fbase == a->addr)
+            return 1;
+    }
+    return 0;
+}
+
+static pl_lock_t *pl_create(void *addr, int kind, void *site) {
+    pl_lock_t *l;
+
+    if (PL_COND != kind && !pl_allowed(addr, site)) {
+        __sync_fetch_and_add(&pl_skipped, 1);
+        return &pl_native_lock;
+    }
+    if (0 != posix_memalign((void **) &l, CACHELINE, sizeof(pl_lock_t)))
+        goto fail;
+    memset(l, 0, sizeof(pl_lock_t));
+    l->kind = kind;
+    l->addr = addr;
+    l->site = site;
+    if (PL_MODE_SCL != pl_mode)
+        return l;
+    if (PL_MUTEX == kind) {
+        if (0 != fairlock_init(&l->scl.mutex)) {
+            free(l);
+            goto fail;
+        }
+        if (0 != pl_slice_us)
+            fairlock_set_slice(&l->scl.mutex, pl_slice_us);
+    } else if (PL_RWLOCK == kind) {
+        if (0 != rwlock_init(&l->scl.rw)) {
+            free(l);
+            goto fail;
+        }
+    }
+    return l;
+fail:
+    __sync_fetch_and_add(&pl_failed, 1);
+    return &pl_native_lock;
+}
+
+static inline ull pl_home(void *addr) {
+    return ((uintptr_t) addr * PL_HASH_MUL) >> pl_hash_shift;
+}
+
+/*
+ * The slot of the lock at addr, NULL if it has none. The table is
+ * open-addressed with linear probing over at most PL_MAX_PROBE slots, and
+ * a never-used slot ends the probe; tombstones do not.
+ */
+static pl_slot_t *pl_lookup(void *addr) {
+    ull i = pl_home(addr);
+
+    for (ull n = 0; n < PL_MAX_PROBE && n <= pl_mask; n++, i = (i + 1) & pl_mask) {
+        pl_slot_t *s = &pl_table[i];
+        void *key = __atomic_load_n(&s->key, __ATOMIC_ACQUIRE);
+
+        if (key == addr)
+            return s;
+        if (NULL == key)
+            return NULL;
+    }
+    return NULL;
+}
+
+// Claim the first free slot of addr's probe for it; under pl_table_lock.
+static pl_slot_t *pl_claim(void *addr) {
+    ull i = pl_home(addr);
+
+    for (ull n = 0; n < PL_MAX_PROBE && n <= pl_mask; n++, i = (i + 1) & pl_mask) {
+        pl_slot_t *s = &pl_table[i];
+
+        if (NULL != s->key && PL_TOMBSTONE != s->key)
+            continue;
+        __atomic_store_n(&s->lock, NULL, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->key, addr, __ATOMIC_RELEASE);
+        return s;
+    }
+    return NULL;
+}
+
+/*
+ * The table entry of the lock at addr if it is of the given kind, creating
+ * it if create is set and addr has none yet; NULL if the lock stays native.
+ * Lookups take no lock. Slots are claimed under pl_table_lock, so that two
+ * threads first taking the same lock cannot claim two of them, but the
+ * SCL is created outside it; a lookup that finds the slot before the SCL
+ * waits for it.
+ */
+static pl_lock_t *pl_find(void *addr, int kind, void *site, int create) {
+    pl_slot_t *s, *claimed = NULL;
+    pl_lock_t *l;
+
+    if (NULL == pl_table)
+        return NULL;
+    if (NULL == (s = pl_lookup(addr))) {
+        if (!create)
+            return NULL;
+        pl_real.mutex_lock(&pl_table_lock);
+        if (NULL == (s = pl_lookup(addr)))
+            claimed = pl_claim(addr);
+        pl_real.mutex_unlock(&pl_table_lock);
+        if (NULL != claimed) {
+            l = pl_create(addr, kind, site);
+            __atomic_store_n(&claimed->lock, l, __ATOMIC_RELEASE);
+            return l->kind == kind ? l : NULL;
+        }
+        if (NULL == s) {
+            __sync_fetch_and_add(&pl_full, 1);
+            return NULL;
+        }
+    }
+    scl_wait_while(&pl_waiting, NULL, NULL == (l = __atomic_load_n(&s->lock, __ATOMIC_ACQUIRE)));
+    // the address may have held another kind of object first
+    return l->kind == kind ? l : NULL;
+}
+
+/*
+ * Drop the entry of the object at addr, which is being destroyed, leaving
+ * a tombstone that a later lock can claim, and free its SCL.
+ */
+static void pl_forget(void *addr) {
+    pl_slot_t *s;
+    pl_lock_t *l = NULL;
+
+    pl_check_init();
+    if (NULL == pl_table || NULL == pl_lookup(addr))
+        return;
+    pl_real.mutex_lock(&pl_table_lock);
+    // an entry still being created belongs to a lock in use
+    if (NULL != (s = pl_lookup(addr)) && NULL != (l = __atomic_load_n(&s->lock, __ATOMIC_ACQUIRE)))
+        __atomic_store_n(&s->key, PL_TOMBSTONE, __ATOMIC_RELEASE);
+    pl_real.mutex_unlock(&pl_table_lock);
+    if (NULL == s || NULL == l || &pl_native_lock == l)
+        return;
+    if (PL_MODE_SCL == pl_mode && PL_MUTEX == l->kind)
+        fairlock_destroy(&l->scl.mutex);
+    else if (PL_MODE_SCL == pl_mode && PL_RWLOCK == l->kind)
+        rwlock_destroy(&l->scl.rw);
+    free(l);
+}
+
+static inline pl_lock_t *pl_mutex(pthread_mutex_t *m, void *site, int create) {
+    pl_check_init();
+    if (!pl_mutex_routable(m))
+        return NULL;
+    return pl_find(m, PL_MUTEX, site, create);
+}
+
+static inline pl_lock_t *pl_rwlock(pthread_rwlock_t *rw, void *site, int create) {
+    pl_check_init();
+    if (!pl_rwlock_routable(rw))
+        return NULL;
+    return pl_find(rw, PL_RWLOCK, site, create);
+}
+
+/*
+ * Report mode: count an acquisition that waited since start (0 if it did
+ * not wait). hold starts a hold time, which readers do not track.
+ */
+static inline void pl_count_acquired(pl_lock_t *l, ull start, int hold) {
+    ull now = scl_now(), wait = 0 != start ? now - start : 0, max;
+
+    __sync_fetch_and_add(&l->acquisitions, 1);
+    if (0 != start) {
+        __sync_fetch_and_add(&l->contended, 1);
+        __sync_fetch_and_add(&l->wait, wait);
+        while (wait > (max = readvol(l->wait_max)) &&
+                !__sync_bool_compare_and_swap(&l->wait_max, max, wait));
+    }
+    if (hold)
+        l->hold_start = now;
+}
+
+static inline void pl_count_released(pl_lock_t *l) {
+    __sync_fetch_and_add(&l->hold, scl_now() - l->hold_start);
+}
+
+/*
+ * Report mode: try the native lock, then take it with lock_expr, counting
+ * the acquisition and whether it had to wait. Evaluates to 0 or the error
+ * lock_expr returned.
+ */
+#define pl_count_lock(l, trylock_expr, lock_expr, hold) ({             \
+    int pl_rc_ = 0;                                                   \
+    if (0 == (trylock_expr)) {                                        \
+        pl_count_acquired((l), 0, (hold));                            \
+    } else {                                                          \
+        ull pl_start_ = scl_now();                                    \
+        if (0 == (pl_rc_ = (lock_expr)))                              \
+            pl_count_acquired((l), pl_start_, (hold));                \
+    }                                                                 \
+    pl_rc_; })
+
+/*
+ * abstime on clock (CLOCK_REALTIME or CLOCK_MONOTONIC, the clocks pthread
+ * accepts) to CLOCK_MONOTONIC, as the SCLs time out on it.
+ */
+static int pl_monotonic(clockid_t clock, const struct timespec *abstime, struct timespec *ts) {
+    struct timespec now, mono;
+    long long ns;
+
+    if (abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000L)
+        return EINVAL;
+    if (CLOCK_MONOTONIC == clock) {
+        *ts = *abstime;
+        return 0;
+    }
+    if (CLOCK_REALTIME != clock)
+        return EINVAL;
+    clock_gettime(CLOCK_REALTIME, &now);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    ns = (abstime->tv_sec - now.tv_sec) * 1000000000LL + (abstime->tv_nsec - now.tv_nsec);
+    if (ns < 0)
+        ns = 0;
+    ns += mono.tv_sec * 1000000000LL + mono.tv_nsec;
+    ts->tv_sec = ns / 1000000000LL;
+    ts->tv_nsec = ns % 1000000000LL;
+    return 0;
+}
+
+int pthread_mutex_lock(pthread_mutex_t *m) {
+    pl_lock_t *l = pl_mutex(m, __builtin_return_address(0), 1);
+
+    if (NULL == l)
+        return pl_real.mutex_lock(m);
+    if (PL_MODE_REPORT == pl_mode)
+        return pl_count_lock(l, pl_real.mutex_trylock(m), pl_real.mutex_lock(m), 1);
+    fairlock_acquire(&l->scl.mutex);
+    return 0;
+}
+
+int pthread_mutex_trylock(pthread_mutex_t *m) {
+    pl_lock_t *l = pl_mutex(m, __builtin_return_address(0), 1);
+    int rc;
+
+    if (NULL == l)
+        return pl_real.mutex_trylock(m);
+    if (PL_MODE_REPORT == pl_mode) {
+        if (0 == (rc = pl_real.mutex_trylock(m)))
+            pl_count_acquired(l, 0, 1);
+        return rc;
+    }
+    return fairlock_trylock(&l->scl.mutex);
+}
+
+int pthread_mutex_timedlock(pthread_mutex_t *m, const struct timespec *abstime) {
+    pl_lock_t *l = pl_mutex(m, __builtin_return_address(0), 1);
+    struct timespec ts;
+    int rc;
+
+    if (NULL == l)
+        return pl_real.mutex_timedlock(m, abstime);
+    if (PL_MODE_REPORT == pl_mode)
+        return pl_count_lock(l, pl_real.mutex_trylock(m), pl_real.mutex_timedlock(m, abstime), 1);
+    if (0 != (rc = pl_monotonic(CLOCK_REALTIME, abstime, &ts)))
+        return rc;
+    return fairlock_timedlock(&l->scl.mutex, &ts);
+}
+
+#if PL_CLOCK_VARIANTS
+int pthread_mutex_clocklock(pthread_mutex_t *m, clockid_t clock, const struct timespec *abstime) {
+    pl_lock_t *l = pl_mutex(m, __builtin_return_address(0), 1);
+    struct timespec ts;
+    int rc;
+
+    if (NULL == l)
+        return pl_real.mutex_clocklock(m, clock, abstime);
+    if (PL_MODE_REPORT == pl_mode)
+        return pl_count_lock(l, pl_real.mutex_trylock(m), pl_real.mutex_clocklock(m, clock, abstime), 1);
+    if (0 != (rc = pl_monotonic(clock, abstime, &ts)))
+        return rc;
+    return fairlock_timedlock(&l->scl.mutex, &ts);
+}
+#endif
+
+int pthread_mutex_unlock(pthread_mutex_t *m) {
+    pl_lock_t *l = pl_mutex(m, NULL, 0);
+
+    if (NULL == l)
+        return pl_real.mutex_unlock(m);
+    if (PL_MODE_REPORT == pl_mode) {
+        pl_count_released(l);
+        return pl_real.mutex_unlock(m);
+    }
+    fairlock_release(&l->scl.mutex);
+    return 0;
+}
+
+/*
+ * Lock for reading or writing until the deadline in ticks, polling the
+ * RW-SCL trylock as it has no timed acquire.
+ */
+static int pl_rwlock_timed(rwlock_t *rw, int (*trylock)(rwlock_t *), clockid_t clock,
+        const struct timespec *abstime) {
+    struct timespec ts;
+    scl_waiter_t w;
+    ull deadline;
+    int rc;
+
+    if (0 == trylock(rw))
+        return 0;
+    if (0 != (rc = pl_monotonic(clock, abstime, &ts)))
+        return rc;
+    deadline = scl_monotonic_to_ticks(&ts);
+    scl_waiter_init(&w, &rw->waiting, NULL);
+    while (0 != (rc = trylock(rw)) && scl_now() < deadline)
+        scl_waiter_pause(&w);
+    scl_waiter_done(&w);
+    return 0 == rc ? 0 : ETIMEDOUT;
+}
+
+int pthread_mutex_destroy(pthread_mutex_t *m) {
+    pl_forget(m);
+    return pl_real.mutex_destroy(m);
+}
+
+int pthread_rwlock_rdlock(pthread_rwlock_t *rw) {
+    pl_lock_t *l = pl_rwlock(rw, __builtin_return_address(0), 1);
+
+    if (NULL == l)
+        return pl_real.rwlock_rdlock(rw);
+    if (PL_MODE_REPORT == pl_mode)
+        return pl_count_lock(l, pl_real.rwlock_tryrdlock(rw), pl_real.rwlock_rdlock(rw), 0);
+    rwlock_reader_lock(&l->scl.rw);
+    return 0;
+}
+
+int pthread_rwlock_wrlock(pthread_rwlock_t *rw) {
+    pl_lock_t *l = pl_rwlock(rw, __builtin_return_address(0), 1);
+    int rc = 0;
+
+    if (NULL == l)
+        return pl_real.rwlock_wrlock(rw);
+    if (PL_MODE_REPORT == pl_mode)
+        rc = pl_count_lock(l, pl_real.rwlock_trywrlock(rw), pl_real.rwlock_wrlock(rw), 1);
+    else
+        rwlock_writer_lock(&l->scl.rw);
+    if (0 == rc)
+        l->writer = pl_self();
+    return rc;
+}
+
+int pthread_rwlock_tryrdlock(pthread_rwlock_t *rw) {
+    pl_lock_t *l = pl_rwlock(rw, __builtin_return_address(0), 1);
+    int rc;
+
+    if (NULL == l)
+        return pl_real.rwlock_tryrdlock(rw);
+    if (PL_MODE_REPORT == pl_mode) {
+        if (0 == (rc = pl_real.rwlock_tryrdlock(rw)))
+            pl_count_acquired(l, 0, 0);
+        return rc;
+    }
+    return rwlock_reader_trylock(&l->scl.rw);
+}
+
+int pthread_rwlock_trywrlock(pthread_rwlock_t *rw) {
+    pl_lock_t *l = pl_rwlock(rw, __builtin_return_address(0), 1);
+    int rc;
+
+    if (NULL == l)
+        return pl_real.rwlock_trywrlock(rw);
+    if (PL_MODE_REPORT == pl_mode) {
+        if (0 == (rc = pl_real.rwlock_trywrlock(rw)))
+            pl_count_acquired(l, 0, 1);
+    } else {
+        rc = rwlock_writer_trylock(&l->scl.rw);
+    }
+    if (0 == rc)
+        l->writer = pl_self();
+    return rc;
+}
+
+int pthread_rwlock_timedrdlock(pthread_rwlock_t *rw, const struct timespec *abstime) {
+    pl_lock_t *l = pl_rwlock(rw, __builtin_return_address(0), 1);
+
+    if (NULL == l)
+        return pl_real.rwlock_timedrdlock(rw, abstime);
+    if (PL_MODE_REPORT == pl_mode)
+        return pl_count_lock(l, pl_real.rwlock_tryrdlock(rw), pl_real.rwlock_timedrdlock(rw, abstime), 0);
+    return pl_rwlock_timed(&l->scl.rw, rwlock_reader_trylock, CLOCK_REALTIME, abstime);
+}
+
+int pthread_rwlock_timedwrlock(pthread_rwlock_t *rw, const struct timespec *abstime) {
+    pl_lock_t *l = pl_rwlock(rw, __builtin_return_address(0), 1);
+    int rc;
+
+    if (NULL == l)
+        return pl_real.rwlock_timedwrlock(rw, abstime);
+    if (PL_MODE_REPORT == pl_mode)
+        rc = pl_count_lock(l, pl_real.rwlock_trywrlock(rw), pl_real.rwlock_timedwrlock(rw, abstime), 1);
+    else
+        rc = pl_rwlock_timed(&l->scl.rw, rwlock_writer_trylock, CLOCK_REALTIME, abstime);
+    if (0 == rc)
+        l->writer = pl_self();
+    return rc;
+}
+
+#if PL_CLOCK_VARIANTS
+int pthread_rwlock_clockrdlock(pthread_rwlock_t *rw, clockid_t clock, const struct timespec *abstime) {
+    pl_lock_t *l = pl_rwlock(rw, __builtin_return_address(0), 1);
+
+    if (NULL == l)
+        return pl_real.rwlock_clockrdlock(rw, clock, abstime);
+    if (PL_MODE_REPORT == pl_mode)
+        return pl_count_lock(l, pl_real.rwlock_tryrdlock(rw),
+                pl_real.rwlock_clockrdlock(rw, clock, abstime), 0);
+    return pl_rwlock_timed(&l->scl.rw, rwlock_reader_trylock, clock, abstime);
+}
+
+int pthread_rwlock_clockwrlock(pthread_rwlock_t *rw, clockid_t clock, const struct timespec *abstime) {
+    pl_lock_t *l = pl_rwlock(rw, __builtin_return_address(0), 1);
+    int rc;
+
+    if (NULL == l)
+        return pl_real.rwlock_clockwrlock(rw, clock, abstime);
+    if (PL_MODE_REPORT == pl_mode)
+        rc = pl_count_lock(l, pl_real.rwlock_trywrlock(rw),
+                pl_real.rwlock_clockwrlock(rw, clock, abstime), 1);
+    else
+        rc = pl_rwlock_timed(&l->scl.rw, rwlock_writer_trylock, clock, abstime);
+    if (0 == rc)
+        l->writer = pl_self();
+    return rc;
+}
+#endif
+
+int pthread_rwlock_unlock(pthread_rwlock_t *rw) {
+    pl_lock_t *l = pl_rwlock(rw, NULL, 0);
+    int writer;
+
+    if (NULL == l)
+        return pl_real.rwlock_unlock(rw);
+    // only the writer itself can see its own tid here
+    if ((writer = readvol(l->writer) == pl_self()))
+        l->writer = 0;
+    if (PL_MODE_REPORT == pl_mode) {
+        if (writer)
+            pl_count_released(l);
+        return pl_real.rwlock_unlock(rw);
+    }
+    if (writer)
+        rwlock_writer_unlock(&l->scl.rw);
+    else
+        rwlock_reader_unlock(&l->scl.rw);
+    return 0;
+}
+
+int pthread_rwlock_destroy(pthread_rwlock_t *rw) {
+    pl_forget(rw);
+    return pl_real.rwlock_destroy(rw);
+}
+
+/*
+ * The native wait: untimed without abstime, on the condition variable's
+ * own clock with PL_COND_CLOCK, and on clock otherwise.
+ */
+static int pl_native_cond_wait(pthread_cond_t *c, pthread_mutex_t *m, clockid_t clock,
+        const struct timespec *abstime) {
+    if (NULL == abstime)
+        return pl_real.cond_wait(c, m);
+#if PL_CLOCK_VARIANTS
+    if (PL_COND_CLOCK != clock)
+        return pl_real.cond_clockwait(c, m, clock, abstime);
+#endif
+    return pl_real.cond_timedwait(c, m, abstime);
+}
+
+/*
+ * Wait on a native condition variable with a routed mutex: take the
+ * mutex's native storage before releasing the u-SCL, so that a signal sent
+ * under it (pl_cond_wake()) cannot slip in before the wait starts.
+ */
+static int pl_cond_wait(pthread_cond_t *c, pthread_mutex_t *m, clockid_t clock,
+        const struct timespec *abstime) {
+    pl_lock_t *l = pl_mutex(m, NULL, 0), *cl;
+    int rc;
+
+    if (NULL == l)
+        goto native;
+    if (PL_MODE_REPORT == pl_mode) {
+        pl_count_released(l);
+        rc = pl_native_cond_wait(c, m, clock, abstime);
+        l->hold_start = scl_now();
+        return rc;
+    }
+    if (NULL == (cl = pl_find(c, PL_COND, NULL, 1))) {
+        // no room to remember the mutex; a signal could be missed
+        fl_release(&l->scl.mutex, 1);
+        sched_yield();
+        fairlock_acquire(&l->scl.mutex);
+        return 0;
+    }
+    __atomic_store_n(&cl->mutex, m, __ATOMIC_RELEASE);
+    pl_real.mutex_lock(m);
+    // end the slice too, as fairlock_cond_wait() does, or the next thread
+    // would sit out the rest of it while its owner sleeps here
+    fl_release(&l->scl.mutex, 1);
+    rc = pl_native_cond_wait(c, m, clock, abstime);
+    pl_real.mutex_unlock(m);
+    fairlock_acquire(&l->scl.mutex);
+    return rc;
+native:
+    return pl_native_cond_wait(c, m, clock, abstime);
+}
+
+static int pl_cond_wake(pthread_cond_t *c, int (*wake)(pthread_cond_t *)) {
+    pl_lock_t *cl;
+    pthread_mutex_t *m;
+    int rc;
+
+    pl_check_init();
+    if (PL_MODE_SCL != pl_mode || NULL == (cl = pl_find(c, PL_COND, NULL, 0)) ||
+            NULL == (m = __atomic_load_n(&cl->mutex, __ATOMIC_ACQUIRE)))
+        return wake(c);
+    pl_real.mutex_lock(m);
+    rc = wake(c);
+    pl_real.mutex_unlock(m);
+    return rc;
+}
+
+int pthread_cond_wait(pthread_cond_t *c, pthread_mutex_t *m) {
+    return pl_cond_wait(c, m, PL_COND_CLOCK, NULL);
+}
+
+int pthread_cond_timedwait(pthread_cond_t *c, pthread_mutex_t *m, const struct timespec *abstime) {
+    return pl_cond_wait(c, m, PL_COND_CLOCK, abstime);
+}
+
+#if PL_CLOCK_VARIANTS
+int pthread_cond_clockwait(pthread_cond_t *c, pthread_mutex_t *m, clockid_t clock,
+        const struct timespec *abstime) {
+    return pl_cond_wait(c, m, clock, abstime);
+}
+#endif
+
+int pthread_cond_signal(pthread_cond_t *c) {
+    return pl_cond_wake(c, pl_real.cond_signal);
+}
+
+int pthread_cond_broadcast(pthread_cond_t *c) {
+    return pl_cond_wake(c, pl_real.cond_broadcast);
+}
+
+int pthread_cond_destroy(pthread_cond_t *c) {
+    pl_forget(c);
+    return pl_real.cond_destroy(c);
+}
+
+/*
+ * The report: one line per lock, most waited-on first, and in scl mode
+ * each thread's acquisitions and entitled versus received share.
+ */
+typedef struct pl_report_entry {
+    pl_lock_t *lock;
+    ull waited_ns;
+    scl_stats_snapshot_t snap;
+} pl_report_entry_t;
+
+static int pl_report_cmp(const void *a, const void *b) {
+    const pl_report_entry_t *x = a, *y = b;
+    return x->waited_ns < y->waited_ns ? 1 : x->waited_ns > y->waited_ns ? -1 : 0;
+}
+
+static void pl_report_site(FILE *f, void *site) {
+    Dl_info dl;
+    const char *module;
+
+    if (NULL == site || 0 == dladdr(site, &dl)) {
+        fprintf(f, "%p", site);
+        return;
+    }
+    if (NULL != dl.dli_sname)
+        fprintf(f, "%s+0x%lx ", dl.dli_sname, (unsigned long) ((uintptr_t) site - (uintptr_t) dl.dli_saddr));
+    module = NULL != dl.dli_fname ? strrchr(dl.dli_fname, '/') : NULL;
+    module = NULL != module ? module + 1 : dl.dli_fname;
+    fprintf(f, "%s+0x%lx", NULL != module ? module : "?",
+            (unsigned long) ((uintptr_t) site - (uintptr_t) dl.dli_fbase));
+}
+
+static void pl_report_write(void) {
+    pl_report_entry_t *entries;
+    int n = 0, nmutex = 0, nrwlock = 0;
+    FILE *f = stderr;
+
+    if (NULL == pl_table)
+        return;
+    if (NULL == (entries = (pl_report_entry_t *) calloc(pl_mask + 1, sizeof(pl_report_entry_t))))
+        return;
+    for (ull i = 0; i <= pl_mask; i++) {
+        void *key = __atomic_load_n(&pl_table[i].key, __ATOMIC_ACQUIRE);
+        pl_lock_t *l = __atomic_load_n(&pl_table[i].lock, __ATOMIC_ACQUIRE);
+        pl_report_entry_t *e = &entries[n];
+
+        if (NULL == key || PL_TOMBSTONE == key || NULL == l ||
+                (PL_MUTEX != l->kind && PL_RWLOCK != l->kind))
+            continue;
+        nmutex += PL_MUTEX == l->kind;
+        nrwlock += PL_RWLOCK == l->kind;
+        e->lock = l;
+        if (PL_MODE_REPORT == pl_mode) {
+            e->waited_ns = scl_ticks_to_ns(l->wait);
+        } else {
+            if (0 != (PL_MUTEX == l->kind ? fairlock_stats(&l->scl.mutex, &e->snap) :
+                                            rwlock_stats(&l->scl.rw, &e->snap)))
+                continue;
+            e->waited_ns = e->snap.total.wait_ns + e->snap.total.ban_ns;
+        }
+        n++;
+    }
+    qsort(entries, n, sizeof(pl_report_entry_t), pl_report_cmp);
+
+    if (0 != strcmp(pl_report, "stderr") && NULL == (f = fopen(pl_report, "w"))) {
+        fprintf(stderr, "scl-preload: cannot write %s: %s\n", pl_report, strerror(errno));
+        f = stderr;
+    }
+    fprintf(f, "scl-preload: %s mode, %d mutexes, %d rwlocks; native: %llu not allowed, "
+            "%llu out of memory, %llu table full\n",
+            PL_MODE_REPORT == pl_mode ? "report" : "scl", nmutex, nrwlock,
+            pl_skipped, pl_failed, pl_full);
+    for (int i = 0; i < n; i++) {
+        pl_report_entry_t *e = &entries[i];
+        pl_lock_t *l = e->lock;
+
+        fprintf(f, "%p %s first taken at ", l->addr, PL_MUTEX == l->kind ? "mutex" : "rwlock");
+        pl_report_site(f, l->site);
+        fprintf(f, "\n");
+        if (PL_MODE_REPORT == pl_mode) {
+            fprintf(f, "    acquisitions %llu contended %llu (%.1f%%) wait %.3f ms max %.3f ms hold %.3f ms\n",
+                    l->acquisitions, l->contended,
+                    l->acquisitions ? 100.0 * l->contended / l->acquisitions : 0.0,
+                    scl_ticks_to_ns(l->wait) / 1e6, scl_ticks_to_ns(l->wait_max) / 1e6,
+                    scl_ticks_to_ns(l->hold) / 1e6);
+            continue;
+        }
+        fprintf(f, "    acquisitions %llu wait %.3f ms ban %.3f ms hold %.3f ms spin %.3f ms",
+                e->snap.total.acquisitions, e->snap.total.wait_ns / 1e6, e->snap.total.ban_ns / 1e6,
+                e->snap.total.hold_ns / 1e6, e->snap.total.spin_ns / 1e6);
+        if (PL_RWLOCK == l->kind)
+            fprintf(f, " idle slice %.3f ms", e->snap.total.idle_slice_ns / 1e6);
+        fprintf(f, "\n");
+        for (int j = 0; j < e->snap.nthreads; j++) {
+            scl_stats_thread_t *t = &e->snap.threads[j];
+            fprintf(f, "    tid %d%s weight %llu acquisitions %llu hold %.3f ms entitled %.3f received %.3f\n",
+                    t->tid, SCL_STATS_READER == t->role ? " reader" : SCL_STATS_WRITER == t->role ? " writer" : "",
+                    t->weight, t->acquisitions, t->hold_ns / 1e6, t->entitled, t->received);
+        }
+        scl_stats_snapshot_free(&e->snap);
+    }
+    if (stderr != f)
+        fclose(f);
+    free(entries);
+}
@@ -1,33 +1,35 @@
-#include <sched.h>
+#ifndef __FAIRLOCK_COMMON_H__
+#define __FAIRLOCK_COMMON_H__
+
+#include "../common/clock.h"
+#include "../common/wait.h"
+#include "../common/waiter.h"
+#include "../common/prio.h"
 
 #define CACHELINE 64
-#ifndef SPIN_LIMIT
-#define SPIN_LIMIT 20
-#endif
-#define SLEEP_GRANULARITY 8
 
-#ifndef CYCLE_PER_US
-#error Must define CYCLE_PER_US for the current machine in Makefile or elsewhere
-#endif
-#define CYCLE_PER_MS (CYCLE_PER_US * 1000L)
-#define CYCLE_PER_S (CYCLE_PER_MS * 1000L)
 #define FAIRLOCK_GRANULARITY (CYCLE_PER_MS * 2L)
+// A thread that has not released the lock for this long stops counting
+// towards total_weight until it uses the lock again.
+#define FAIRLOCK_INACTIVE_THRESHOLD (CYCLE_PER_S * 1L)
+// How often waiters on a process-shared lock look for dead participants.
+#define FAIRLOCK_SHM_CHECK (CYCLE_PER_MS * 100L)
+// FAIRLOCK_CHARGE_HYBRID charges wall time for shorter critical sections.
+#define FAIRLOCK_CHARGE_HYBRID_MIN (CYCLE_PER_US * 20L)
+// Default bound on consecutive handoffs within one node of a cohort lock.
+#define FAIRLOCK_COHORT_HANDOFFS 64
+// Requests a holder runs for fairlock_execute() callers before it releases.
+#define FAIRLOCK_EXECUTE_BATCH 32
 
-#define readvol(lvalue) (*(volatile typeof(lvalue)*)(&lvalue))
-
-#define spin_then_yield(limit, expr) while (1) { \
-    int val, counter = 0;                        \
-    while ((val = (expr)) && counter++ < limit); \
-    if (!val) break; sched_yield(); }
+// Adaptive slices (fairlock_set_adaptive): default bounds, a slice should
+// hold this many average critical sections and be this many times longer
+// than an average handoff. Estimates are EWMAs with weight 1/2^SHIFT.
+#define FAIRLOCK_ADAPT_MIN (CYCLE_PER_US * 20L)
+#define FAIRLOCK_ADAPT_MAX (CYCLE_PER_MS * 20L)
+#define FAIRLOCK_ADAPT_CS_PER_SLICE 16
+#define FAIRLOCK_ADAPT_HANDOFF_RATIO 32
+#define FAIRLOCK_EWMA_SHIFT 3
 
-static const int prio_to_weight[40] = {
- /* -20 */     88761,     71755,     56483,     46273,     36291,
- /* -15 */     29154,     23254,     18705,     14949,     11916,
- /* -10 */      9548,      7620,      6100,      4904,      3906,
- /*  -5 */      3121,      2501,      1991,      1586,      1277,
- /*   0 */      1024,       820,       655,       526,       423,
- /*   5 */       335,       272,       215,       172,       137,
- /*  10 */       110,        87,        70,        56,        45,
- /*  15 */        36,        29,        23,        18,        15,
-};
+#define readvol(lvalue) (*(volatile __typeof__(lvalue)*)(&lvalue))
 
+#endif // __FAIRLOCK_COMMON_H__
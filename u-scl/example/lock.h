@@ -22,6 +22,33 @@ typedef fairlock_t lock_t;
 #define lock_acquire(plock) fairlock_acquire(plock)
 #define lock_release(plock) fairlock_release(plock)
 
+#elif FAIRLOCK_COHORT
+#include "fairlock_cohort.h"
+typedef fairlock_cohort_t lock_t;
+#define lock_init(plock) fairlock_cohort_init(plock, 0)
+#define lock_acquire(plock) fairlock_cohort_acquire(plock)
+#define lock_release(plock) fairlock_cohort_release(plock)
+
+#elif FAIRLOCK_TABLE
+#include "fairlock_table.h"
+// every acquisition takes the next bucket of a 1024-bucket table
+#define LOCK_TABLE_BUCKETS 1024
+static __thread size_t lock_bucket;
+typedef fairlock_table_t lock_t;
+#define lock_init(plock) fairlock_table_init(plock, LOCK_TABLE_BUCKETS)
+#define lock_acquire(plock) fairlock_table_acquire(plock, ++lock_bucket)
+#define lock_release(plock) fairlock_table_release(plock, lock_bucket)
+
+#elif FAIRLOCK_SHM
+#include "fairlock_shm.h"
+// the workers are processes and the lock lives in a shared mapping
+#define LOCK_SHM_SLOTS 64
+typedef fairlock_shm_t lock_t;
+#define lock_size() fairlock_shm_size(LOCK_SHM_SLOTS)
+#define lock_init(plock) fairlock_shm_init(plock, LOCK_SHM_SLOTS)
+#define lock_acquire(plock) fairlock_shm_acquire(plock)
+#define lock_release(plock) fairlock_shm_release(plock)
+
 #endif
 
 #endif // __LOCK_H__
@@ -6,22 +6,21 @@
 #include <pthread.h>
 #include <sched.h>
 #include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <sys/syscall.h>
 #include <inttypes.h>
 #define gettid() syscall(SYS_gettid)
 #include "rdtsc.h"
+#include "../../common/clock.h"
 #include "lock.h"
 
-#ifndef CYCLE_PER_US
-#error Must define CYCLE_PER_US for the current machine in the Makefile or elsewhere
-#endif
-
 typedef unsigned long long ull;
-typedef struct {
+typedef struct __attribute__ ((aligned (64))) {
     volatile int *stop;
     pthread_t thread;
     int priority;
-#ifdef FAIRLOCK
+#if defined(FAIRLOCK) || defined(FAIRLOCK_COHORT) || defined(FAIRLOCK_TABLE) || defined(FAIRLOCK_SHM)
     int weight;
 #endif
     int id;
@@ -31,9 +30,23 @@ typedef struct {
     ull loop_in_cs;
     ull lock_acquires;
     ull lock_hold;
-} task_t __attribute__ ((aligned (64)));
+} task_t;
+
+lock_t *lock;
+
+#if defined(FAIRLOCK) && defined(EXECUTE)
+// The critical section, run by whichever thread holds the lock.
+static void critical_section(void *arg) {
+    task_t *task = (task_t *) arg;
+    ull now = scl_now(), start = now, then = now + CYCLE_PER_US * task->cs;
 
-lock_t lock;
+    do {
+        task->loop_in_cs++;
+    } while ((now = scl_now()) < then);
+    task->lock_acquires++;
+    task->lock_hold += now - start;
+}
+#endif
 
 void *worker(void *arg) {
     int ret;
@@ -65,9 +78,19 @@ void *worker(void *arg) {
     }
 
 #ifdef FAIRLOCK
-    fairlock_thread_init(&lock, task->weight);
+    fairlock_thread_init(lock, task->weight);
+#elif FAIRLOCK_COHORT
+    fairlock_cohort_thread_init(lock, task->weight);
+#elif FAIRLOCK_TABLE
+    fairlock_table_thread_init(lock, task->weight);
+#elif FAIRLOCK_SHM
+    fairlock_shm_thread_init(lock, task->weight);
 #endif
 
+#if defined(FAIRLOCK) && defined(EXECUTE)
+    while (!*task->stop)
+        fairlock_execute(lock, critical_section, task);
+#else
     // loop
     ull now, start, then;
     ull lock_acquires = 0;
@@ -76,8 +99,8 @@ void *worker(void *arg) {
     const ull delta = CYCLE_PER_US * task->cs;
     while (!*task->stop) {
 
-        lock_acquire(&lock);
-        now = rdtscp();
+        lock_acquire(lock);
+        now = scl_now();
 
         lock_acquires++;
         start = now;
@@ -85,15 +108,16 @@ void *worker(void *arg) {
 
         do {
             loop_in_cs++;
-        } while ((now = rdtscp()) < then);
+        } while ((now = scl_now()) < then);
 
         lock_hold += now - start;
 
-        lock_release(&lock);
+        lock_release(lock);
     }
     task->lock_acquires = lock_acquires;
     task->loop_in_cs = loop_in_cs;
     task->lock_hold = lock_hold;
+#endif
 
     pid_t pid = getpid();
     char path[256];
@@ -120,7 +144,7 @@ void *worker(void *arg) {
             task->lock_hold / (float) (CYCLE_PER_US * 1000),
             buffer);
 #if defined(FAIRLOCK) && defined(DEBUG)
-    flthread_info_t *info = pthread_getspecific(lock.flthread_info_key);
+    flthread_info_t *info = flthread_info_lookup(lock);
     printf("  slice %llu\n"
             "  own_slice_wait %llu\n"
             "  prev_slice_wait %llu\n"
@@ -155,26 +179,40 @@ int main(int argc, char *argv[]) {
 	printf("NCPU - no. of CPUs to be used for the experimentation\n");
         return 1;
     }
+    scl_clock_init();
     int nthreads = atoi(argv[1]);
     int duration = atoi(argv[2]);
-    task_t *tasks = malloc(sizeof(task_t) * nthreads);
+#ifdef FAIRLOCK_SHM
+    // workers are forked processes, so everything they share is in a shared mapping
+    task_t *tasks = mmap(NULL, sizeof(task_t) * nthreads, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    lock = mmap(NULL, lock_size(), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    volatile int *stop = mmap(NULL, sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    pid_t *pids = malloc(sizeof(pid_t) * nthreads);
+#else
+    task_t *tasks = aligned_alloc(64, sizeof(task_t) * nthreads);
+    lock = aligned_alloc(64, sizeof(lock_t));
+#endif
     if (argc < 3+nthreads*2) {
         printf("usage: %s <nthreads> <duration> <<cs prio> <..n>> [NCPU]\n", argv[0]);
         return 1;
     }
 
-    int stop __attribute__((aligned (64))) = 0;
-#ifdef FAIRLOCK
+#ifndef FAIRLOCK_SHM
+    static int stop_flag __attribute__((aligned (64)));
+    volatile int *stop = &stop_flag;
+#endif
+    *stop = 0;
+#if defined(FAIRLOCK) || defined(FAIRLOCK_COHORT) || defined(FAIRLOCK_TABLE) || defined(FAIRLOCK_SHM)
     int tot_weight = 0;
 #endif
     int ncpu = argc > 3 + nthreads*2 ? atoi(argv[3+nthreads*2]) : 0;
     for (int i = 0; i < nthreads; i++) {
-        tasks[i].stop = &stop;
+        tasks[i].stop = stop;
         tasks[i].cs = atof(argv[3+i*2]);
 
         int priority = atoi(argv[4+i*2]);
         tasks[i].priority = priority;
-#ifdef FAIRLOCK
+#if defined(FAIRLOCK) || defined(FAIRLOCK_COHORT) || defined(FAIRLOCK_TABLE) || defined(FAIRLOCK_SHM)
         int weight = prio_to_weight[priority+20];
         tasks[i].weight = weight;
         tot_weight += weight;
@@ -191,17 +229,46 @@ int main(int argc, char *argv[]) {
 //#ifdef FAIRLOCK
 //    lock_init(&lock, tot_weight);
 //#else
-    lock_init(&lock);
+    lock_init(lock);
 //#endif
+#if defined(FAIRLOCK) && defined(ADAPTIVE)
+    fairlock_set_adaptive(lock, 0, 0);
+#endif
 
+#ifdef FAIRLOCK_SHM
+    for (int i = 0; i < nthreads; i++) {
+        if (0 == (pids[i] = fork())) {
+            worker(&tasks[i]);
+            fflush(stdout);
+            _exit(0);
+        }
+    }
+    sleep(duration);
+    *stop = 1;
+    for (int i = 0; i < nthreads; i++) {
+        waitpid(pids[i], NULL, 0);
+    }
+#else
     for (int i = 0; i < nthreads; i++) {
         pthread_create(&tasks[i].thread, NULL, worker, &tasks[i]);
     }
     sleep(duration);
-    stop = 1;
+    *stop = 1;
     for (int i = 0; i < nthreads; i++) {
         pthread_join(tasks[i].thread, NULL);
     }
+#endif
+#if defined(FAIRLOCK) && defined(ADAPTIVE)
+    fairlock_slice_stats_t st;
+    fairlock_slice_stats(lock, &st);
+    printf("adaptive slice(us) %.3f avg_cs(us) %.3f avg_handoff(us) %.3f avg_waiters %.2f slices %llu\n",
+            st.slice_ns / 1000.0, st.avg_cs_ns / 1000.0, st.avg_handoff_ns / 1000.0,
+            st.avg_waiters, st.slices);
+#endif
+#if defined(FAIRLOCK) && defined(FAIRLOCK_TRACE)
+    if (0 == fairlock_trace_dump("fairlock.trace"))
+        printf("trace written to fairlock.trace, analyze with ../tools/fltrace\n");
+#endif
     return 0;
 }
 
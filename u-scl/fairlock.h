@@ -3,19 +3,27 @@
 #ifndef __FAIRLOCK_H__
 #define __FAIRLOCK_H__
 
+#ifndef _GNU_SOURCE
 #define _GNU_SOURCE
+#endif
 #include <stddef.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <unistd.h>
 #include <string.h>
 #include <sched.h>
 #include <sys/resource.h>
 #include <sys/syscall.h>
 #include <sys/time.h>
+#include <sys/eventfd.h>
 #include <linux/futex.h>
 #include <pthread.h>
 #include "rdtsc.h"
 #include "common.h"
+#include "../common/stats.h"
+#include "../common/group.h"
+#include "../common/weight.h"
+#include "fairlock_trace.h"
 
 typedef unsigned long long ull;
 
@@ -38,7 +46,19 @@ typedef struct flthread_info {
     ull weight;
     ull slice;
     ull start_ticks;
+    ull start_cpu; // thread CPU time at start_ticks, ns, unless charging wall time
+    ull gen; // generation of the lock this entry belongs to, 0 if unused
+    ull last_release;
+    ull wait_start; // when the current acquisition started queueing, 0 to not record it
+    scl_wait_stats_t wait;
+    scl_stats_slot_t *stats;
+    scl_group_thread_t *group; // entry in lock->group, refreshed on every acquisition
     int banned;
+    int active; // weight is counted in total_weight, guarded by members_lock
+    int held; // buckets held, for a fairlock_table_t's accounting domain
+    int weight_auto; // weight is derived, see common/weight.h
+    struct flthread_info *mnext;
+    struct flthread_info **mpprev;
 #ifdef DEBUG
     stats_t stat;
 #endif
@@ -48,11 +68,18 @@ enum qnode_state {
     INIT = 0, // not waiting or after next runnable node
     NEXT,
     RUNNABLE,
-    RUNNING
+    RUNNING,
+    ABANDONED, // waiter timed out; whoever would promote the node skips it
+    DONE // the holder ran the node's fairlock_execute() request
 };
 
 typedef struct qnode {
     int state __attribute__ ((aligned (CACHELINE)));
+    // fairlock_execute() request, NULL once the holder or the waiter took it
+    void (*fn)(void *);
+    void *arg;
+    ull cs; // ticks the holder spent running the request
+    int wake_fd; // eventfd to signal along with the futex, plus one; 0 for none
     struct qnode *next __attribute__ ((aligned (CACHELINE)));
 } qnode_t __attribute__ ((aligned (CACHELINE)));
 
@@ -61,10 +88,105 @@ typedef struct fairlock {
     qnode_t *qnext __attribute__ ((aligned (CACHELINE)));
     ull slice __attribute__ ((aligned (CACHELINE)));
     int slice_valid __attribute__ ((aligned (CACHELINE)));
-    pthread_key_t flthread_info_key;
+    unsigned int id;
+    ull gen;
     ull total_weight;
+    ull *weights; // total_weight that bans are computed from, normally this lock's
+    scl_group_t *group; // accounting group that bans come from instead, if any
+    ull slice_len;
+    int charge; // enum fairlock_charge
+    // adaptive slice estimates, only written by the lock holder
+    int adaptive __attribute__ ((aligned (CACHELINE)));
+    ull slice_min;
+    ull slice_max;
+    ull avg_cs;
+    ull avg_handoff;
+    ull avg_waiters; // fixed point, x16
+    ull release_ticks;
+    ull slices;
+    scl_wait_policy_t waiting; // avg_hold also only written by the lock holder
+    int nwaiters __attribute__ ((aligned (CACHELINE)));
+    int parked; // waiters asleep on their RUNNABLE transition or on head_seq
+    int head_seq; // bumped when a delegating head waiter may have to wake
+    int head_fd; // eventfd of an asynchronous head waiter, plus one, see fairlock_async.h
+    // threads with accounting for this lock, scanned for inactivity
+    int members_lock __attribute__ ((aligned (CACHELINE)));
+    flthread_info_t *members;
+    ull next_scan;
+    scl_stats_t stats;
 } fairlock_t __attribute__ ((aligned (CACHELINE)));
 
+/*
+ * What a critical section is charged for when computing the ban. Wall time
+ * also charges time the holder spent preempted or blocked inside the
+ * critical section. CPU time reads CLOCK_THREAD_CPUTIME_ID when the
+ * critical section starts and ends. Each read is a system call; measured
+ * on an x86 VM an uncontended acquire/release pair took 93 ns charging
+ * wall time and 771 ns charging CPU time. Hybrid reads the clock at the
+ * start, but at the end only if the critical section took at least
+ * FAIRLOCK_CHARGE_HYBRID_MIN of wall time, as a shorter one cannot have
+ * lost much to preemption; the same pair took 346 ns.
+ */
+enum fairlock_charge {
+    FAIRLOCK_CHARGE_WALL = 0,
+    FAIRLOCK_CHARGE_CPU,
+    FAIRLOCK_CHARGE_HYBRID,
+};
+
+typedef struct fairlock_slice_stats {
+    int adaptive;
+    ull slice_ns;
+    ull avg_cs_ns;
+    ull avg_handoff_ns;
+    double avg_waiters;
+    ull slices;
+} fairlock_slice_stats_t;
+
+#define fl_ewma(avg, sample) ((avg) == 0 ? (sample) : \
+    (ull) ((long long) (avg) + (((long long) (sample) - (long long) (avg)) >> FAIRLOCK_EWMA_SHIFT)))
+
+/*
+ * Per-thread accounting lives in a thread-local slab indexed by a compact
+ * lock id, so the hot path does no TSD lookup and the number of locks is
+ * bounded only by memory. The slab is a directory of FL_SLAB_SIZE-entry
+ * chunks that are allocated the first time a thread touches a lock in that
+ * range. Ids are recycled when a lock is destroyed; the generation stored in
+ * each entry tells a stale entry from a live one.
+ */
+#define FL_SLAB_SHIFT 8
+#define FL_SLAB_SIZE (1U << FL_SLAB_SHIFT)
+
+typedef struct flslab {
+    flthread_info_t **chunks;
+    unsigned int nchunks;
+} flslab_t;
+
+SCL_SHARED_TLS flslab_t fl_slab;
+
+/*
+ * Queue nodes of timed acquisitions cannot live on the waiter's stack: a
+ * waiter that times out leaves its node behind for whoever skips it. Such
+ * nodes come from, and go back to, a per-thread cache so that they are
+ * never returned to malloc while a stale reader might still look at them.
+ */
+SCL_SHARED_TLS qnode_t *fl_qnode_cache;
+
+/*
+ * fl_ids_mutex guards id allocation and the registry that maps live ids to
+ * their locks, which a thread uses on exit to take its weight back out of
+ * every lock it has used.
+ */
+SCL_SHARED pthread_mutex_t fl_ids_mutex = PTHREAD_MUTEX_INITIALIZER;
+SCL_SHARED fairlock_t **fl_registry;
+SCL_SHARED unsigned int fl_registry_cap;
+SCL_SHARED pthread_key_t fl_exit_key;
+SCL_SHARED pthread_once_t fl_exit_once = PTHREAD_ONCE_INIT;
+SCL_SHARED unsigned int *fl_free_ids;
+SCL_SHARED unsigned int fl_nfree_ids;
+SCL_SHARED unsigned int fl_free_ids_cap;
+SCL_SHARED unsigned int fl_next_id;
+SCL_SHARED ull fl_next_gen = 1;
+
 static inline qnode_t *flqnode(fairlock_t *lock) {
     return (qnode_t *) ((char *) &lock->qnext - offsetof(qnode_t, next));
 }
@@ -73,239 +195,1169 @@ static inline int futex(int *uaddr, int futex_op, int val, const struct timespec
     return syscall(SYS_futex, uaddr, futex_op, val, timeout, NULL, 0);
 }
 
-int fairlock_init(fairlock_t *lock) {
+static int fl_id_alloc(fairlock_t *lock) {
+    int rc = 0;
+
+    pthread_mutex_lock(&fl_ids_mutex);
+    if (fl_nfree_ids > 0) {
+        lock->id = fl_free_ids[--fl_nfree_ids];
+    } else if (fl_next_id < (1U << 31)) {
+        lock->id = fl_next_id++;
+    } else {
+        rc = EAGAIN;
+        goto out;
+    }
+    if (lock->id >= fl_registry_cap) {
+        unsigned int cap = fl_registry_cap ? fl_registry_cap * 2 : 64;
+        fairlock_t **registry;
+        while (cap <= lock->id)
+            cap *= 2;
+        registry = (fairlock_t **) realloc(fl_registry, cap * sizeof(fairlock_t *));
+        if (NULL == registry) {
+            fl_next_id--;
+            rc = ENOMEM;
+            goto out;
+        }
+        memset(registry + fl_registry_cap, 0, (cap - fl_registry_cap) * sizeof(fairlock_t *));
+        fl_registry = registry;
+        fl_registry_cap = cap;
+    }
+    fl_registry[lock->id] = lock;
+    lock->gen = fl_next_gen++;
+out:
+    pthread_mutex_unlock(&fl_ids_mutex);
+    return rc;
+}
+
+static void fl_id_free(fairlock_t *lock) {
+    pthread_mutex_lock(&fl_ids_mutex);
+    fl_registry[lock->id] = NULL;
+    if (fl_nfree_ids == fl_free_ids_cap) {
+        unsigned int cap = fl_free_ids_cap ? fl_free_ids_cap * 2 : 64;
+        unsigned int *ids = (unsigned int *) realloc(fl_free_ids, cap * sizeof(unsigned int));
+        if (NULL == ids) {
+            // leak the id rather than fail the destroy
+            pthread_mutex_unlock(&fl_ids_mutex);
+            return;
+        }
+        fl_free_ids = ids;
+        fl_free_ids_cap = cap;
+    }
+    fl_free_ids[fl_nfree_ids++] = lock->id;
+    pthread_mutex_unlock(&fl_ids_mutex);
+}
+
+static inline void fl_members_lock(fairlock_t *lock) {
+    scl_wait_while(&lock->waiting, NULL, !__sync_bool_compare_and_swap(&lock->members_lock, 0, 1));
+}
+
+static inline void fl_members_unlock(fairlock_t *lock) {
+    __sync_lock_release(&lock->members_lock);
+}
+
+// Take the thread's weight out of total_weight. Needs members_lock.
+static inline void fl_deactivate(fairlock_t *lock, flthread_info_t *info) {
+    if (info->active) {
+        info->active = 0;
+        __sync_sub_and_fetch(lock->weights, info->weight);
+    }
+}
+
+// Take an entry out of a live lock for good. Needs fl_ids_mutex.
+static void fl_info_leave(fairlock_t *lock, flthread_info_t *info) {
+    fl_members_lock(lock);
+    fl_deactivate(lock, info);
+    if (NULL != info->mnext)
+        info->mnext->mpprev = info->mpprev;
+    *info->mpprev = info->mnext;
+    fl_members_unlock(lock);
+    scl_stats_retire(&lock->stats, info->stats);
+}
+
+static void fl_thread_exit(void *arg) {
+    unsigned int c, i;
+    qnode_t *n;
+
+    pthread_mutex_lock(&fl_ids_mutex);
+    for (c = 0; c < fl_slab.nchunks; c++) {
+        if (NULL == fl_slab.chunks[c])
+            continue;
+        for (i = 0; i < FL_SLAB_SIZE; i++) {
+            flthread_info_t *info = &fl_slab.chunks[c][i];
+            unsigned int id = c << FL_SLAB_SHIFT | i;
+            fairlock_t *lock;
+            if (0 == info->gen || id >= fl_registry_cap)
+                continue;
+            // skip entries of locks that have been destroyed since
+            lock = fl_registry[id];
+            if (NULL == lock || lock->gen != info->gen)
+                continue;
+            fl_info_leave(lock, info);
+        }
+        free(fl_slab.chunks[c]);
+    }
+    pthread_mutex_unlock(&fl_ids_mutex);
+    free(fl_slab.chunks);
+    fl_slab.chunks = NULL;
+    fl_slab.nchunks = 0;
+    while (NULL != (n = fl_qnode_cache)) {
+        fl_qnode_cache = n->next;
+        free(n);
+    }
+}
+
+static void fl_exit_key_create(void) {
+    pthread_key_create(&fl_exit_key, fl_thread_exit);
+}
+
+// Return the calling thread's slab entry for the lock, allocating it if needed.
+static flthread_info_t *flthread_info_slot(fairlock_t *lock) {
+    unsigned int c = lock->id >> FL_SLAB_SHIFT;
+
+    if (NULL == fl_slab.chunks) {
+        // have fl_thread_exit run when this thread exits
+        pthread_once(&fl_exit_once, fl_exit_key_create);
+        pthread_setspecific(fl_exit_key, &fl_slab);
+    }
+    if (c >= fl_slab.nchunks) {
+        unsigned int n = fl_slab.nchunks ? fl_slab.nchunks : 1;
+        flthread_info_t **chunks;
+        while (n <= c)
+            n *= 2;
+        chunks = (flthread_info_t **) realloc(fl_slab.chunks, n * sizeof(flthread_info_t *));
+        if (NULL == chunks)
+            return NULL;
+        memset(chunks + fl_slab.nchunks, 0, (n - fl_slab.nchunks) * sizeof(flthread_info_t *));
+        fl_slab.chunks = chunks;
+        fl_slab.nchunks = n;
+    }
+    if (NULL == fl_slab.chunks[c]) {
+        if (0 != posix_memalign((void **) &fl_slab.chunks[c], CACHELINE, FL_SLAB_SIZE * sizeof(flthread_info_t)))
+            return NULL;
+        memset(fl_slab.chunks[c], 0, FL_SLAB_SIZE * sizeof(flthread_info_t));
+    }
+    return &fl_slab.chunks[c][lock->id & (FL_SLAB_SIZE - 1)];
+}
+
+// Return the calling thread's accounting for the lock, or NULL if it has none yet.
+static inline flthread_info_t *flthread_info_lookup(fairlock_t *lock) {
+    unsigned int c = lock->id >> FL_SLAB_SHIFT;
+    flthread_info_t *info;
+
+    if (__builtin_expect(c < fl_slab.nchunks && NULL != fl_slab.chunks[c], 1)) {
+        info = &fl_slab.chunks[c][lock->id & (FL_SLAB_SIZE - 1)];
+        if (__builtin_expect(info->gen == lock->gen, 1))
+            return info;
+    }
+    return NULL;
+}
+
+SCL_API int fairlock_init(fairlock_t *lock) {
     int rc;
 
+    scl_clock_init();
+    scl_wait_init();
     lock->qtail = NULL;
     lock->qnext = NULL;
     lock->total_weight = 0;
+    lock->weights = &lock->total_weight;
+    lock->group = NULL;
     lock->slice = 0;
     lock->slice_valid = 0;
-    if (0 != (rc = pthread_key_create(&lock->flthread_info_key, NULL))) {
+    lock->slice_len = FAIRLOCK_GRANULARITY;
+    lock->charge = FAIRLOCK_CHARGE_WALL;
+    lock->adaptive = 0;
+    lock->slice_min = FAIRLOCK_ADAPT_MIN;
+    lock->slice_max = FAIRLOCK_ADAPT_MAX;
+    lock->avg_cs = 0;
+    lock->avg_handoff = 0;
+    lock->avg_waiters = 0;
+    lock->release_ticks = 0;
+    lock->slices = 0;
+    scl_wait_policy_init(&lock->waiting, SCL_WAIT_ADAPTIVE);
+    lock->nwaiters = 0;
+    lock->parked = 0;
+    lock->head_seq = 0;
+    lock->head_fd = 0;
+    lock->members_lock = 0;
+    lock->members = NULL;
+    lock->next_scan = 0;
+    if (0 != (rc = fl_id_alloc(lock))) {
         return rc;
     }
+    scl_stats_init(&lock->stats);
     return 0;
 }
 
-static flthread_info_t *flthread_info_create(fairlock_t *lock, int weight) {
-    flthread_info_t *info;
-    info = malloc(sizeof(flthread_info_t));
-    info->banned_until = rdtsc();
-    if (weight == 0) {
-        int prio = getpriority(PRIO_PROCESS, 0);
-        weight = prio_to_weight[prio+20];
-    }
+// Set up info as the accounting of a new member of the lock. Returns info, or NULL.
+static flthread_info_t *fl_info_join(fairlock_t *lock, flthread_info_t *info, int weight, int role) {
+    info->banned_until = scl_now();
+    info->weight_auto = 0 == weight;
+    if (info->weight_auto)
+        weight = scl_thread_weight_at(info->banned_until);
     info->weight = weight;
-    __sync_add_and_fetch(&lock->total_weight, weight);
     info->banned = 0;
     info->slice = 0;
     info->start_ticks = 0;
+    info->last_release = info->banned_until;
+    info->wait_start = 0;
+    info->held = 0;
+    info->group = NULL;
+    if (NULL == (info->stats = scl_stats_claim(&lock->stats, role, weight)))
+        return NULL;
+    memset(&info->wait, 0, sizeof(info->wait));
 #ifdef DEBUG
     memset(&info->stat, 0, sizeof(stats_t));
     info->stat.start = info->banned_until;
 #endif
+    fl_members_lock(lock);
+    info->active = 1;
+    __sync_add_and_fetch(lock->weights, weight);
+    info->mnext = lock->members;
+    if (NULL != info->mnext)
+        info->mnext->mpprev = &info->mnext;
+    info->mpprev = &lock->members;
+    lock->members = info;
+    info->gen = lock->gen;
+    fl_members_unlock(lock);
+    fl_trace(lock, FL_TRACE_WEIGHT, weight);
     return info;
 }
 
-void fairlock_thread_init(fairlock_t *lock, int weight) {
-    flthread_info_t *info;
-    info = (flthread_info_t *) pthread_getspecific(lock->flthread_info_key);
-    if (NULL != info) {
-        free(info);
+static flthread_info_t *flthread_info_create(fairlock_t *lock, int weight) {
+    flthread_info_t *info = flthread_info_slot(lock);
+
+    if (NULL == info || NULL == fl_info_join(lock, info, weight, SCL_STATS_THREAD))
+        abort();
+    return info;
+}
+
+static void fl_update_weight(fairlock_t *lock, flthread_info_t *info, ull weight) {
+    fl_members_lock(lock);
+    if (info->active)
+        __sync_add_and_fetch(lock->weights, (ull) weight - info->weight);
+    info->weight = weight;
+    info->stats->weight = weight;
+    fl_members_unlock(lock);
+    fl_trace(lock, FL_TRACE_WEIGHT, weight);
+}
+
+/*
+ * Change the calling thread's weight for the lock; 0 derives it from the
+ * thread's scheduling parameters (see common/weight.h) and keeps it up to
+ * date with them. Safe while other threads use the lock: their next
+ * release sees the new total_weight.
+ */
+SCL_API void fairlock_set_weight(fairlock_t *lock, int weight) {
+    flthread_info_t *info = flthread_info_lookup(lock);
+
+    if (NULL == info) {
+        flthread_info_create(lock, weight);
+        return;
+    }
+    info->weight_auto = 0 == weight;
+    fl_update_weight(lock, info, info->weight_auto ? scl_thread_weight() : (ull) weight);
+}
+
+SCL_API void fairlock_thread_init(fairlock_t *lock, int weight) {
+    fairlock_set_weight(lock, weight);
+}
+
+// Count a thread that went inactive towards total_weight again.
+static void fl_reactivate(fairlock_t *lock, flthread_info_t *info) {
+    ull now = scl_now();
+
+    fl_members_lock(lock);
+    if (!info->active) {
+        info->active = 1;
+        __sync_add_and_fetch(lock->weights, info->weight);
+    }
+    fl_members_unlock(lock);
+    // idle time does not turn into credit
+    if (info->banned_until < now)
+        info->banned_until = now;
+}
+
+/*
+ * Drop threads that have not released the lock within
+ * FAIRLOCK_INACTIVE_THRESHOLD out of total_weight, like the waiter scan in
+ * k-SCL's fair_unlock. Called by the releasing thread at most once per
+ * threshold, and skipped if another thread is updating the member list.
+ */
+static void fl_scan_inactive(fairlock_t *lock, ull now) {
+    flthread_info_t *m;
+
+    if (!__sync_bool_compare_and_swap(&lock->members_lock, 0, 1))
+        return;
+    lock->next_scan = now + FAIRLOCK_INACTIVE_THRESHOLD;
+    for (m = lock->members; NULL != m; m = m->mnext) {
+        if (m->active && readvol(m->last_release) + FAIRLOCK_INACTIVE_THRESHOLD < now)
+            fl_deactivate(lock, m);
     }
-    info = flthread_info_create(lock, weight);
-    pthread_setspecific(lock->flthread_info_key, info);
+    fl_members_unlock(lock);
+}
+
+static inline ull fl_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Called by the new holder.
+static inline void fl_start_cs(fairlock_t *lock, flthread_info_t *info, ull now, int reentry) {
+    info->start_ticks = now;
+    scl_stats_acquired(info->stats, now, reentry);
+    if (lock->charge != FAIRLOCK_CHARGE_WALL)
+        info->start_cpu = fl_cpu_ns();
+}
+
+// Length of the critical section that ends now, as charged to the holder.
+static inline ull fl_cs_charge(fairlock_t *lock, flthread_info_t *info, ull now) {
+    ull cs = now - info->start_ticks, cpu;
+
+    if (lock->charge == FAIRLOCK_CHARGE_WALL ||
+            (lock->charge == FAIRLOCK_CHARGE_HYBRID && cs < FAIRLOCK_CHARGE_HYBRID_MIN))
+        return cs;
+    // never charge more than the wall time, which the TSC measures better
+    cpu = scl_ns_to_ticks(fl_cpu_ns() - info->start_cpu);
+    return cpu < cs ? cpu : cs;
 }
 
-int fairlock_destroy(fairlock_t *lock) {
-    //return pthread_key_delete(lock->flthread_info_key);
+/*
+ * Charge a critical section of cs ticks that ended at now to the thread:
+ * ban it for cs scaled by total_weight over its weight, or by the group's
+ * if the lock is in one.
+ */
+static inline void fl_charge(fairlock_t *lock, flthread_info_t *info, ull cs, ull now) {
+    if (NULL != lock->group)
+        info->banned_until = scl_group_charge(lock->group, info->group, cs, now);
+    else
+        info->banned_until += cs * (__atomic_load_n(lock->weights, __ATOMIC_RELAXED) / info->weight);
+    info->banned = now < info->banned_until;
+    info->last_release = now;
+    if (now >= readvol(lock->next_scan))
+        fl_scan_inactive(lock, now);
+    // a derived weight follows the thread's scheduling parameters
+    if (info->weight_auto && __builtin_expect(scl_thread_weight_at(now) != info->weight, 0))
+        fl_update_weight(lock, info, scl_thread_weight_at(now));
+}
+
+// Charge the critical section that ends now to the holder.
+static inline void fl_account(fairlock_t *lock, flthread_info_t *info, ull now) {
+    scl_stats_released(info->stats, now);
+    fl_charge(lock, info, fl_cs_charge(lock, info, now), now);
+}
+
+// Select what critical sections are charged for. Call before the lock is shared.
+SCL_API void fairlock_set_charge(fairlock_t *lock, enum fairlock_charge charge) {
+    lock->charge = charge;
+}
+
+// How waiters wait, one of enum scl_wait_strategy. Call before the lock is shared.
+SCL_API void fairlock_set_wait(fairlock_t *lock, int strategy) {
+    scl_wait_policy_init(&lock->waiting, strategy);
+}
+
+/*
+ * Charge critical sections on the lock to group and ban threads across it
+ * (see common/group.h) instead of on this lock alone. Call before the lock
+ * is shared.
+ */
+SCL_API void fairlock_set_group(fairlock_t *lock, scl_group_t *group) {
+    lock->group = group;
+}
+
+// Use slices of slice_us (0 picks FAIRLOCK_GRANULARITY). Call before the lock is shared.
+SCL_API void fairlock_set_slice(fairlock_t *lock, ull slice_us) {
+    lock->slice_len = slice_us ? slice_us * CYCLE_PER_US : FAIRLOCK_GRANULARITY;
+    lock->adaptive = 0;
+}
+
+/*
+ * Let the lock size its slices from observed critical-section length,
+ * handoff latency and queue length, within [min_us, max_us] (0 picks the
+ * defaults). Call before the lock is shared.
+ */
+SCL_API void fairlock_set_adaptive(fairlock_t *lock, ull min_us, ull max_us) {
+    lock->slice_min = min_us ? min_us * CYCLE_PER_US : FAIRLOCK_ADAPT_MIN;
+    lock->slice_max = max_us ? max_us * CYCLE_PER_US : FAIRLOCK_ADAPT_MAX;
+    if (lock->slice_max < lock->slice_min)
+        lock->slice_max = lock->slice_min;
+    lock->slice_len = lock->slice_min;
+    lock->adaptive = 1;
+}
+
+// Called by the new slice owner.
+static void fl_adaptive_resize(fairlock_t *lock) {
+    ull len, cap;
+
+    // long enough to batch critical sections and amortize the handoff ...
+    len = lock->avg_cs * FAIRLOCK_ADAPT_CS_PER_SLICE;
+    if (len < lock->avg_handoff * FAIRLOCK_ADAPT_HANDOFF_RATIO)
+        len = lock->avg_handoff * FAIRLOCK_ADAPT_HANDOFF_RATIO;
+    // ... but short enough that a full round over the waiters fits in slice_max
+    cap = lock->slice_max * 16 / (16 + lock->avg_waiters);
+    if (len > cap)
+        len = cap;
+    if (len < lock->slice_min)
+        len = lock->slice_min;
+    if (len > lock->slice_max)
+        len = lock->slice_max;
+    lock->slice_len = len;
+    lock->slices++;
+}
+
+/*
+ * How far the calling thread's timed waits on the lock (bans, slice and
+ * queue waits with a deadline) overshot their deadlines, in nanoseconds.
+ */
+SCL_API void fairlock_wait_stats(fairlock_t *lock, scl_wait_stats_t *stats) {
+    flthread_info_t *info = flthread_info_lookup(lock);
+
+    memset(stats, 0, sizeof(*stats));
+    if (NULL == info)
+        return;
+    stats->waits = info->wait.waits;
+    stats->overshoot = scl_ticks_to_ns(info->wait.overshoot);
+    stats->overshoot_max = scl_ticks_to_ns(info->wait.overshoot_max);
+}
+
+SCL_API void fairlock_slice_stats(fairlock_t *lock, fairlock_slice_stats_t *stats) {
+    stats->adaptive = lock->adaptive;
+    stats->slice_ns = scl_ticks_to_ns(readvol(lock->slice_len));
+    stats->avg_cs_ns = scl_ticks_to_ns(readvol(lock->avg_cs));
+    stats->avg_handoff_ns = scl_ticks_to_ns(readvol(lock->avg_handoff));
+    stats->avg_waiters = readvol(lock->avg_waiters) / 16.0;
+    stats->slices = readvol(lock->slices);
+}
+
+/*
+ * Snapshot the lock's counters: acquisitions, reentries, slices, ban, queue
+ * wait and hold times per thread and in total, histograms of queue wait
+ * and hold times, each thread's entitled versus received share, and the
+ * time it spent spinning and how often it yielded or slept. Safe to call
+ * from any thread while the lock is in use; free the snapshot with
+ * scl_stats_snapshot_free(). Returns 0 or ENOMEM.
+ */
+SCL_API int fairlock_stats(fairlock_t *lock, scl_stats_snapshot_t *snap) {
+    return scl_stats_snapshot(&lock->stats, snap);
+}
+
+/*
+ * Threads keep their slab entries of a destroyed lock until they exit or
+ * the id is reused; the generation check makes those entries look unused.
+ */
+SCL_API int fairlock_destroy(fairlock_t *lock) {
+    fl_id_free(lock);
+    scl_stats_destroy(&lock->stats);
     return 0;
 }
 
-void fairlock_acquire(fairlock_t *lock) {
-    flthread_info_t *info;
-    ull now;
+#define FL_NO_DEADLINE SCL_NO_DEADLINE
 
-    info = (flthread_info_t *) pthread_getspecific(lock->flthread_info_key);
-    if (NULL == info) {
-        info = flthread_info_create(lock, 0);
-        pthread_setspecific(lock->flthread_info_key, info);
+static qnode_t *fl_qnode_get(void) {
+    qnode_t *n = fl_qnode_cache;
+
+    if (NULL != n) {
+        fl_qnode_cache = n->next;
+    } else if (0 != posix_memalign((void **) &n, CACHELINE, sizeof(qnode_t))) {
+        return NULL;
+    }
+    n->state = INIT;
+    n->fn = NULL;
+    n->wake_fd = 0;
+    n->next = NULL;
+    return n;
+}
+
+static void fl_qnode_put(qnode_t *n) {
+    n->next = fl_qnode_cache;
+    fl_qnode_cache = n;
+}
+
+// Signal an eventfd given plus one, as qnode_t.wake_fd and fairlock_t.head_fd are.
+static inline void fl_notify(int wake_fd) {
+    if (0 != wake_fd)
+        eventfd_write(wake_fd - 1, 1);
+}
+
+/*
+ * Move n from INIT to state and wake its waiter. Returns 0 if n was not
+ * INIT. The waiter may move on and reuse n as soon as it leaves INIT, so
+ * its eventfd is read before.
+ */
+static inline int fl_qnode_promote(qnode_t *n, int state) {
+    int wake_fd = readvol(n->wake_fd);
+
+    if (!__sync_bool_compare_and_swap(&n->state, INIT, state))
+        return 0;
+    futex(&n->state, FUTEX_WAKE_PRIVATE, 1, NULL);
+    fl_notify(wake_fd);
+    return 1;
+}
+
+/*
+ * Remove the abandoned node a, which lock->qnext points to, from the queue.
+ * Called by the lock holder. Returns the node behind a, now in lock->qnext,
+ * or NULL after resetting the tail to empty (flqnode(lock) while holding
+ * the lock, NULL while releasing it).
+ */
+static qnode_t *fl_qnode_unlink(fairlock_t *lock, qnode_t *a, qnode_t *empty) {
+    qnode_t *next = readvol(a->next);
+
+    if (NULL == next) {
+        lock->qnext = NULL;
+        if (__sync_bool_compare_and_swap(&lock->qtail, a, empty)) {
+            fl_qnode_put(a);
+            return NULL;
+        }
+        scl_wait_while(&lock->waiting, NULL, NULL == (next = readvol(a->next)));
+    }
+    lock->qnext = next;
+    fl_qnode_put(a);
+    return next;
+}
+
+/*
+ * Make the first live waiter from succ on RUNNABLE while releasing the lock.
+ * Nodes behind an abandoned node have never been promoted, so they are
+ * either INIT or abandoned themselves.
+ */
+static void fl_release_skip(fairlock_t *lock, qnode_t *succ) {
+    while (NULL != (succ = fl_qnode_unlink(lock, succ, NULL))) {
+        if (fl_qnode_promote(succ, RUNNABLE))
+            return;
+    }
+}
+
+/*
+ * n was RUNNABLE at the head of a free lock when its waiter gave up, so the
+ * waiter has to pass the lock on itself. The slice owner may be reentering
+ * concurrently: it sees n abandoned and queues normally. lock->qnext is
+ * moved off n with a CAS because the promoted waiter may already have
+ * replaced it.
+ */
+static void fl_pass_abandoned(fairlock_t *lock, qnode_t *n) {
+    qnode_t *a = n, *succ;
+
+    while (1) {
+        succ = readvol(a->next);
+        if (NULL == succ) {
+            if (__sync_bool_compare_and_swap(&lock->qtail, a, NULL)) {
+                __sync_bool_compare_and_swap(&lock->qnext, n, NULL);
+                break;
+            }
+            scl_wait_while(&lock->waiting, NULL, NULL == (succ = readvol(a->next)));
+        }
+        if (a != n)
+            fl_qnode_put(a);
+        if (fl_qnode_promote(succ, RUNNABLE)) {
+            __sync_bool_compare_and_swap(&lock->qnext, n, succ);
+            a = n;
+            break;
+        }
+        a = succ;
+    }
+    if (a != n)
+        fl_qnode_put(a);
+    fl_qnode_put(n);
+}
+
+/*
+ * Give up a queued node after its deadline. Returns 0 if the node was
+ * promoted to RUNNING in the meantime and the lock is held after all.
+ */
+static int fl_abandon(fairlock_t *lock, qnode_t *n) {
+    while (1) {
+        int state = readvol(n->state);
+        switch (state) {
+        case INIT:
+        case NEXT:
+            // the node now belongs to whoever would have promoted it
+            if (__sync_bool_compare_and_swap(&n->state, state, ABANDONED))
+                goto abandoned;
+            break;
+        case RUNNABLE:
+            if (__sync_bool_compare_and_swap(&n->state, RUNNABLE, ABANDONED)) {
+                fl_pass_abandoned(lock, n);
+                goto abandoned;
+            }
+            break;
+        default:
+            return 0;
+        }
     }
+abandoned:
+    if (lock->adaptive)
+        __sync_fetch_and_sub(&lock->nwaiters, 1);
+    fl_trace(lock, FL_TRACE_ABANDON, 0);
+    return 1;
+}
+
+// If owner of current slice, try to reenter at the beginning of the queue
+static int fl_reenter(fairlock_t *lock, flthread_info_t *info) {
+    ull now;
 
     if (readvol(lock->slice_valid)) {
         ull curr_slice = lock->slice;
-        // If owner of current slice, try to reenter at the beginning of the queue
-        if (curr_slice == info->slice && (now = rdtsc()) < curr_slice) {
+        if (curr_slice == info->slice && (now = scl_now()) < curr_slice) {
             qnode_t *succ = readvol(lock->qnext);
             if (NULL == succ) {
                 if (__sync_bool_compare_and_swap(&lock->qtail, NULL, flqnode(lock)))
                     goto reenter;
-                spin_then_yield(SPIN_LIMIT, (now = rdtsc()) < curr_slice && NULL == (succ = readvol(lock->qnext)));
+                scl_wait_while(&lock->waiting, info->stats, (now = scl_now()) < curr_slice &&
+                               NULL == (succ = readvol(lock->qnext)) && flqnode(lock) != readvol(lock->qtail));
 #ifdef DEBUG
-                info->stat.own_slice_wait += rdtsc() - now;
+                info->stat.own_slice_wait += scl_now() - now;
 #endif
                 // let the succ invalidate the slice, and don't need to wake it up because slice expires naturally
                 if (now >= curr_slice)
-                    goto begin;
+                    return 0;
+                // another thread acting for the same task holds the lock
+                if (NULL == succ)
+                    return 0;
             }
-            // if state < RUNNABLE, it won't become RUNNABLE unless someone releases lock,
-            // but as no one is holding the lock, there is no race
-            if (succ->state < RUNNABLE || __sync_bool_compare_and_swap(&succ->state, RUNNABLE, NEXT)) {
+            // while we are not holding the lock the head waiter is RUNNABLE; if
+            // it is not, our slice expired meanwhile and someone else holds it
+            if (__sync_bool_compare_and_swap(&succ->state, RUNNABLE, NEXT)) {
 reenter:
 #ifdef DEBUG
                 info->stat.reenter++;
 #endif
-                info->start_ticks = now;
-                return;
+                fl_start_cs(lock, info, now, 1);
+                fl_trace(lock, FL_TRACE_REENTER, 0);
+                return 1;
             }
         }
     }
-begin:
+    return 0;
+}
 
-    if (info->banned) {
-        if ((now = rdtsc()) < info->banned_until) {
-            ull banned_time = info->banned_until - now;
+static void fl_wait_ban(fairlock_t *lock, flthread_info_t *info) {
+    ull now = scl_now();
 #ifdef DEBUG
-            info->stat.banned_time += banned_time;
+    if (now < info->banned_until)
+        info->stat.banned_time += info->banned_until - now;
 #endif
-            // sleep with granularity of SLEEP_GRANULARITY us
-            while (banned_time > CYCLE_PER_US * SLEEP_GRANULARITY) {
-                struct timespec req = {
-                    .tv_sec = banned_time / CYCLE_PER_S,
-                    .tv_nsec = (banned_time % CYCLE_PER_S / CYCLE_PER_US / SLEEP_GRANULARITY) * SLEEP_GRANULARITY * 1000,
-                };
-                nanosleep(&req, NULL);
-                if ((now = rdtsc()) >= info->banned_until)
-                    break;
-                banned_time = info->banned_until - now;
-            }
-            // spin for the remaining (<SLEEP_GRANULARITY us)
-            spin_then_yield(SPIN_LIMIT, (now = rdtsc()) < info->banned_until);
-        }
-    }
+    if (now >= info->banned_until)
+        return;
+    fl_trace(lock, FL_TRACE_BAN_START, scl_ticks_to_ns(info->banned_until - now) / 1000);
+    scl_wait_until(info->banned_until, &info->wait);
+    fl_trace(lock, FL_TRACE_BAN_END, 0);
+    info->stats->c.ban += scl_now() - now;
+}
+
+// Append n to the lock queue and return its predecessor.
+static qnode_t *fl_enqueue(fairlock_t *lock, qnode_t *n) {
+    if (lock->adaptive)
+        __sync_fetch_and_add(&lock->nwaiters, 1);
 
-    qnode_t n = { 0 };
     while (1) {
         qnode_t *prev = readvol(lock->qtail);
-        if (__sync_bool_compare_and_swap(&lock->qtail, prev, &n)) {
+        if (__sync_bool_compare_and_swap(&lock->qtail, prev, n)) {
             // enter the lock queue
             if (NULL == prev) {
-                n.state = RUNNABLE;
-                lock->qnext = &n;
+                n->state = RUNNABLE;
+                lock->qnext = n;
             } else {
                 if (prev == flqnode(lock)) {
-                    n.state = NEXT;
-                    prev->next = &n;
-                } else {
-                    prev->next = &n;
-                    // wait until we become the next runnable
+                    n->state = NEXT;
+                }
+                prev->next = n;
+            }
+            return prev;
+        }
+    }
+}
+
+/*
+ * Wait for the releaser to make n RUNNABLE and move it to RUNNING, or until
+ * the deadline. The wait is as long as the holder's critical section, so
+ * past the spin budget the waiter sleeps on n->state and the releaser wakes
+ * it if lock->parked says anyone is asleep. Only the head waiter gets here.
+ */
+static void fl_wait_runnable(fairlock_t *lock, flthread_info_t *info, qnode_t *n, ull deadline) {
+    scl_waiter_t w;
+    int state;
+
+    scl_waiter_init(&w, &lock->waiting, info->stats);
+    while (1) {
+        state = readvol(n->state);
+        if (RUNNABLE == state) {
+            if (__sync_bool_compare_and_swap(&n->state, RUNNABLE, RUNNING))
+                break;
+            continue;
+        }
+        if (FL_NO_DEADLINE != deadline && scl_now() >= deadline)
+            break;
+        if (lock->waiting.strategy >= SCL_WAIT_PARK && !scl_waiter_spinning(&w)) {
+            __sync_fetch_and_add(&lock->parked, 1);
+            scl_waiter_park(&w, &n->state, state, deadline);
+            __sync_fetch_and_sub(&lock->parked, 1);
+        } else {
+            scl_waiter_pause(&w);
+        }
+    }
+    scl_waiter_done(&w);
+}
+
+/*
+ * Wake a fairlock_execute() caller asleep at the head of the queue, see
+ * fl_execute_wait(), or an asynchronous head waiter. The caller must have
+ * made its change with a full barrier.
+ */
+static inline void fl_wake_head(fairlock_t *lock) {
+    if (readvol(lock->parked)) {
+        __sync_fetch_and_add(&lock->head_seq, 1);
+        futex(&lock->head_seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL);
+        fl_notify(readvol(lock->head_fd));
+    }
+}
+
+/*
+ * n has just moved to RUNNING at the head of the queue: take it out of the
+ * queue, start a new slice and make the next waiter NEXT.
+ */
+static void fl_start_slice(fairlock_t *lock, flthread_info_t *info, qnode_t *n, qnode_t *prev) {
+    ull now;
+
+    fl_trace(lock, FL_TRACE_RUNNING, 0);
 #ifdef DEBUG
-                    now = rdtsc();
+    now = scl_now();
 #endif
-                    do {
-                        futex(&n.state, FUTEX_WAIT_PRIVATE, INIT, NULL);
-                    } while (INIT == readvol(n.state));
+    // record the successor in the lock so we can notify it when we release
+    qnode_t *succ = readvol(n->next);
+    if (NULL == succ) {
+        lock->qnext = NULL;
+        if (0 == __sync_bool_compare_and_swap(&lock->qtail, n, flqnode(lock))) {
+            scl_wait_while(&lock->waiting, info->stats, NULL == (succ = readvol(n->next)));
 #ifdef DEBUG
-                    info->stat.next_runnable_wait += rdtsc() - now;
+            info->stat.succ_wait += scl_now() - now;
 #endif
-                }
-            }
-            // invariant: n.state >= NEXT
-
-            // wait until the current slice expires
-            int slice_valid;
-            ull curr_slice;
-            while ((slice_valid = readvol(lock->slice_valid)) && (now = rdtsc()) + SLEEP_GRANULARITY < (curr_slice = readvol(lock->slice))) {
-                ull slice_left = curr_slice - now;
-                struct timespec timeout = {
-                    .tv_sec = 0, // slice will be less then 1 sec
-                    .tv_nsec = (slice_left / (CYCLE_PER_US * SLEEP_GRANULARITY)) * SLEEP_GRANULARITY * 1000,
-                };
-                futex(&lock->slice_valid, FUTEX_WAIT_PRIVATE, 0, &timeout);
+            lock->qnext = succ;
+        }
+    } else {
+        lock->qnext = succ;
+    }
+    // invariant: NULL == succ <=> lock->qtail == flqnode(lock)
+
+    now = scl_now();
+    if (lock->adaptive) {
+        // handoff: from the later of the previous release and the end of
+        // the previous slice until we own the lock
+        ull from = lock->release_ticks > lock->slice ? lock->release_ticks : lock->slice;
+        int waiters = __sync_sub_and_fetch(&lock->nwaiters, 1);
+        if (NULL != prev && now > from)
+            lock->avg_handoff = fl_ewma(lock->avg_handoff, now - from);
+        lock->avg_waiters = fl_ewma(lock->avg_waiters, (ull) waiters * 16);
+        fl_adaptive_resize(lock);
+    }
+    fl_start_cs(lock, info, now, 0);
+    info->stats->c.handoffs++;
+    if (info->wait_start)
+        scl_stats_wait(info->stats, now - info->wait_start);
+    info->slice = now + lock->slice_len;
+    lock->slice = info->slice;
+    lock->slice_valid = 1;
+    fl_trace(lock, FL_TRACE_SLICE, scl_ticks_to_ns(lock->slice_len) / 1000);
+    // repeated so that the analyzer knows it once the joining event is overwritten
+    fl_trace(lock, FL_TRACE_WEIGHT, info->weight);
+    // wake up successor if necessary, skipping waiters that timed out
+    while (succ && !fl_qnode_promote(succ, NEXT))
+        succ = fl_qnode_unlink(lock, succ, flqnode(lock));
+}
+
+/*
+ * Wait in the queue until n owns the lock and start a new slice. Returns 0
+ * with the lock held, or ETIMEDOUT once the deadline has passed and n has
+ * been abandoned.
+ */
+static int fl_queue_wait(fairlock_t *lock, flthread_info_t *info, qnode_t *n, qnode_t *prev, ull deadline) {
+    ull now;
+
+    if (INIT == readvol(n->state)) {
+        // wait until we become the next runnable
 #ifdef DEBUG
-                info->stat.prev_slice_wait += rdtsc() - now;
+        now = scl_now();
 #endif
+        do {
+            if (ETIMEDOUT == scl_futex_wait_until(&n->state, INIT, deadline, &info->wait, 0)) {
+                scl_spin_while(INIT == readvol(n->state) && scl_now() < deadline);
+                if (INIT == readvol(n->state) && fl_abandon(lock, n))
+                    return ETIMEDOUT;
             }
-            if (slice_valid) {
-                spin_then_yield(SPIN_LIMIT, (slice_valid = readvol(lock->slice_valid)) && rdtsc() < readvol(lock->slice));
-                if (slice_valid)
-                    lock->slice_valid = 0;
-            }
-            // invariant: rdtsc() >= curr_slice && lock->slice_valid == 0
-
+        } while (INIT == readvol(n->state));
 #ifdef DEBUG
-            now = rdtsc();
+        info->stat.next_runnable_wait += scl_now() - now;
 #endif
-            // spin until RUNNABLE and try to grab the lock
-            spin_then_yield(SPIN_LIMIT, RUNNABLE != readvol(n.state) || 0 == __sync_bool_compare_and_swap(&n.state, RUNNABLE, RUNNING));
-            // invariant: n.state == RUNNING
+    }
+    fl_trace(lock, FL_TRACE_NEXT, 0);
+    // invariant: n->state >= NEXT
+
+    // wait until the current slice expires or is given up
+    int slice_valid;
+    ull curr_slice;
+    while ((slice_valid = readvol(lock->slice_valid)) && (now = scl_now()) < (curr_slice = readvol(lock->slice))) {
+        ull until = curr_slice < deadline ? curr_slice : deadline;
+        int rc = scl_futex_wait_until(&lock->slice_valid, 1, until, &info->wait, 0);
 #ifdef DEBUG
-            info->stat.runnable_wait += rdtsc() - now;
+        info->stat.prev_slice_wait += scl_now() - now;
 #endif
+        if (ETIMEDOUT != rc)
+            continue;
+        scl_spin_while((slice_valid = readvol(lock->slice_valid)) && (now = scl_now()) < until);
+        if (slice_valid && until == deadline && now < curr_slice) {
+            if (fl_abandon(lock, n))
+                return ETIMEDOUT;
+            break;
+        }
+    }
+    if (slice_valid) {
+        scl_wait_while(&lock->waiting, info->stats, (slice_valid = readvol(lock->slice_valid)) && scl_now() < readvol(lock->slice));
+        if (slice_valid)
+            lock->slice_valid = 0;
+    }
+    // invariant: scl_now() >= curr_slice && lock->slice_valid == 0
 
-            // record the successor in the lock so we can notify it when we release
-            qnode_t *succ = readvol(n.next);
-            if (NULL == succ) {
-                lock->qnext = NULL;
-                if (0 == __sync_bool_compare_and_swap(&lock->qtail, &n, flqnode(lock))) {
-                    spin_then_yield(SPIN_LIMIT, NULL == (succ = readvol(n.next)));
 #ifdef DEBUG
-                    info->stat.succ_wait += rdtsc() - now;
+    now = scl_now();
 #endif
-                    lock->qnext = succ;
-                }
-            } else {
-                lock->qnext = succ;
-            }
-            // invariant: NULL == succ <=> lock->qtail == flqnode(lock)
-
-            now = rdtsc();
-            info->start_ticks = now;
-            info->slice = now + FAIRLOCK_GRANULARITY;
-            lock->slice = info->slice;
-            lock->slice_valid = 1;
-            // wake up successor if necessary
-            if (succ) {
-                succ->state = NEXT;
-                futex(&succ->state, FUTEX_WAKE_PRIVATE, 1, NULL);
-            }
-            return;
+    // wait until RUNNABLE and try to grab the lock
+    if (!__sync_bool_compare_and_swap(&n->state, RUNNABLE, RUNNING))
+        fl_wait_runnable(lock, info, n, deadline);
+    if (RUNNING != readvol(n->state) && fl_abandon(lock, n))
+        return ETIMEDOUT;
+    // invariant: n->state == RUNNING
+#ifdef DEBUG
+    info->stat.runnable_wait += scl_now() - now;
+#endif
+    fl_start_slice(lock, info, n, prev);
+    return 0;
+}
+
+// Bring the accounting of an acquisition that is about to start up to date.
+static inline flthread_info_t *fl_info_refresh(fairlock_t *lock, flthread_info_t *info) {
+    if (__builtin_expect(!readvol(info->active), 0))
+        fl_reactivate(lock, info);
+    if (NULL != lock->group) {
+        // the group's ban replaces the lock's own
+        info->group = scl_group_self(lock->group);
+        info->banned_until = info->group->banned_until;
+        info->banned = 1;
+    }
+    return info;
+}
+
+/*
+ * Accounting identities. A fairlock_task_t stands for a logical task or a
+ * tenant that is charged for its critical sections in place of the thread
+ * that runs them, with a weight of its own, so that work multiplexed onto
+ * a few threads still gets its share. Its entry for each lock is created
+ * the first time it uses the lock, and entries are only added until the
+ * task is destroyed, so threads find them without locking. A lookup starts
+ * at the entry found last, so a release finds the entry of its acquisition
+ * at once, and the search for a new lock is done before queueing.
+ *
+ * A thread acquires on behalf of a task either through the _as variants
+ * of the lock functions or by making the task its current one with
+ * fairlock_task_switch(), after which the plain functions charge the task.
+ * Handing a task to another thread costs nothing beyond the store of the
+ * pointer, and several threads may act for one task at once: its ban and
+ * slice are only updated by whichever of them holds the lock, though its
+ * statistics may then miss some waits. On a lock in an accounting group,
+ * a task is charged through the group entry of the thread that runs it;
+ * on a fairlock_cohort_t its weight does not follow it across nodes, and
+ * a fairlock_table_t must not be used by one task from two threads at once.
+ */
+typedef struct fl_task_entry {
+    fairlock_t *lock;
+    ull gen;
+    unsigned int id;
+    flthread_info_t *info;
+    struct fl_task_entry *next;
+} fl_task_entry_t;
+
+typedef struct fairlock_task {
+    int weight;
+    int id; // stands in for the thread id in the statistics
+    fl_task_entry_t *entries; // newest first
+    fl_task_entry_t *hint; // entry found last
+    pthread_mutex_t mutex; // serializes additions
+} fairlock_task_t;
+
+SCL_SHARED int fl_next_task_id = 1;
+// the task the calling thread acquires for, NULL for itself
+SCL_SHARED_TLS fairlock_task_t *fl_task_current;
+
+// Whether the lock of a task entry still exists. Needs fl_ids_mutex.
+static inline int fl_task_entry_alive(fl_task_entry_t *e) {
+    return e->id < fl_registry_cap && fl_registry[e->id] == e->lock && e->lock->gen == e->gen;
+}
+
+// 0 gives the task the weight of a nice 0 thread.
+SCL_API void fairlock_task_init(fairlock_task_t *task, int weight) {
+    task->weight = weight ? weight : prio_to_weight[20];
+    task->id = __sync_fetch_and_add(&fl_next_task_id, 1);
+    task->entries = NULL;
+    task->hint = NULL;
+    pthread_mutex_init(&task->mutex, NULL);
+}
+
+// Change the task's weight on every lock it has used.
+SCL_API void fairlock_task_set_weight(fairlock_task_t *task, int weight) {
+    pthread_mutex_lock(&task->mutex);
+    task->weight = weight ? weight : prio_to_weight[20];
+    pthread_mutex_lock(&fl_ids_mutex);
+    for (fl_task_entry_t *e = task->entries; NULL != e; e = e->next) {
+        if (fl_task_entry_alive(e))
+            fl_update_weight(e->lock, e->info, task->weight);
+    }
+    pthread_mutex_unlock(&fl_ids_mutex);
+    pthread_mutex_unlock(&task->mutex);
+}
+
+// Take the task out of every lock it has used. It must hold and wait for none,
+// and be no thread's current task.
+SCL_API void fairlock_task_destroy(fairlock_task_t *task) {
+    fl_task_entry_t *e;
+
+    pthread_mutex_lock(&fl_ids_mutex);
+    while (NULL != (e = task->entries)) {
+        task->entries = e->next;
+        if (fl_task_entry_alive(e))
+            fl_info_leave(e->lock, e->info);
+        free(e->info);
+        free(e);
+    }
+    pthread_mutex_unlock(&fl_ids_mutex);
+    task->hint = NULL;
+    pthread_mutex_destroy(&task->mutex);
+}
+
+// The task's entry for the lock, or NULL if it has none.
+static inline fl_task_entry_t *fl_task_find(fairlock_t *lock, fairlock_task_t *task) {
+    fl_task_entry_t *e = readvol(task->hint);
+
+    if (__builtin_expect(NULL != e && e->lock == lock && e->gen == lock->gen, 1))
+        return e;
+    for (e = __atomic_load_n(&task->entries, __ATOMIC_ACQUIRE); NULL != e; e = e->next) {
+        // entries of a destroyed lock that another one replaced stay behind
+        if (e->lock == lock && e->gen == lock->gen) {
+            task->hint = e;
+            return e;
         }
     }
+    return NULL;
+}
+
+// The task's accounting for the lock, created if it has none. NULL if out of memory.
+static inline flthread_info_t *fl_task_info(fairlock_t *lock, fairlock_task_t *task) {
+    fl_task_entry_t *e = fl_task_find(lock, task);
+    flthread_info_t *info = NULL;
+
+    if (__builtin_expect(NULL != e, 1))
+        return fl_info_refresh(lock, e->info);
+    pthread_mutex_lock(&task->mutex);
+    // another thread acting for the task may have got here first
+    if (NULL != (e = fl_task_find(lock, task)))
+        goto out;
+    if (NULL == (e = (fl_task_entry_t *) malloc(sizeof(fl_task_entry_t))) ||
+            0 != posix_memalign((void **) &info, CACHELINE, sizeof(flthread_info_t)))
+        goto lost;
+    memset(info, 0, sizeof(*info));
+    if (NULL == fl_info_join(lock, info, task->weight, SCL_STATS_TASK))
+        goto lost;
+    info->stats->tid = task->id;
+    e->lock = lock;
+    e->gen = lock->gen;
+    e->id = lock->id;
+    e->info = info;
+    e->next = task->entries;
+    __atomic_store_n(&task->entries, e, __ATOMIC_RELEASE);
+    task->hint = e;
+out:
+    pthread_mutex_unlock(&task->mutex);
+    return fl_info_refresh(lock, e->info);
+lost:
+    pthread_mutex_unlock(&task->mutex);
+    free(info);
+    free(e);
+    return NULL;
+}
+
+/*
+ * Make task the one the calling thread's acquisitions are charged to, or
+ * the thread itself if NULL. Returns the previous one. The thread must
+ * hold no lock acquired for the previous one.
+ */
+SCL_API fairlock_task_t *fairlock_task_switch(fairlock_task_t *task) {
+    fairlock_task_t *prev = fl_task_current;
+
+    fl_task_current = task;
+    return prev;
+}
+
+// Accounting for an acquisition by the calling thread, up to date.
+static inline flthread_info_t *fl_info(fairlock_t *lock) {
+    flthread_info_t *info;
+
+    if (__builtin_expect(NULL != fl_task_current, 0)) {
+        if (NULL == (info = fl_task_info(lock, fl_task_current)))
+            abort();
+        return info;
+    }
+    if (NULL == (info = flthread_info_lookup(lock)))
+        info = flthread_info_create(lock, 0);
+    return fl_info_refresh(lock, info);
+}
+
+// Accounting of the lock the calling thread holds.
+static inline flthread_info_t *fl_self(fairlock_t *lock) {
+    if (__builtin_expect(NULL != fl_task_current, 0))
+        return fl_task_find(lock, fl_task_current)->info;
+    return flthread_info_lookup(lock);
+}
+
+SCL_API void fairlock_acquire(fairlock_t *lock) {
+    flthread_info_t *info = fl_info(lock);
+    qnode_t *prev;
+
+    fl_trace(lock, FL_TRACE_ACQUIRE, 0);
+    if (fl_reenter(lock, info))
+        return;
+
+    if (info->banned)
+        fl_wait_ban(lock, info);
+
+    info->wait_start = scl_now();
+    qnode_t n = { 0 };
+    prev = fl_enqueue(lock, &n);
+    fl_trace(lock, FL_TRACE_ENQUEUE, 0);
+    fl_queue_wait(lock, info, &n, prev, FL_NO_DEADLINE);
+}
+
+/*
+ * Take the lock only if that needs no waiting: the caller owns the current
+ * slice, or the lock is idle with no slice in force and the caller is not
+ * banned. Returns 0 on success and EBUSY otherwise.
+ */
+SCL_API int fairlock_trylock(fairlock_t *lock) {
+    flthread_info_t *info = fl_info(lock);
+    ull now;
+
+    fl_trace(lock, FL_TRACE_ACQUIRE, 0);
+    if (fl_reenter(lock, info))
+        return 0;
+
+    now = scl_now();
+    if (info->banned && now < info->banned_until)
+        return EBUSY;
+    if (readvol(lock->slice_valid) && now < readvol(lock->slice))
+        return EBUSY;
+    if (NULL != readvol(lock->qtail))
+        return EBUSY;
+
+    // nobody can start a slice without queueing, so winning the empty tail
+    // means the lock is ours as soon as the stale slice is invalidated
+    qnode_t n = { 0 };
+    if (!__sync_bool_compare_and_swap(&lock->qtail, NULL, &n))
+        return EBUSY;
+    if (lock->adaptive)
+        __sync_fetch_and_add(&lock->nwaiters, 1);
+    n.state = RUNNABLE;
+    lock->qnext = &n;
+    info->wait_start = now;
+    fl_trace(lock, FL_TRACE_ENQUEUE, 0);
+    return fl_queue_wait(lock, info, &n, NULL, FL_NO_DEADLINE);
+}
+
+/*
+ * Acquire the lock, giving up at abstime (CLOCK_MONOTONIC). A thread whose
+ * ban outlasts the deadline fails at once. Returns 0 on success and
+ * ETIMEDOUT otherwise; a waiter that times out leaves the queue without
+ * holding up the waiters behind it.
+ */
+SCL_API int fairlock_timedlock(fairlock_t *lock, const struct timespec *abstime) {
+    flthread_info_t *info = fl_info(lock);
+    ull deadline;
+    qnode_t *n, *prev;
+    int rc;
+
+    fl_trace(lock, FL_TRACE_ACQUIRE, 0);
+    if (fl_reenter(lock, info))
+        return 0;
+
+    deadline = scl_monotonic_to_ticks(abstime);
+    if (info->banned) {
+        if (info->banned_until >= deadline)
+            return ETIMEDOUT;
+        fl_wait_ban(lock, info);
+    }
+
+    if (NULL == (n = fl_qnode_get()))
+        return ENOMEM;
+    info->wait_start = scl_now();
+    prev = fl_enqueue(lock, n);
+    fl_trace(lock, FL_TRACE_ENQUEUE, 0);
+    rc = fl_queue_wait(lock, info, n, prev, deadline);
+    if (0 == rc)
+        fl_qnode_put(n);
+    return rc;
 }
 
-void fairlock_release(fairlock_t *lock) {
-    ull now, cs;
+/*
+ * Release the lock held with the accounting info. With yield set the
+ * holder also gives up the rest of its slice, so the next waiter does not
+ * wait for it to expire.
+ */
+static void fl_unlock(fairlock_t *lock, flthread_info_t *info, int yield) {
+    ull now;
 #ifdef DEBUG
     ull succ_start = 0, succ_end = 0;
 #endif
-    flthread_info_t *info;
+
+    fl_trace(lock, FL_TRACE_RELEASE, 0);
+    // update the estimates before a successor can take the lock
+    if (lock->adaptive || SCL_WAIT_ADAPTIVE == lock->waiting.strategy) {
+        now = scl_now();
+        scl_wait_policy_hold(&lock->waiting, now - info->start_ticks);
+        if (lock->adaptive) {
+            lock->avg_cs = fl_ewma(lock->avg_cs, now - info->start_ticks);
+            lock->release_ticks = now;
+        }
+    }
 
     qnode_t *succ = lock->qnext;
     if (NULL == succ) {
         if (__sync_bool_compare_and_swap(&lock->qtail, flqnode(lock), NULL))
             goto accounting;
 #ifdef DEBUG
-        succ_start = rdtsc();
+        succ_start = scl_now();
 #endif
-        spin_then_yield(SPIN_LIMIT, NULL == (succ = readvol(lock->qnext)));
+        scl_wait_while(&lock->waiting, info->stats, NULL == (succ = readvol(lock->qnext)));
 #ifdef DEBUG
-        succ_end = rdtsc();
+        succ_end = scl_now();
 #endif
     }
-    succ->state = RUNNABLE;
+    if (__sync_bool_compare_and_swap(&succ->state, NEXT, RUNNABLE)) {
+        if (readvol(lock->parked)) {
+            futex(&succ->state, FUTEX_WAKE_PRIVATE, 1, NULL);
+            fl_notify(readvol(lock->head_fd));
+        }
+    } else {
+        fl_release_skip(lock, succ);
+    }
+    fl_trace(lock, FL_TRACE_RUNNABLE, 0);
 
 accounting:
     // invariant: NULL == succ || succ->state = RUNNABLE
-    info = (flthread_info_t *) pthread_getspecific(lock->flthread_info_key);
-    now = rdtsc();
-    cs = now - info->start_ticks;
-    info->banned_until += cs * (__atomic_load_n(&lock->total_weight, __ATOMIC_RELAXED) / info->weight);
-    info->banned = now < info->banned_until;
+    fl_account(lock, info, scl_now());
 
-    if (info->banned) {
+    if (info->banned || yield) {
         if (__sync_bool_compare_and_swap(&lock->slice_valid, 1, 0)) {
+            fl_trace(lock, FL_TRACE_SLICE_END, 0);
             futex(&lock->slice_valid, FUTEX_WAKE_PRIVATE, 1, NULL);
+            fl_wake_head(lock);
         }
     }
 #ifdef DEBUG
@@ -313,4 +1365,265 @@ accounting:
 #endif
 }
 
+static void fl_release(fairlock_t *lock, int yield) {
+    fl_unlock(lock, fl_self(lock), yield);
+}
+
+SCL_API void fairlock_release(fairlock_t *lock) {
+    fl_release(lock, 0);
+}
+
+/*
+ * Delegation: fairlock_execute() publishes a critical section in the
+ * caller's queue node, and whoever holds the lock runs the requests at the
+ * head of the queue before it releases, up to FAIRLOCK_EXECUTE_BATCH at a
+ * time and stopping at the first waiter that wants the lock itself. The
+ * data the critical sections touch stays in the holder's cache, and the
+ * submitters sleep instead of taking turns on the lock. Each request is
+ * charged to the thread that submitted it for the wall time it took, and
+ * the holder is not charged for it, so shares stay as they are.
+ *
+ * A request that no holder takes before the slice in force ends is taken
+ * back, and its submitter acquires the lock and runs it itself.
+ */
+
+/*
+ * Run the requests at the head of the queue. Called by the holder, which
+ * keeps the lock throughout. Returns the ticks spent on them.
+ */
+static ull fl_combine(fairlock_t *lock) {
+    ull spent = 0, start, now;
+    void (*fn)(void *);
+    qnode_t *n, *succ;
+
+    for (int i = 0; i < FAIRLOCK_EXECUTE_BATCH; i++) {
+        // the head of the queue is NEXT while the lock is held
+        if (NULL == (n = readvol(lock->qnext)) || NULL == (fn = readvol(n->fn)) ||
+                !__sync_bool_compare_and_swap(&n->fn, fn, NULL))
+            break;
+        if (lock->adaptive)
+            __sync_fetch_and_sub(&lock->nwaiters, 1);
+        start = scl_now();
+        fn(n->arg);
+        now = scl_now();
+        n->cs = now - start;
+        spent += n->cs;
+
+        // take n out of the queue before its submitter may reuse it
+        if (NULL == (succ = readvol(n->next))) {
+            lock->qnext = NULL;
+            if (!__sync_bool_compare_and_swap(&lock->qtail, n, flqnode(lock)))
+                scl_wait_while(&lock->waiting, NULL, NULL == (succ = readvol(n->next)));
+        }
+        if (NULL != succ) {
+            lock->qnext = succ;
+            while (succ && !fl_qnode_promote(succ, NEXT))
+                succ = fl_qnode_unlink(lock, succ, flqnode(lock));
+        }
+        __atomic_store_n(&n->state, DONE, __ATOMIC_SEQ_CST);
+        futex(&n->state, FUTEX_WAKE_PRIVATE, 1, NULL);
+        fl_wake_head(lock);
+        if (NULL == succ)
+            break;
+    }
+    return spent;
+}
+
+/*
+ * Wait until a holder has run n's request, or until the slice in force
+ * ends with n at the head of the queue, then take the request back and
+ * wait for the lock. Returns 1 if the request has been run and 0 with the
+ * lock held.
+ *
+ * At the head n sleeps on lock->head_seq rather than on its state or on
+ * slice_valid, as either may change: the holder that runs the request and
+ * the releaser that gives up its slice early both bump it while anyone is
+ * parked.
+ */
+static int fl_execute_wait(fairlock_t *lock, flthread_info_t *info, qnode_t *n, qnode_t *prev) {
+    void (*fn)(void *) = n->fn;
+    int state, seq, wait;
+    ull slice = 0;
+
+    while (DONE != (state = readvol(n->state))) {
+        if (INIT == state) {
+            scl_futex_wait_until(&n->state, INIT, SCL_NO_DEADLINE, &info->wait, 0);
+            continue;
+        }
+        seq = readvol(lock->head_seq);
+        __sync_fetch_and_add(&lock->parked, 1);
+        wait = DONE != readvol(n->state) && readvol(lock->slice_valid) &&
+            scl_now() < (slice = readvol(lock->slice));
+        if (wait)
+            scl_futex_wait_until(&lock->head_seq, seq, slice, &info->wait, 0);
+        __sync_fetch_and_sub(&lock->parked, 1);
+        if (wait || DONE == readvol(n->state))
+            continue;
+        if (__sync_bool_compare_and_swap(&n->fn, fn, NULL)) {
+            fl_queue_wait(lock, info, n, prev, FL_NO_DEADLINE);
+            return 0;
+        }
+        // a holder has just taken the request
+        while (DONE != (state = readvol(n->state)))
+            futex(&n->state, FUTEX_WAIT_PRIVATE, state, NULL);
+    }
+    return 1;
+}
+
+/*
+ * Run fn(arg) under the lock, or have the holder run it on the caller's
+ * behalf. fn must not block or take the lock again, and should be short:
+ * it runs on whichever thread holds the lock.
+ */
+SCL_API void fairlock_execute(fairlock_t *lock, void (*fn)(void *), void *arg) {
+    flthread_info_t *info = fl_info(lock);
+    qnode_t *prev;
+    ull spent, now;
+
+    fl_trace(lock, FL_TRACE_ACQUIRE, 0);
+    if (!fl_reenter(lock, info)) {
+        if (info->banned)
+            fl_wait_ban(lock, info);
+
+        info->wait_start = scl_now();
+        qnode_t n = { 0 };
+        n.fn = fn;
+        n.arg = arg;
+        prev = fl_enqueue(lock, &n);
+        fl_trace(lock, FL_TRACE_ENQUEUE, 0);
+        if (fl_execute_wait(lock, info, &n, prev)) {
+            now = scl_now();
+            scl_stats_wait(info->stats, now - info->wait_start - n.cs);
+            scl_stats_acquired(info->stats, now - n.cs, 0);
+            info->stats->c.delegated++;
+            scl_stats_released(info->stats, now);
+            fl_charge(lock, info, n.cs, now);
+            fl_trace(lock, FL_TRACE_DELEGATED, scl_ticks_to_ns(n.cs) / 1000);
+            return;
+        }
+    }
+
+    fn(arg);
+    // the holder's critical section does not include the others' requests
+    if (0 != (spent = fl_combine(lock))) {
+        info->start_ticks += spent;
+        info->stats->start += spent;
+        info->start_cpu += scl_ticks_to_ns(spent);
+    }
+    fl_release(lock, 0);
+}
+
+/*
+ * The lock functions on behalf of task rather than of the calling thread,
+ * see fairlock_task_t. Errors as for the plain functions. A release on
+ * behalf of a task also ends its slice: a task handed from thread to
+ * thread seldom comes back to the lock before the slice runs out, and
+ * until then the slice would keep everyone else off the lock. A task that
+ * does reacquire in a loop keeps its slices by being made the current one
+ * with fairlock_task_switch() instead.
+ */
+SCL_API void fairlock_acquire_as(fairlock_t *lock, fairlock_task_t *task) {
+    fairlock_task_t *prev = fairlock_task_switch(task);
+
+    fairlock_acquire(lock);
+    fairlock_task_switch(prev);
+}
+
+SCL_API int fairlock_trylock_as(fairlock_t *lock, fairlock_task_t *task) {
+    fairlock_task_t *prev = fairlock_task_switch(task);
+    int rc = fairlock_trylock(lock);
+
+    fairlock_task_switch(prev);
+    return rc;
+}
+
+SCL_API int fairlock_timedlock_as(fairlock_t *lock, fairlock_task_t *task, const struct timespec *abstime) {
+    fairlock_task_t *prev = fairlock_task_switch(task);
+    int rc = fairlock_timedlock(lock, abstime);
+
+    fairlock_task_switch(prev);
+    return rc;
+}
+
+SCL_API void fairlock_execute_as(fairlock_t *lock, fairlock_task_t *task, void (*fn)(void *), void *arg) {
+    fairlock_task_t *prev = fairlock_task_switch(task);
+
+    fairlock_execute(lock, fn, arg);
+    fairlock_task_switch(prev);
+}
+
+SCL_API void fairlock_release_as(fairlock_t *lock, fairlock_task_t *task) {
+    fl_unlock(lock, fl_task_find(lock, task)->info, 1);
+}
+
+/*
+ * Condition variable for a fairlock_t. Waiters keep a queue node parked on
+ * the condition; signal and broadcast move those nodes onto the lock queue,
+ * so woken waiters take the lock one at a time in queue order instead of
+ * all racing for it. The waiter list is protected by the lock itself:
+ * signal and broadcast must be called with the lock held.
+ */
+typedef struct fairlock_cond {
+    qnode_t *head;
+    qnode_t *tail;
+} fairlock_cond_t;
+
+SCL_API int fairlock_cond_init(fairlock_cond_t *cond) {
+    cond->head = NULL;
+    cond->tail = NULL;
+    return 0;
+}
+
+SCL_API int fairlock_cond_destroy(fairlock_cond_t *cond) {
+    return NULL == cond->head ? 0 : EBUSY;
+}
+
+/*
+ * Release the lock, wait for a signal and reacquire the lock. Only the
+ * critical section up to the wait is charged to the caller, and its slice
+ * ends at the wait so the next waiter on the lock can go at once. A ban
+ * still in force when the caller is signalled is not waited out, as the
+ * caller has already been off the lock for the whole wait.
+ */
+SCL_API int fairlock_cond_wait(fairlock_cond_t *cond, fairlock_t *lock) {
+    flthread_info_t *info = fl_self(lock);
+    qnode_t *n;
+
+    if (NULL == (n = fl_qnode_get()))
+        return ENOMEM;
+    if (NULL == cond->tail)
+        cond->head = n;
+    else
+        cond->tail->next = n;
+    cond->tail = n;
+
+    fl_release(lock, 1);
+    // time spent waiting for a signal is not lock wait
+    info->wait_start = 0;
+    // sleeps in the INIT wait until a signal moves n onto the lock queue
+    fl_queue_wait(lock, info, n, flqnode(lock), FL_NO_DEADLINE);
+    fl_qnode_put(n);
+    return 0;
+}
+
+// Move the first waiter on the condition to the lock queue.
+SCL_API void fairlock_cond_signal(fairlock_cond_t *cond, fairlock_t *lock) {
+    qnode_t *n = cond->head, *prev;
+
+    if (NULL == n)
+        return;
+    if (NULL == (cond->head = n->next))
+        cond->tail = NULL;
+    n->next = NULL;
+    prev = fl_enqueue(lock, n);
+    // otherwise n is woken when its predecessor makes it NEXT
+    if (NULL == prev || flqnode(lock) == prev)
+        futex(&n->state, FUTEX_WAKE_PRIVATE, 1, NULL);
+}
+
+SCL_API void fairlock_cond_broadcast(fairlock_cond_t *cond, fairlock_t *lock) {
+    while (NULL != cond->head)
+        fairlock_cond_signal(cond, lock);
+}
+
 #endif // __FAIRLOCK_H__
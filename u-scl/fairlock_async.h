@@ -0,0 +1,217 @@
+#ifndef __FAIRLOCK_ASYNC_H__
+#define __FAIRLOCK_ASYNC_H__
+
+/*
+ * Asynchronous u-SCL acquisition, for event loops that run many logical
+ * tasks on one thread and must not block it on a lock.
+ *
+ * fairlock_async_start() prepares an acquisition on behalf of a task (see
+ * fairlock_task_t), and fairlock_async_poll() advances it as far as it can
+ * without blocking: it returns 0 once the task holds the lock, and EAGAIN
+ * while it has to wait. A waiting acquisition needs polling again when the
+ * eventfd given to fairlock_async_start() becomes readable, or at the
+ * latest after fairlock_async_timeout_ns(). The eventfd is signalled by
+ * whoever moves the acquisition on: the holder that makes its queue node
+ * NEXT or RUNNABLE, and the releaser that ends a slice early. A ban, or a
+ * slice that runs out on its own, is waited out by the timeout alone.
+ *
+ * One eventfd can serve every acquisition of a loop; being a counter, it
+ * loses no signal between polls. The loop can read it directly, watch it
+ * with epoll, or submit a poll or read for it to an io_uring. The lock
+ * forgets the eventfd when the acquisition completes or is cancelled, but
+ * a thread releasing or promoting on the lock that read it just before
+ * can still signal it once afterwards. So close it only after the
+ * acquisitions given it have completed or been cancelled and no other
+ * thread can still be in the middle of releasing or acquiring those
+ * locks, for instance once the other users of the locks have been joined
+ * or the locks destroyed; otherwise the signal can reach whatever file
+ * reuses the descriptor.
+ *
+ * Usage is charged to the task rather than to the loop thread, so tasks
+ * that share a thread get shares by their own weights. The queue node of
+ * an acquisition comes from the node cache of the thread that started it.
+ */
+
+#include "fairlock.h"
+
+enum fl_async_phase {
+    FL_ASYNC_BANNED = 0, // waiting out the task's ban, not queued yet
+    FL_ASYNC_QUEUED, // in the queue behind the next runnable node
+    FL_ASYNC_HEAD, // NEXT, waiting for the slice to end and to become RUNNABLE
+    FL_ASYNC_HELD,
+};
+
+typedef struct fairlock_async {
+    fairlock_t *lock;
+    flthread_info_t *info; // the task's accounting for lock
+    qnode_t *n;
+    qnode_t *prev;
+    ull deadline; // poll again by then at the latest
+    ull ban_start; // when a ban first held the acquisition up, 0 if none has
+    int wake_fd; // plus one, as in qnode_t
+    int phase; // enum fl_async_phase
+    int parked; // counted in lock->parked
+} fairlock_async_t;
+
+/*
+ * Prepare req to acquire lock for task, signalling wake_fd, an eventfd,
+ * when it has to be polled. Returns 0 or ENOMEM.
+ */
+SCL_API int fairlock_async_start(fairlock_async_t *req, fairlock_t *lock, fairlock_task_t *task, int wake_fd) {
+    if (NULL == (req->info = fl_task_info(lock, task)))
+        return ENOMEM;
+    req->lock = lock;
+    req->n = NULL;
+    req->prev = NULL;
+    req->deadline = 0;
+    req->ban_start = 0;
+    req->wake_fd = wake_fd + 1;
+    req->phase = FL_ASYNC_BANNED;
+    req->parked = 0;
+    fl_trace(lock, FL_TRACE_ACQUIRE, 0);
+    return 0;
+}
+
+static inline void fl_async_unpark(fairlock_async_t *req) {
+    if (req->parked) {
+        __sync_fetch_and_sub(&req->lock->parked, 1);
+        req->parked = 0;
+    }
+}
+
+/*
+ * The head-of-queue part of fl_queue_wait(): wait for the slice in force
+ * to end and for n to become RUNNABLE. Returns 1 with n RUNNING. Otherwise
+ * counts the request in lock->parked with its eventfd as the head's, so
+ * that fl_release() and fl_wake_head() signal it, and returns 0.
+ */
+static int fl_async_head(fairlock_async_t *req) {
+    fairlock_t *lock = req->lock;
+    qnode_t *n = req->n;
+    ull slice;
+
+    while (1) {
+        if (readvol(lock->slice_valid) && scl_now() < (slice = readvol(lock->slice))) {
+            req->deadline = slice;
+        } else {
+            if (readvol(lock->slice_valid))
+                lock->slice_valid = 0;
+            if (__sync_bool_compare_and_swap(&n->state, RUNNABLE, RUNNING)) {
+                fl_async_unpark(req);
+                lock->head_fd = 0;
+                return 1;
+            }
+            req->deadline = FL_NO_DEADLINE;
+        }
+        if (req->parked)
+            return 0;
+        // look again once counted, in case the change came in between
+        lock->head_fd = req->wake_fd;
+        __sync_fetch_and_add(&lock->parked, 1);
+        req->parked = 1;
+    }
+}
+
+/*
+ * Advance the acquisition without blocking. Returns 0 once the task holds
+ * the lock, EAGAIN while it has to wait, or ENOMEM.
+ */
+SCL_API int fairlock_async_poll(fairlock_async_t *req) {
+    fairlock_t *lock = req->lock;
+    flthread_info_t *info = req->info;
+    ull now;
+
+    fl_async_unpark(req);
+    switch (req->phase) {
+    case FL_ASYNC_BANNED:
+        if (fl_reenter(lock, info))
+            break;
+        now = scl_now();
+        if (info->banned && now < info->banned_until) {
+            if (0 == req->ban_start) {
+                req->ban_start = now;
+                fl_trace(lock, FL_TRACE_BAN_START, scl_ticks_to_ns(info->banned_until - now) / 1000);
+            }
+            req->deadline = info->banned_until;
+            return EAGAIN;
+        }
+        if (0 != req->ban_start) {
+            info->stats->c.ban += now - req->ban_start;
+            fl_trace(lock, FL_TRACE_BAN_END, 0);
+        }
+        if (NULL == (req->n = fl_qnode_get()))
+            return ENOMEM;
+        req->n->wake_fd = req->wake_fd;
+        info->wait_start = now;
+        req->prev = fl_enqueue(lock, req->n);
+        fl_trace(lock, FL_TRACE_ENQUEUE, 0);
+        req->phase = FL_ASYNC_QUEUED;
+        // fall through
+    case FL_ASYNC_QUEUED:
+        if (INIT == readvol(req->n->state)) {
+            req->deadline = FL_NO_DEADLINE;
+            return EAGAIN;
+        }
+        fl_trace(lock, FL_TRACE_NEXT, 0);
+        req->phase = FL_ASYNC_HEAD;
+        // fall through
+    case FL_ASYNC_HEAD:
+        if (!fl_async_head(req))
+            return EAGAIN;
+        fl_start_slice(lock, info, req->n, req->prev);
+        fl_qnode_put(req->n);
+        req->n = NULL;
+        break;
+    default:
+        return 0;
+    }
+    req->phase = FL_ASYNC_HELD;
+    return 0;
+}
+
+/*
+ * Nanoseconds until the acquisition has to be polled again even if its
+ * eventfd stays quiet, or -1 if it only has to be polled on a signal.
+ */
+SCL_API long long fairlock_async_timeout_ns(const fairlock_async_t *req) {
+    ull now;
+
+    if (FL_ASYNC_HELD == req->phase || FL_NO_DEADLINE == req->deadline)
+        return FL_ASYNC_HELD == req->phase ? 0 : -1;
+    now = scl_now();
+    return req->deadline > now ? (long long) scl_ticks_to_ns(req->deadline - now) : 0;
+}
+
+/*
+ * Give up an acquisition that has not completed; one that has completed is
+ * released. A node that leaves the queue this way belongs to whoever would
+ * have promoted it, as with fairlock_timedlock().
+ */
+SCL_API void fairlock_async_cancel(fairlock_async_t *req) {
+    fl_async_unpark(req);
+    switch (req->phase) {
+    case FL_ASYNC_HEAD:
+        // the head parked its eventfd on the lock; the next head sets its own
+        __sync_bool_compare_and_swap(&req->lock->head_fd, req->wake_fd, 0);
+        // fall through
+    case FL_ASYNC_QUEUED:
+        // nobody but the request itself moves its node to RUNNING
+        fl_abandon(req->lock, req->n);
+        req->n = NULL;
+        break;
+    case FL_ASYNC_HELD:
+        fl_unlock(req->lock, req->info, 0);
+        break;
+    }
+    req->phase = FL_ASYNC_BANNED;
+    req->ban_start = 0;
+}
+
+// Release the lock acquired through req, charging the task for it.
+SCL_API void fairlock_async_release(fairlock_async_t *req) {
+    fl_unlock(req->lock, req->info, 0);
+    req->phase = FL_ASYNC_BANNED;
+    req->ban_start = 0;
+}
+
+#endif // __FAIRLOCK_ASYNC_H__
@@ -0,0 +1,187 @@
+#ifndef __FAIRLOCK_COHORT_H__
+#define __FAIRLOCK_COHORT_H__
+
+/*
+ * NUMA-aware cohort u-SCL.
+ *
+ * Every NUMA node has its own fairlock_t, and a global lock decides which
+ * node runs. A thread takes the local lock of the node it runs on and then,
+ * unless the previous local holder passed it along, the global lock. On
+ * release the global lock stays with the node while local threads are
+ * queued, for at most max_handoffs handoffs in a row; after that, or when
+ * the local queue is empty, it goes to the next node that waits for it,
+ * round robin.
+ *
+ * Slices are per node. Bans span all nodes: every local lock charges
+ * against the cohort's total_weight, and a thread that moves to another
+ * node takes its weight and its ban along.
+ */
+
+#include "fairlock.h"
+#include <limits.h>
+#include "../common/topology.h"
+
+typedef struct fairlock_cohort_node {
+    fairlock_t local;
+    // only touched by the holder of local
+    int owns_global __attribute__ ((aligned (CACHELINE)));
+    int handoffs;
+    int waiting __attribute__ ((aligned (CACHELINE)));
+} fairlock_cohort_node_t __attribute__ ((aligned (CACHELINE)));
+
+typedef struct fairlock_cohort {
+    int global __attribute__ ((aligned (CACHELINE))); // 1 + node holding it, 0 if free
+    int nnodes;
+    int max_handoffs;
+    ull total_weight __attribute__ ((aligned (CACHELINE)));
+    fairlock_cohort_node_t *nodes;
+} fairlock_cohort_t __attribute__ ((aligned (CACHELINE)));
+
+/*
+ * Initialize the cohort with one local lock per NUMA node. max_handoffs
+ * bounds consecutive handoffs within a node; 0 picks
+ * FAIRLOCK_COHORT_HANDOFFS.
+ */
+SCL_API int fairlock_cohort_init(fairlock_cohort_t *lock, int max_handoffs) {
+    int i, rc;
+
+    scl_topology_init();
+    lock->global = 0;
+    lock->nnodes = scl_topology.nnodes;
+    lock->max_handoffs = max_handoffs ? max_handoffs : FAIRLOCK_COHORT_HANDOFFS;
+    lock->total_weight = 0;
+    if (0 != posix_memalign((void **) &lock->nodes, CACHELINE, lock->nnodes * sizeof(fairlock_cohort_node_t)))
+        return ENOMEM;
+    for (i = 0; i < lock->nnodes; i++) {
+        fairlock_cohort_node_t *node = &lock->nodes[i];
+        if (0 != (rc = fairlock_init(&node->local))) {
+            while (i-- > 0)
+                fairlock_destroy(&lock->nodes[i].local);
+            free(lock->nodes);
+            return rc;
+        }
+        node->local.weights = &lock->total_weight;
+        node->owns_global = 0;
+        node->handoffs = 0;
+        node->waiting = 0;
+    }
+    return 0;
+}
+
+SCL_API int fairlock_cohort_destroy(fairlock_cohort_t *lock) {
+    for (int i = 0; i < lock->nnodes; i++)
+        fairlock_destroy(&lock->nodes[i].local);
+    free(lock->nodes);
+    return 0;
+}
+
+/*
+ * Make the local lock of node the one that carries the calling thread's
+ * accounting. If the thread last used another node, its weight moves out
+ * of that node's lock and its ban comes along.
+ */
+static void fl_cohort_migrate(fairlock_cohort_t *lock, int node) {
+    fairlock_t *local = &lock->nodes[node].local;
+    flthread_info_t *info = flthread_info_lookup(local), *old = NULL;
+    fairlock_t *from = NULL;
+
+    if (NULL != info && readvol(info->active))
+        return;
+    for (int i = 0; i < lock->nnodes && NULL == old; i++) {
+        if (i == node)
+            continue;
+        from = &lock->nodes[i].local;
+        old = flthread_info_lookup(from);
+        if (NULL != old && !readvol(old->active))
+            old = NULL;
+    }
+    if (NULL == old)
+        return;
+    fl_members_lock(from);
+    fl_deactivate(from, old);
+    fl_members_unlock(from);
+    fairlock_set_weight(local, old->weight);
+    info = flthread_info_lookup(local);
+    if (info->banned_until < old->banned_until)
+        info->banned_until = old->banned_until;
+    info->banned = old->banned;
+}
+
+static inline int fl_cohort_node(fairlock_cohort_t *lock) {
+    int node = scl_current_node();
+    return node < lock->nnodes ? node : 0;
+}
+
+/*
+ * Set the calling thread's weight (0 derives it, see common/weight.h). The
+ * weight follows the thread to whatever node it runs on.
+ */
+SCL_API void fairlock_cohort_thread_init(fairlock_cohort_t *lock, int weight) {
+    int node = fl_cohort_node(lock);
+
+    fl_cohort_migrate(lock, node);
+    fairlock_set_weight(&lock->nodes[node].local, weight);
+}
+
+static void fl_cohort_global_acquire(fairlock_cohort_t *lock, int node) {
+    int g;
+
+    lock->nodes[node].waiting = 1;
+    __sync_synchronize();
+    while (1) {
+        g = readvol(lock->global);
+        // the previous holder may have passed it to us
+        if (g == node + 1)
+            break;
+        if (0 == g && __sync_bool_compare_and_swap(&lock->global, 0, node + 1))
+            break;
+        futex(&lock->global, FUTEX_WAIT_PRIVATE, g, NULL);
+    }
+    lock->nodes[node].waiting = 0;
+}
+
+// Pass the global lock to the next waiting node after node, or free it.
+static void fl_cohort_global_release(fairlock_cohort_t *lock, int node) {
+    int next = 0;
+
+    for (int i = 1; i < lock->nnodes; i++) {
+        int n = (node + i) % lock->nnodes;
+        if (readvol(lock->nodes[n].waiting)) {
+            next = n + 1;
+            break;
+        }
+    }
+    lock->global = next;
+    futex(&lock->global, FUTEX_WAKE_PRIVATE, INT_MAX, NULL);
+}
+
+SCL_API void fairlock_cohort_acquire(fairlock_cohort_t *lock) {
+    int node = fl_cohort_node(lock);
+    fairlock_cohort_node_t *n = &lock->nodes[node];
+
+    fl_cohort_migrate(lock, node);
+    fairlock_acquire(&n->local);
+    if (!n->owns_global) {
+        fl_cohort_global_acquire(lock, node);
+        n->owns_global = 1;
+        n->handoffs = 0;
+    }
+}
+
+SCL_API void fairlock_cohort_release(fairlock_cohort_t *lock) {
+    // the holder may have moved since it acquired, but the node holding the
+    // global lock is the one whose local lock it holds
+    int node = readvol(lock->global) - 1;
+    fairlock_cohort_node_t *n = &lock->nodes[node];
+
+    // waiters queued behind us on the local lock inherit the global lock
+    if (flqnode(&n->local) != readvol(n->local.qtail) && n->handoffs < lock->max_handoffs) {
+        n->handoffs++;
+    } else {
+        n->owns_global = 0;
+        fl_cohort_global_release(lock, node);
+    }
+    fairlock_release(&n->local);
+}
+
+#endif // __FAIRLOCK_COHORT_H__
@@ -0,0 +1,476 @@
+#ifndef __FAIRLOCK_SHM_H__
+#define __FAIRLOCK_SHM_H__
+
+/*
+ * Process-shared u-SCL.
+ *
+ * fairlock_shm_t lives in memory mapped by every participating process
+ * (MAP_SHARED, shm_open, ...), together with a fixed array of participant
+ * slots. A slot holds one thread's accounting and doubles as its queue node;
+ * queue links are slot indices, so the segment may be mapped at a different
+ * address in every process. Slices and bans work as in fairlock_t: the slice
+ * owner reenters at will, every other thread waits for the slice to expire
+ * and is banned for cs * total_weight / weight after each critical section.
+ *
+ * Lock state is updated under a short robust, process-shared mutex, and
+ * waiters sleep on a futex in their own slot. A participant is identified by
+ * its pid, tid and start time. Waiters look for dead participants every
+ * FAIRLOCK_SHM_CHECK: a dead waiter is taken out of the queue, a dead holder
+ * loses the lock and the next acquirer gets EOWNERDEAD, like a robust
+ * pthread mutex, and either way its weight leaves total_weight.
+ *
+ * Times are ticks of scl_now(), so every participant has to be built with
+ * the same clock source (all TSC, or all -DSCL_CLOCK_MONOTONIC).
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include "fairlock.h"
+
+#define FL_SHM_NONE (-1)
+
+typedef struct fairlock_shm_slot {
+    int wake __attribute__ ((aligned (CACHELINE))); // futex word, bumped to wake the waiter
+    int in_use;
+    int queued;
+    int next; // next queued slot
+    pid_t pid;
+    pid_t tid;
+    ull start_time; // of the task, tells a recycled tid from the participant
+    ull weight;
+    ull banned_until;
+    ull start_ticks;
+    int banned;
+} fairlock_shm_slot_t __attribute__ ((aligned (CACHELINE)));
+
+typedef struct fairlock_shm {
+    pthread_mutex_t guard;
+    int nslots;
+    int holder; // slot holding the lock
+    int head;
+    int tail;
+    int slice_owner;
+    int slice_valid;
+    int owner_died;
+    ull slice;
+    ull slice_len;
+    ull total_weight;
+    ull next_check;
+    fairlock_shm_slot_t slots[];
+} fairlock_shm_t __attribute__ ((aligned (CACHELINE)));
+
+/*
+ * The slot of the calling thread for each shared lock it has joined. Only
+ * the forking thread survives a fork, and its entries belong to the parent,
+ * so the child starts with an empty map.
+ */
+typedef struct flshm_map {
+    fairlock_shm_t *lock;
+    int slot;
+} flshm_map_t;
+
+SCL_SHARED_TLS flshm_map_t *fl_shm_map;
+SCL_SHARED_TLS int fl_shm_nmap;
+SCL_SHARED_TLS int fl_shm_map_cap;
+SCL_SHARED pthread_once_t fl_shm_atfork_once = PTHREAD_ONCE_INIT;
+
+static void fl_shm_atfork_child(void) {
+    free(fl_shm_map);
+    fl_shm_map = NULL;
+    fl_shm_nmap = 0;
+    fl_shm_map_cap = 0;
+}
+
+static void fl_shm_atfork_register(void) {
+    pthread_atfork(NULL, NULL, fl_shm_atfork_child);
+}
+
+static inline int fl_shm_self(fairlock_shm_t *lock) {
+    for (int i = 0; i < fl_shm_nmap; i++) {
+        if (fl_shm_map[i].lock == lock)
+            return fl_shm_map[i].slot;
+    }
+    return FL_SHM_NONE;
+}
+
+static int fl_shm_map_add(fairlock_shm_t *lock, int slot) {
+    pthread_once(&fl_shm_atfork_once, fl_shm_atfork_register);
+    if (fl_shm_nmap == fl_shm_map_cap) {
+        int cap = fl_shm_map_cap ? fl_shm_map_cap * 2 : 4;
+        flshm_map_t *map = (flshm_map_t *) realloc(fl_shm_map, cap * sizeof(flshm_map_t));
+        if (NULL == map)
+            return ENOMEM;
+        fl_shm_map = map;
+        fl_shm_map_cap = cap;
+    }
+    fl_shm_map[fl_shm_nmap].lock = lock;
+    fl_shm_map[fl_shm_nmap].slot = slot;
+    fl_shm_nmap++;
+    return 0;
+}
+
+static void fl_shm_map_del(fairlock_shm_t *lock) {
+    for (int i = 0; i < fl_shm_nmap; i++) {
+        if (fl_shm_map[i].lock == lock) {
+            fl_shm_map[i] = fl_shm_map[--fl_shm_nmap];
+            return;
+        }
+    }
+}
+
+/*
+ * Start time of a task in clock ticks since boot (field 22 of its stat
+ * file), or 0 if the task does not exist or has exited.
+ */
+static ull fl_shm_task_start(pid_t pid, pid_t tid) {
+    char path[64], buf[512], *p;
+    int fd, n, i;
+
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/stat", pid, tid);
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return 0;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return 0;
+    buf[n] = 0;
+    // the command name may contain spaces and parentheses
+    if (NULL == (p = strrchr(buf, ')')) || ' ' != p[1])
+        return 0;
+    if ('Z' == p[2] || 'X' == p[2])
+        return 0;
+    for (i = 0; i < 20 && NULL != p; i++)
+        p = strchr(p + 1, ' ');
+    return NULL == p ? 0 : strtoull(p + 1, NULL, 10);
+}
+
+static int fl_shm_alive(fairlock_shm_slot_t *slot) {
+    // without a start time, fall back to a check that misses tid reuse
+    if (0 == slot->start_time)
+        return 0 == syscall(SYS_tgkill, slot->pid, slot->tid, 0) || EPERM == errno;
+    return slot->start_time == fl_shm_task_start(slot->pid, slot->tid);
+}
+
+static void fl_shm_wake(fairlock_shm_t *lock, int slot) {
+    __sync_fetch_and_add(&lock->slots[slot].wake, 1);
+    futex(&lock->slots[slot].wake, FUTEX_WAKE, 1, NULL);
+}
+
+static void fl_shm_append(fairlock_shm_t *lock, int slot) {
+    lock->slots[slot].next = FL_SHM_NONE;
+    lock->slots[slot].queued = 1;
+    if (FL_SHM_NONE == lock->tail)
+        lock->head = slot;
+    else
+        lock->slots[lock->tail].next = slot;
+    lock->tail = slot;
+}
+
+/*
+ * Reap dead participants and rebuild the queue and total_weight from the
+ * live ones. Needs the guard. Also repairs whatever a participant that died
+ * inside the guard left half done; a waiter that dropped off the queue that
+ * way goes back to its tail.
+ */
+static void fl_shm_recover(fairlock_shm_t *lock) {
+    int i, n, steps;
+    ull total = 0;
+
+    for (i = 0; i < lock->nslots; i++) {
+        fairlock_shm_slot_t *slot = &lock->slots[i];
+        if (!slot->in_use)
+            continue;
+        if (fl_shm_alive(slot)) {
+            total += slot->weight;
+            continue;
+        }
+        if (lock->holder == i) {
+            lock->holder = FL_SHM_NONE;
+            lock->owner_died = 1;
+        }
+        if (lock->slice_owner == i)
+            lock->slice_valid = 0;
+        slot->in_use = 0;
+    }
+
+    // queued: 1 until relinked, 2 once relinked
+    n = lock->head;
+    lock->head = lock->tail = FL_SHM_NONE;
+    for (steps = 0; FL_SHM_NONE != n && steps < lock->nslots; steps++) {
+        int next = lock->slots[n].next;
+        if (lock->slots[n].in_use && 1 == lock->slots[n].queued) {
+            fl_shm_append(lock, n);
+            lock->slots[n].queued = 2;
+        }
+        n = next;
+    }
+    for (i = 0; i < lock->nslots; i++) {
+        fairlock_shm_slot_t *slot = &lock->slots[i];
+        if (slot->in_use && 1 == slot->queued)
+            fl_shm_append(lock, i);
+        else if (!slot->in_use)
+            slot->queued = 0;
+        if (slot->queued)
+            slot->queued = 1;
+    }
+
+    lock->total_weight = total;
+    lock->next_check = scl_now() + FAIRLOCK_SHM_CHECK;
+    // the head may be able to go now
+    if (FL_SHM_NONE != lock->head)
+        fl_shm_wake(lock, lock->head);
+}
+
+static void fl_shm_guard(fairlock_shm_t *lock) {
+    if (EOWNERDEAD == pthread_mutex_lock(&lock->guard)) {
+        pthread_mutex_consistent(&lock->guard);
+        fl_shm_recover(lock);
+    }
+}
+
+static inline void fl_shm_unguard(fairlock_shm_t *lock) {
+    pthread_mutex_unlock(&lock->guard);
+}
+
+SCL_API size_t fairlock_shm_size(int nslots) {
+    return sizeof(fairlock_shm_t) + nslots * sizeof(fairlock_shm_slot_t);
+}
+
+/*
+ * Initialize a lock for up to nslots participating threads in
+ * fairlock_shm_size(nslots) bytes of shared memory. Call once, before any
+ * other process uses the memory.
+ */
+SCL_API int fairlock_shm_init(fairlock_shm_t *lock, int nslots) {
+    pthread_mutexattr_t attr;
+    int rc;
+
+    scl_clock_init();
+    scl_wait_init();
+    if (nslots <= 0)
+        return EINVAL;
+    memset(lock, 0, fairlock_shm_size(nslots));
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    rc = pthread_mutex_init(&lock->guard, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (0 != rc)
+        return rc;
+    lock->nslots = nslots;
+    lock->holder = FL_SHM_NONE;
+    lock->head = FL_SHM_NONE;
+    lock->tail = FL_SHM_NONE;
+    lock->slice_owner = FL_SHM_NONE;
+    lock->slice_len = FAIRLOCK_GRANULARITY;
+    lock->next_check = scl_now() + FAIRLOCK_SHM_CHECK;
+    return 0;
+}
+
+SCL_API int fairlock_shm_destroy(fairlock_shm_t *lock) {
+    return pthread_mutex_destroy(&lock->guard);
+}
+
+/*
+ * Join the lock from the calling thread with the given weight (0 derives
+ * it once from the scheduling parameters, see common/weight.h), or change the weight of a thread that already
+ * joined. Returns EAGAIN if every slot belongs to a live participant.
+ */
+SCL_API int fairlock_shm_thread_init(fairlock_shm_t *lock, int weight) {
+    int s = fl_shm_self(lock), i;
+
+    scl_clock_init();
+    scl_wait_init();
+    if (weight == 0)
+        weight = scl_thread_weight();
+    fl_shm_guard(lock);
+    if (FL_SHM_NONE != s) {
+        lock->total_weight += (ull) weight - lock->slots[s].weight;
+        lock->slots[s].weight = weight;
+        fl_shm_unguard(lock);
+        return 0;
+    }
+    for (int pass = 0; pass < 2 && FL_SHM_NONE == s; pass++) {
+        // on the second pass, make room by reaping dead participants
+        if (pass)
+            fl_shm_recover(lock);
+        for (i = 0; i < lock->nslots; i++) {
+            if (!lock->slots[i].in_use) {
+                s = i;
+                break;
+            }
+        }
+    }
+    if (FL_SHM_NONE == s || 0 != fl_shm_map_add(lock, s)) {
+        fl_shm_unguard(lock);
+        return FL_SHM_NONE == s ? EAGAIN : ENOMEM;
+    }
+    fairlock_shm_slot_t *me = &lock->slots[s];
+    me->pid = getpid();
+    me->tid = syscall(SYS_gettid);
+    me->start_time = fl_shm_task_start(me->pid, me->tid);
+    me->weight = weight;
+    me->banned_until = scl_now();
+    me->banned = 0;
+    me->queued = 0;
+    me->next = FL_SHM_NONE;
+    me->in_use = 1;
+    lock->total_weight += weight;
+    fl_shm_unguard(lock);
+    return 0;
+}
+
+// Leave the lock; the calling thread must not hold it.
+SCL_API void fairlock_shm_thread_exit(fairlock_shm_t *lock) {
+    int s = fl_shm_self(lock);
+
+    if (FL_SHM_NONE == s)
+        return;
+    fl_shm_guard(lock);
+    if (lock->slots[s].in_use) {
+        lock->slots[s].in_use = 0;
+        lock->total_weight -= lock->slots[s].weight;
+    }
+    if (lock->slice_owner == s)
+        lock->slice_valid = 0;
+    fl_shm_unguard(lock);
+    fl_shm_map_del(lock);
+}
+
+// Take s out of the queue. Needs the guard.
+static void fl_shm_unlink(fairlock_shm_t *lock, int s) {
+    int prev = FL_SHM_NONE, n = lock->head;
+
+    while (FL_SHM_NONE != n && n != s) {
+        prev = n;
+        n = lock->slots[n].next;
+    }
+    lock->slots[s].queued = 0;
+    if (FL_SHM_NONE == n)
+        return;
+    if (FL_SHM_NONE == prev) {
+        lock->head = lock->slots[s].next;
+        // let the new head time its wait to the end of the current slice
+        if (FL_SHM_NONE != lock->head)
+            fl_shm_wake(lock, lock->head);
+    } else {
+        lock->slots[prev].next = lock->slots[s].next;
+    }
+    if (lock->tail == s)
+        lock->tail = prev;
+}
+
+// Needs the guard.
+static inline int fl_shm_can_take(fairlock_shm_t *lock, int s, ull now) {
+    if (FL_SHM_NONE != lock->holder)
+        return 0;
+    if (lock->slice_valid && now < lock->slice)
+        return lock->slice_owner == s;
+    return FL_SHM_NONE == lock->head || lock->head == s;
+}
+
+// Needs the guard.
+static int fl_shm_take(fairlock_shm_t *lock, int s, ull now) {
+    fairlock_shm_slot_t *me = &lock->slots[s];
+    int rc = 0;
+
+    lock->holder = s;
+    if (!(lock->slice_valid && lock->slice_owner == s && now < lock->slice)) {
+        lock->slice_owner = s;
+        lock->slice = now + lock->slice_len;
+        lock->slice_valid = 1;
+    }
+    me->start_ticks = now;
+    if (me->queued)
+        fl_shm_unlink(lock, s);
+    if (lock->owner_died) {
+        lock->owner_died = 0;
+        rc = EOWNERDEAD;
+    }
+    return rc;
+}
+
+/*
+ * Acquire the lock, joining it with the default weight first if needed.
+ * Returns 0, or EOWNERDEAD if the previous holder died while holding it (the
+ * lock is held either way), or EAGAIN if the thread could not join.
+ */
+SCL_API int fairlock_shm_acquire(fairlock_shm_t *lock) {
+    int s = fl_shm_self(lock), rc;
+    fairlock_shm_slot_t *me;
+    ull now;
+
+    if (FL_SHM_NONE == s) {
+        if (0 != (rc = fairlock_shm_thread_init(lock, 0)))
+            return rc;
+        s = fl_shm_self(lock);
+    }
+    me = &lock->slots[s];
+
+    fl_shm_guard(lock);
+    // the slice owner reenters without waiting
+    now = scl_now();
+    if (lock->slice_valid && lock->slice_owner == s && fl_shm_can_take(lock, s, now)) {
+        rc = fl_shm_take(lock, s, now);
+        fl_shm_unguard(lock);
+        return rc;
+    }
+    if (me->banned) {
+        fl_shm_unguard(lock);
+        scl_wait_until(me->banned_until, NULL);
+        fl_shm_guard(lock);
+    }
+
+    while (1) {
+        int wake;
+        ull until;
+
+        now = scl_now();
+        if (fl_shm_can_take(lock, s, now)) {
+            rc = fl_shm_take(lock, s, now);
+            fl_shm_unguard(lock);
+            return rc;
+        }
+        if (!me->queued)
+            fl_shm_append(lock, s);
+        if (now >= lock->next_check) {
+            fl_shm_recover(lock);
+            continue;
+        }
+        until = lock->next_check;
+        // the head waits for the end of the current slice
+        if (lock->head == s && lock->slice_valid && lock->slice > now && lock->slice < until)
+            until = lock->slice;
+        wake = me->wake;
+        fl_shm_unguard(lock);
+        scl_futex_wait_until(&me->wake, wake, until, NULL, 1);
+        fl_shm_guard(lock);
+    }
+}
+
+SCL_API void fairlock_shm_release(fairlock_shm_t *lock) {
+    int s = fl_shm_self(lock), head;
+    fairlock_shm_slot_t *me = &lock->slots[s];
+    ull now, cs;
+
+    fl_shm_guard(lock);
+    now = scl_now();
+    cs = now - me->start_ticks;
+    me->banned_until += cs * (lock->total_weight / me->weight);
+    me->banned = now < me->banned_until;
+    lock->holder = FL_SHM_NONE;
+    if (me->banned && lock->slice_owner == s)
+        lock->slice_valid = 0;
+    // participants that exited without fairlock_shm_thread_exit() still
+    // count towards total_weight until they are reaped
+    if (now >= lock->next_check)
+        fl_shm_recover(lock);
+    // wake the head only if it can take the lock now; otherwise it wakes
+    // up by itself when the slice ends
+    head = lock->head;
+    if (FL_SHM_NONE != head && (!lock->slice_valid || now >= lock->slice))
+        fl_shm_wake(lock, head);
+    fl_shm_unguard(lock);
+}
+
+#endif // __FAIRLOCK_SHM_H__
@@ -0,0 +1,172 @@
+#ifndef __FAIRLOCK_TABLE_H__
+#define __FAIRLOCK_TABLE_H__
+
+/*
+ * Lock table u-SCL: many fine-grained bucket locks, one per hash bucket or
+ * stripe, sharing one proportional-share accounting domain.
+ *
+ * A bucket is a single futex word, the size of a pthread_spinlock_t: 0 if
+ * free, 1 if held, 2 if held with waiters asleep on it. Buckets have no
+ * queue and no slices of their own. The domain is a fairlock_t that is never
+ * taken and only carries the per-thread accounting, so every thread has one
+ * weight and one banned_until across the table. A thread is charged for the
+ * time it holds at least one bucket, whichever buckets those are, and waits
+ * out its ban before it takes its first one; spreading work over many
+ * buckets earns no more than hammering a single one.
+ *
+ * Buckets are picked by hash modulo the table size, which is rounded up to
+ * a power of two. As in any array of spinlocks, neighbouring buckets share
+ * a cache line.
+ */
+
+#include "fairlock.h"
+
+// The average hold time the adaptive wait policy learns from is only
+// updated on one release in this many per thread.
+#define FAIRLOCK_TABLE_HOLD_SAMPLE 64
+
+typedef struct fairlock_table {
+    int *buckets;
+    size_t mask;
+    fairlock_t domain;
+} fairlock_table_t;
+
+SCL_API int fairlock_table_init(fairlock_table_t *table, size_t nbuckets) {
+    size_t n = 1;
+    int rc;
+
+    while (n < nbuckets)
+        n <<= 1;
+    if (0 != posix_memalign((void **) &table->buckets, CACHELINE, n * sizeof(int)))
+        return ENOMEM;
+    memset(table->buckets, 0, n * sizeof(int));
+    table->mask = n - 1;
+    if (0 != (rc = fairlock_init(&table->domain))) {
+        free(table->buckets);
+        return rc;
+    }
+    return 0;
+}
+
+SCL_API int fairlock_table_destroy(fairlock_table_t *table) {
+    fairlock_destroy(&table->domain);
+    free(table->buckets);
+    return 0;
+}
+
+/*
+ * Set the calling thread's weight across the whole table; 0 derives it
+ * from the thread's scheduling parameters, see fairlock_set_weight().
+ */
+SCL_API void fairlock_table_thread_init(fairlock_table_t *table, int weight) {
+    fairlock_set_weight(&table->domain, weight);
+}
+
+static inline int *fl_table_bucket(fairlock_table_t *table, size_t hash) {
+    return &table->buckets[hash & table->mask];
+}
+
+// Take bucket b: spin while the domain's wait policy says, then sleep on it.
+static void fl_table_bucket_wait(fairlock_table_t *table, int *b, scl_stats_slot_t *stats) {
+    const scl_wait_policy_t *policy = &table->domain.waiting;
+    scl_waiter_t w;
+
+    scl_waiter_init(&w, policy, stats);
+    while (policy->strategy < SCL_WAIT_PARK || scl_waiter_spinning(&w)) {
+        if (0 == readvol(*b) && __sync_bool_compare_and_swap(b, 0, 1))
+            goto out;
+        scl_waiter_pause(&w);
+    }
+    // mark the bucket contended so that its holder wakes us
+    while (0 != __sync_lock_test_and_set(b, 2))
+        scl_waiter_park(&w, b, 2, SCL_NO_DEADLINE);
+out:
+    scl_waiter_done(&w);
+}
+
+static inline void fl_table_start(fairlock_t *domain, flthread_info_t *info) {
+    if (0 == info->held++)
+        fl_start_cs(domain, info, scl_now(), 0);
+    else
+        info->stats->c.acquisitions++;
+}
+
+/*
+ * Take the bucket that hash maps to. A thread that holds no bucket first
+ * waits out its ban; one that already holds a bucket does not, so that it
+ * is never banned in the middle of an operation on several buckets.
+ */
+SCL_API void fairlock_table_acquire(fairlock_table_t *table, size_t hash) {
+    fairlock_t *domain = &table->domain;
+    flthread_info_t *info = fl_info(domain);
+    int *b = fl_table_bucket(table, hash);
+    ull start;
+
+    if (0 == info->held && info->banned)
+        fl_wait_ban(domain, info);
+    if (!__sync_bool_compare_and_swap(b, 0, 1)) {
+        start = scl_now();
+        fl_table_bucket_wait(table, b, info->stats);
+        scl_stats_wait(info->stats, scl_now() - start);
+    }
+    fl_table_start(domain, info);
+}
+
+/*
+ * Take the bucket that hash maps to only if it is free and the caller is
+ * not banned. Returns 0 on success and EBUSY otherwise.
+ */
+SCL_API int fairlock_table_trylock(fairlock_table_t *table, size_t hash) {
+    fairlock_t *domain = &table->domain;
+    flthread_info_t *info = fl_info(domain);
+
+    if (0 == info->held && info->banned && scl_now() < info->banned_until)
+        return EBUSY;
+    if (!__sync_bool_compare_and_swap(fl_table_bucket(table, hash), 0, 1))
+        return EBUSY;
+    fl_table_start(domain, info);
+    return 0;
+}
+
+SCL_API void fairlock_table_release(fairlock_table_t *table, size_t hash) {
+    fairlock_t *domain = &table->domain;
+    flthread_info_t *info = fl_self(domain);
+    int *b = fl_table_bucket(table, hash);
+    ull now;
+
+    if (1 != __sync_fetch_and_sub(b, 1)) {
+        __atomic_store_n(b, 0, __ATOMIC_RELEASE);
+        futex(b, FUTEX_WAKE_PRIVATE, 1, NULL);
+    }
+    if (0 != --info->held)
+        return;
+    now = scl_now();
+    // every holder writing the shared average would bounce its cache line
+    if (0 == info->stats->c.acquisitions % FAIRLOCK_TABLE_HOLD_SAMPLE)
+        scl_wait_policy_hold(&domain->waiting, now - info->start_ticks);
+    fl_account(domain, info, now);
+}
+
+// See fairlock_set_charge(), fairlock_set_wait() and fairlock_set_group().
+// Call before the table is shared.
+SCL_API void fairlock_table_set_charge(fairlock_table_t *table, enum fairlock_charge charge) {
+    fairlock_set_charge(&table->domain, charge);
+}
+
+SCL_API void fairlock_table_set_wait(fairlock_table_t *table, int strategy) {
+    fairlock_set_wait(&table->domain, strategy);
+}
+
+SCL_API void fairlock_table_set_group(fairlock_table_t *table, scl_group_t *group) {
+    fairlock_set_group(&table->domain, group);
+}
+
+/*
+ * Snapshot the domain's counters, see fairlock_stats(). Acquisitions count
+ * buckets, hold times cover the spans in which a thread held any bucket.
+ */
+SCL_API int fairlock_table_stats(fairlock_table_t *table, scl_stats_snapshot_t *snap) {
+    return fairlock_stats(&table->domain, snap);
+}
+
+#endif // __FAIRLOCK_TABLE_H__
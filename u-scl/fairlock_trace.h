@@ -0,0 +1,176 @@
+#ifndef __FAIRLOCK_TRACE_H__
+#define __FAIRLOCK_TRACE_H__
+
+/*
+ * Event trace of u-SCL, compiled in with -DFAIRLOCK_TRACE.
+ *
+ * Every thread records into its own ring of FAIRLOCK_TRACE_EVENTS events,
+ * overwriting the oldest ones, with a plain store of the event and a
+ * release store of the head. fairlock_trace_dump() copies the rings out
+ * while the threads keep running and drops any event that may have been
+ * overwritten during the copy. Rings are never freed, so the trace also
+ * covers threads that have exited.
+ *
+ * The dump is a fl_trace_header_t, then for every thread a
+ * fl_trace_thread_t followed by its events, oldest first, in host byte
+ * order. Timestamps are scl_now() ticks; cycle_per_us in the header
+ * converts them. tools/fltrace.c analyzes dumps.
+ *
+ * This header also describes the format for the analyzer; without
+ * FAIRLOCK_TRACE the hooks compile to nothing.
+ */
+
+#include <stdint.h>
+
+#define FL_TRACE_MAGIC 0x45434152544c4353ULL // "SCLTRACE"
+#define FL_TRACE_VERSION 2
+
+enum fl_trace_type {
+    FL_TRACE_ACQUIRE = 1, // acquire, trylock or timedlock called
+    FL_TRACE_REENTER, // took the lock within its own slice
+    FL_TRACE_BAN_START, // arg: ban left, us
+    FL_TRACE_BAN_END,
+    FL_TRACE_ENQUEUE,
+    FL_TRACE_NEXT, // became next in line
+    FL_TRACE_RUNNING, // took the lock from the queue
+    FL_TRACE_SLICE, // started a slice, arg: slice length, us
+    FL_TRACE_RUNNABLE, // releaser made its successor RUNNABLE
+    FL_TRACE_RELEASE,
+    FL_TRACE_SLICE_END, // releaser gave up the rest of its slice
+    FL_TRACE_ABANDON, // timed wait gave up
+    FL_TRACE_WEIGHT, // arg: weight, logged on joining, on changes and with every slice
+    FL_TRACE_DELEGATED, // the holder ran the thread's request, arg: its length, us
+};
+
+typedef struct fl_trace_event {
+    uint64_t tsc;
+    uint32_t lock; // lock id
+    uint32_t info; // type in the low 8 bits, argument above
+} fl_trace_event_t;
+
+#define fl_trace_type(ev) ((ev)->info & 0xff)
+#define fl_trace_arg(ev) ((ev)->info >> 8)
+#define FL_TRACE_ARG_MAX ((1U << 24) - 1)
+
+typedef struct fl_trace_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t nthreads;
+    uint64_t cycle_per_us;
+} fl_trace_header_t;
+
+typedef struct fl_trace_thread {
+    uint32_t tid;
+    uint32_t nevents;
+    uint64_t dropped; // older events overwritten in the ring or dropped from the dump
+} fl_trace_thread_t;
+
+#ifdef FAIRLOCK_TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "../common/clock.h"
+
+#ifndef FAIRLOCK_TRACE_EVENTS
+#define FAIRLOCK_TRACE_EVENTS (1U << 16)
+#endif
+
+typedef struct fl_trace_ring {
+    uint64_t head __attribute__ ((aligned (64))); // events ever recorded
+    uint32_t tid;
+    struct fl_trace_ring *next;
+    fl_trace_event_t ev[FAIRLOCK_TRACE_EVENTS];
+} fl_trace_ring_t;
+
+SCL_SHARED fl_trace_ring_t *fl_trace_rings;
+SCL_SHARED_TLS fl_trace_ring_t *fl_trace_self;
+
+static fl_trace_ring_t *fl_trace_ring_create(void) {
+    fl_trace_ring_t *r;
+
+    if (0 != posix_memalign((void **) &r, 64, sizeof(fl_trace_ring_t)))
+        return NULL;
+    r->head = 0;
+    r->tid = syscall(SYS_gettid);
+    do {
+        r->next = fl_trace_rings;
+    } while (!__sync_bool_compare_and_swap(&fl_trace_rings, r->next, r));
+    return fl_trace_self = r;
+}
+
+static inline void fl_trace_event(unsigned int lock, int type, unsigned long long arg) {
+    fl_trace_ring_t *r = fl_trace_self;
+    fl_trace_event_t *ev;
+    uint64_t h;
+
+    if (__builtin_expect(NULL == r, 0) && NULL == (r = fl_trace_ring_create()))
+        return;
+    h = r->head;
+    ev = &r->ev[h & (FAIRLOCK_TRACE_EVENTS - 1)];
+    ev->tsc = scl_now();
+    ev->lock = lock;
+    ev->info = type | (arg > FL_TRACE_ARG_MAX ? FL_TRACE_ARG_MAX : arg) << 8;
+    __atomic_store_n(&r->head, h + 1, __ATOMIC_RELEASE);
+}
+
+#define fl_trace(lock, type, arg) fl_trace_event((lock)->id, (type), (arg))
+
+/*
+ * Write every thread's events to path. Safe to call while the locks are in
+ * use. Returns 0 or an errno value.
+ */
+SCL_API int fairlock_trace_dump(const char *path) {
+    fl_trace_header_t hdr = { FL_TRACE_MAGIC, FL_TRACE_VERSION, 0, CYCLE_PER_US };
+    fl_trace_event_t *buf;
+    fl_trace_ring_t *rings, *r;
+    FILE *f;
+    int rc = 0;
+
+    if (NULL == (buf = malloc(FAIRLOCK_TRACE_EVENTS * sizeof(fl_trace_event_t))))
+        return ENOMEM;
+    if (NULL == (f = fopen(path, "wb"))) {
+        rc = errno;
+        free(buf);
+        return rc;
+    }
+    // rings are only pushed at the front, so the list from rings on is stable
+    rings = __atomic_load_n(&fl_trace_rings, __ATOMIC_ACQUIRE);
+    for (r = rings; NULL != r; r = r->next)
+        hdr.nthreads++;
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    for (r = rings; NULL != r; r = r->next) {
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE), from, i, valid;
+        fl_trace_thread_t th = { r->tid, 0, 0 };
+
+        from = head > FAIRLOCK_TRACE_EVENTS ? head - FAIRLOCK_TRACE_EVENTS : 0;
+        for (i = from; i < head; i++)
+            buf[i - from] = r->ev[i & (FAIRLOCK_TRACE_EVENTS - 1)];
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        // the event after the new head may be half written as well
+        valid = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) + 1;
+        valid = valid > FAIRLOCK_TRACE_EVENTS ? valid - FAIRLOCK_TRACE_EVENTS : 0;
+        if (valid < from)
+            valid = from;
+        if (valid > head)
+            valid = head;
+        th.nevents = head - valid;
+        th.dropped = valid;
+        fwrite(&th, sizeof(th), 1, f);
+        fwrite(buf + (valid - from), sizeof(fl_trace_event_t), th.nevents, f);
+    }
+    if (0 != fclose(f))
+        rc = errno;
+    free(buf);
+    return rc;
+}
+
+#else
+
+#define fl_trace(lock, type, arg) do { } while (0)
+
+#endif // FAIRLOCK_TRACE
+
+#endif // __FAIRLOCK_TRACE_H__
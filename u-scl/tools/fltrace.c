@@ -0,0 +1,381 @@
+/*
+ * Offline analyzer for u-SCL event traces (see fairlock_trace.h).
+ *
+ *     fltrace [-j out.json] trace.bin
+ *
+ * Rebuilds every lock's timeline from the per-thread rings and prints, per
+ * lock and thread, acquisitions, slices, hold, wait and ban times and the
+ * lock opportunity: the time the thread held the lock, plus the time the
+ * lock sat idle while the thread owned the slice, plus idle time with no
+ * slice in force, which any thread could have used. Jain's fairness index
+ * is computed over lock opportunity divided by weight. Handoff gaps are the
+ * times from a release to the next queued thread taking the lock. With -j
+ * the timelines are also written as Chrome trace JSON, which Perfetto and
+ * chrome://tracing load.
+ *
+ * The rings overwrite their oldest events, so the analysis starts at the
+ * latest first event of any ring that lost events, before which some
+ * threads' timelines would be missing; intervals cut off at the start are
+ * skipped. Weights are logged with every slice, and a thread's first logged
+ * weight on a lock also stands for the time before it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../fairlock_trace.h"
+
+#define DEFAULT_WEIGHT 1024
+
+typedef struct event {
+    fl_trace_event_t ev;
+    int thread;
+} event_t;
+
+typedef struct thread_state {
+    uint64_t weight;
+    uint64_t acquire; // wait start, pushed back by bans; 0 if not acquiring
+    uint64_t acquire_raw;
+    uint64_t ban_start;
+    uint64_t hold_start;
+    uint64_t acquisitions;
+    uint64_t slices;
+    uint64_t abandons;
+    uint64_t hold;
+    uint64_t wait;
+    uint64_t ban;
+    uint64_t opportunity;
+    int seen;
+} thread_state_t;
+
+static uint32_t *tids;
+static int nthreads;
+static double cycle_per_us;
+static FILE *json;
+static int json_first = 1;
+static uint64_t json_origin;
+
+static int cmp_event(const void *a, const void *b) {
+    const event_t *x = a, *y = b;
+
+    if (x->ev.lock != y->ev.lock)
+        return x->ev.lock < y->ev.lock ? -1 : 1;
+    if (x->ev.tsc != y->ev.tsc)
+        return x->ev.tsc < y->ev.tsc ? -1 : 1;
+    return 0;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double us(uint64_t ticks) {
+    return ticks / cycle_per_us;
+}
+
+static void json_sep(void) {
+    fputs(json_first ? "\n" : ",\n", json);
+    json_first = 0;
+}
+
+static void json_span(uint32_t lock, uint32_t tid, const char *name, uint64_t from, uint64_t to) {
+    if (NULL == json || 0 == from || to < from)
+        return;
+    json_sep();
+    fprintf(json, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+            name, lock, tid, us(from - json_origin), us(to - from));
+}
+
+static void json_instant(uint32_t lock, uint32_t tid, const char *name, uint64_t at) {
+    if (NULL == json)
+        return;
+    json_sep();
+    fprintf(json, "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f}",
+            name, lock, tid, us(at - json_origin));
+}
+
+static void json_name(uint32_t lock, uint32_t tid, const char *kind, const char *fmt, uint32_t id) {
+    if (NULL == json)
+        return;
+    json_sep();
+    fprintf(json, "{\"name\":\"%s\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":\"", kind, lock, tid);
+    fprintf(json, fmt, id);
+    fputs("\"}}", json);
+}
+
+// Analyze the events of one lock, sorted by time.
+static void analyze_lock(event_t *evs, size_t n) {
+    uint32_t lock = evs[0].ev.lock;
+    thread_state_t *ts = calloc(nthreads, sizeof(thread_state_t));
+    uint64_t *gaps = malloc(n * sizeof(uint64_t));
+    uint64_t prev = evs[0].ev.tsc, last_release = 0, slice_end = 0, slice_start = 0;
+    uint64_t free_idle = 0, gap_sum = 0;
+    int holder = -1, last_holder = -1, slice_owner = -1, nseen = 0;
+    size_t ngaps = 0, i;
+    double sum = 0, sum2 = 0, weights = 0;
+
+    if (NULL == ts || NULL == gaps) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < (size_t) nthreads; i++)
+        ts[i].weight = 0;
+    // the weight a thread had before its first logged change is unknown
+    for (i = 0; i < n; i++) {
+        thread_state_t *s = &ts[evs[i].thread];
+        if (FL_TRACE_WEIGHT == fl_trace_type(&evs[i].ev) && 0 == s->weight)
+            s->weight = fl_trace_arg(&evs[i].ev) ? fl_trace_arg(&evs[i].ev) : DEFAULT_WEIGHT;
+    }
+    for (i = 0; i < (size_t) nthreads; i++) {
+        if (0 == ts[i].weight)
+            ts[i].weight = DEFAULT_WEIGHT;
+    }
+    json_name(lock, 0, "process_name", "lock %u", lock);
+    json_name(lock, 0, "thread_name", "slices", 0);
+
+    for (i = 0; i < n; i++) {
+        fl_trace_event_t *ev = &evs[i].ev;
+        int t = evs[i].thread;
+        thread_state_t *s = &ts[t];
+        uint64_t now = ev->tsc, dt = now - prev;
+
+        // hand out the time since the previous event
+        if (holder >= 0) {
+            ts[holder].opportunity += dt;
+        } else if (slice_owner >= 0 && prev < slice_end) {
+            uint64_t owned = slice_end - prev < dt ? slice_end - prev : dt;
+            ts[slice_owner].opportunity += owned;
+            free_idle += dt - owned;
+        } else {
+            free_idle += dt;
+        }
+        prev = now;
+        if (!s->seen) {
+            s->seen = 1;
+            nseen++;
+            json_name(lock, tids[t], "thread_name", "tid %u", tids[t]);
+        }
+
+        switch (fl_trace_type(ev)) {
+        case FL_TRACE_ACQUIRE:
+            s->acquire = s->acquire_raw = now;
+            break;
+        case FL_TRACE_BAN_START:
+            s->ban_start = now;
+            break;
+        case FL_TRACE_BAN_END:
+            if (s->ban_start) {
+                s->ban += now - s->ban_start;
+                if (s->acquire)
+                    s->acquire += now - s->ban_start;
+                json_span(lock, tids[t], "ban", s->ban_start, now);
+            }
+            s->ban_start = 0;
+            break;
+        case FL_TRACE_RUNNING:
+            if (last_release && last_holder != t) {
+                gaps[ngaps++] = now - last_release;
+                gap_sum += now - last_release;
+            }
+            // fall through
+        case FL_TRACE_REENTER:
+            if (s->acquire)
+                s->wait += now - s->acquire;
+            json_span(lock, tids[t], "wait", s->acquire_raw, now);
+            s->acquire = s->acquire_raw = 0;
+            s->acquisitions++;
+            s->hold_start = now;
+            holder = t;
+            break;
+        case FL_TRACE_SLICE:
+            if (slice_owner >= 0)
+                json_span(lock, 0, "slice", slice_start, slice_end < now ? slice_end : now);
+            slice_owner = t;
+            slice_start = now;
+            slice_end = now + (uint64_t) (fl_trace_arg(ev) * cycle_per_us);
+            s->slices++;
+            break;
+        case FL_TRACE_SLICE_END:
+            if (slice_owner == t && slice_end > now)
+                slice_end = now;
+            break;
+        case FL_TRACE_RELEASE:
+            if (holder == t && s->hold_start) {
+                s->hold += now - s->hold_start;
+                json_span(lock, tids[t], "hold", s->hold_start, now);
+            }
+            s->hold_start = 0;
+            holder = -1;
+            last_holder = t;
+            last_release = now;
+            break;
+        case FL_TRACE_ABANDON:
+            json_span(lock, tids[t], "wait", s->acquire_raw, now);
+            json_instant(lock, tids[t], "abandon", now);
+            s->acquire = s->acquire_raw = 0;
+            s->abandons++;
+            break;
+        case FL_TRACE_DELEGATED:
+            // the holder ran the request, within its own hold
+            if (s->acquire)
+                s->wait += now - s->acquire;
+            json_span(lock, tids[t], "wait", s->acquire_raw, now);
+            json_instant(lock, tids[t], "delegated", now);
+            s->acquire = s->acquire_raw = 0;
+            s->acquisitions++;
+            break;
+        case FL_TRACE_WEIGHT:
+            s->weight = fl_trace_arg(ev) ? fl_trace_arg(ev) : DEFAULT_WEIGHT;
+            break;
+        case FL_TRACE_ENQUEUE:
+            json_instant(lock, tids[t], "enqueue", now);
+            break;
+        case FL_TRACE_NEXT:
+            json_instant(lock, tids[t], "next", now);
+            break;
+        case FL_TRACE_RUNNABLE:
+            json_instant(lock, tids[t], "runnable", now);
+            break;
+        }
+    }
+    if (slice_owner >= 0)
+        json_span(lock, 0, "slice", slice_start, slice_end < prev ? slice_end : prev);
+
+    printf("lock %u: %.3f ms, %zu events\n", lock, us(prev - evs[0].ev.tsc) / 1000, n);
+    printf("%8s %7s %10s %8s %8s %10s %10s %10s %10s %9s %9s\n", "tid", "weight", "acquires",
+           "slices", "abandons", "hold(ms)", "wait(ms)", "ban(ms)", "opp(ms)", "entitled", "opp");
+    for (i = 0; i < (size_t) nthreads; i++) {
+        if (ts[i].seen)
+            weights += ts[i].weight;
+    }
+    for (i = 0; i < (size_t) nthreads; i++) {
+        thread_state_t *s = &ts[i];
+        double x, total;
+        if (!s->seen)
+            continue;
+        // idle time with no slice in force was open to everyone
+        s->opportunity += free_idle;
+        total = prev - evs[0].ev.tsc;
+        x = (double) s->opportunity / s->weight;
+        sum += x;
+        sum2 += x * x;
+        printf("%8u %7llu %10llu %8llu %8llu %10.3f %10.3f %10.3f %10.3f %9.3f %9.3f\n", tids[i],
+               (unsigned long long) s->weight, (unsigned long long) s->acquisitions,
+               (unsigned long long) s->slices, (unsigned long long) s->abandons,
+               us(s->hold) / 1000, us(s->wait) / 1000, us(s->ban) / 1000,
+               us(s->opportunity) / 1000, s->weight / weights,
+               total > 0 ? s->opportunity / total : 0);
+    }
+    printf("jain's fairness index (opportunity / weight): %.4f\n",
+           sum2 > 0 ? sum * sum / (nseen * sum2) : 1.0);
+    if (ngaps > 0) {
+        qsort(gaps, ngaps, sizeof(uint64_t), cmp_u64);
+        printf("handoff gaps (us): n %zu avg %.3f p50 %.3f p99 %.3f max %.3f\n", ngaps,
+               us(gap_sum) / ngaps, us(gaps[ngaps / 2]), us(gaps[ngaps * 99 / 100]),
+               us(gaps[ngaps - 1]));
+    }
+    printf("\n");
+    free(gaps);
+    free(ts);
+}
+
+int main(int argc, char **argv) {
+    fl_trace_header_t hdr;
+    event_t *evs = NULL;
+    size_t nevs = 0, i, start, kept;
+    uint64_t window = 0;
+    const char *json_path = NULL;
+    FILE *f;
+    int opt;
+
+    while (-1 != (opt = getopt(argc, argv, "j:"))) {
+        switch (opt) {
+        case 'j':
+            json_path = optarg;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind + 1 != argc)
+        goto usage;
+    if (NULL == (f = fopen(argv[optind], "rb"))) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (1 != fread(&hdr, sizeof(hdr), 1, f) || FL_TRACE_MAGIC != hdr.magic ||
+            FL_TRACE_VERSION != hdr.version || 0 == hdr.cycle_per_us) {
+        fprintf(stderr, "%s: not a u-SCL trace\n", argv[optind]);
+        return 1;
+    }
+    cycle_per_us = hdr.cycle_per_us;
+    nthreads = hdr.nthreads;
+    tids = calloc(nthreads ? nthreads : 1, sizeof(uint32_t));
+    for (int t = 0; t < nthreads; t++) {
+        fl_trace_thread_t th;
+        event_t *tmp;
+        if (1 != fread(&th, sizeof(th), 1, f))
+            goto truncated;
+        tids[t] = th.tid;
+        if (NULL == (tmp = realloc(evs, (nevs + th.nevents) * sizeof(event_t)))) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        evs = tmp;
+        for (i = 0; i < th.nevents; i++) {
+            if (1 != fread(&evs[nevs + i].ev, sizeof(fl_trace_event_t), 1, f))
+                goto truncated;
+            evs[nevs + i].thread = t;
+        }
+        // before its oldest event, this ring no longer tells what the thread did
+        if (th.dropped > 0 && th.nevents > 0 && evs[nevs].ev.tsc > window)
+            window = evs[nevs].ev.tsc;
+        nevs += th.nevents;
+    }
+    fclose(f);
+    for (i = kept = 0; i < nevs; i++) {
+        if (evs[i].ev.tsc >= window)
+            evs[kept++] = evs[i];
+    }
+    nevs = kept;
+    if (0 == nevs) {
+        printf("no events\n");
+        return 0;
+    }
+    qsort(evs, nevs, sizeof(event_t), cmp_event);
+
+    if (NULL != json_path) {
+        if (NULL == (json = fopen(json_path, "w"))) {
+            perror(json_path);
+            return 1;
+        }
+        json_origin = evs[0].ev.tsc;
+        for (i = 1; i < nevs; i++) {
+            if (evs[i].ev.tsc < json_origin)
+                json_origin = evs[i].ev.tsc;
+        }
+        fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", json);
+    }
+    for (start = 0, i = 1; i <= nevs; i++) {
+        if (i == nevs || evs[i].ev.lock != evs[start].ev.lock) {
+            analyze_lock(evs + start, i - start);
+            start = i;
+        }
+    }
+    if (NULL != json) {
+        fputs("\n]}\n", json);
+        fclose(json);
+    }
+    free(evs);
+    free(tids);
+    return 0;
+
+truncated:
+    fprintf(stderr, "%s: truncated trace\n", argv[optind]);
+    return 1;
+usage:
+    fprintf(stderr, "usage: %s [-j out.json] trace.bin\n", argv[0]);
+    return 1;
+}